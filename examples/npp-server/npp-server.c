@@ -81,7 +81,7 @@ static void *
 com_android_npp_thread(void *arg)
 {
   struct llc_connection *connection = (struct llc_connection *) arg;
-  uint8_t buffer[1024];
+  uint8_t buffer[connection->local_miu];
 
   int len;
   if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) < 0)
@@ -113,7 +113,7 @@ com_android_npp_thread(void *arg)
   if ((len - n) < ndef_length)
     return NULL; // Less received bytes than expected ?
 
-  char ndef_msg[1024];
+  char ndef_msg[4 * ndef_length + 1];
   shexdump(ndef_msg, buffer + n, ndef_length);
   fprintf(info_stream, "NDEF entry received (%u bytes): %s\n", ndef_length, ndef_msg);
 
@@ -104,7 +104,7 @@ com_android_snep_service(void *arg)
     0x0b, 0x55, 0x03, 0x6c, 0x69, 0x62, 0x6e, 0x66, 0x63, 0x2e,
     0x6f, 0x72, 0x67
   };
-  uint8_t buf[1024];
+  uint8_t buf[connection->local_miu];
   int ret;
   uint8_t ssap;
 
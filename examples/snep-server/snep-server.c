@@ -83,7 +83,7 @@ static void *
 com_android_snep_thread(void *arg)
 {
   struct llc_connection *connection = (struct llc_connection *) arg;
-  uint8_t buffer[1024], frame[1024];
+  uint8_t buffer[connection->local_miu], frame[6];
 
   int len;
   if ((len = llc_connection_recv(connection, buffer, sizeof(buffer), NULL)) < 0)
@@ -106,8 +106,10 @@ com_android_snep_thread(void *arg)
       break;
     case 0x02:      /** PUT */
       {
+        if (len < 6)
+          return NULL; // Truncated SNEP header
         uint32_t ndef_length = be32toh(*((uint32_t *)(buffer + 2)));  // NDEF length
-        if ((len - 6) < ndef_length)
+        if (ndef_length > (uint32_t)(len - 6))
           return NULL; // Less received bytes than expected ?
 
         /** return snep success response package */
@@ -119,7 +121,9 @@ com_android_snep_thread(void *arg)
         frame[5] = 0;
         llc_connection_send(connection, frame, 6);
 
-        char ndef_msg[1024];
+        // ndef_length is bounded by the received bytes, at most LLCP_MAX_MIU
+        char ndef_msg[4 * LLCP_MAX_MIU + 1];
+        ndef_msg[0] = '\0';
         shexdump(ndef_msg, buffer + 6, ndef_length);
         fprintf(info_stream, "NDEF message received (%u bytes): %s\n", ndef_length, ndef_msg);
 
@@ -28,6 +28,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <mqueue.h>
+#if defined(__linux__)
+#  include <poll.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,11 +43,18 @@
 #include "llcp_log.h"
 #include "llcp_pdu.h"
 #include "llcp_parameters.h"
+#include "llcp_pool.h"
 
 #define LOG_LLC_CONNECTION "libllcp.llc.connection"
 #define LLC_CONNECTION_MSG(priority, message) llcp_log_log (LOG_LLC_CONNECTION, priority, "%s", message)
 #define LLC_CONNECTION_LOG(priority, format, ...) llcp_log_log (LOG_LLC_CONNECTION, priority, format, __VA_ARGS__)
 
+/* Time a blocked sender waits before checking its connection again (ms) */
+#define LLC_CONNECTION_SEND_POLL 10
+
+/* The remote URI of a connection is kept in the same block */
+LLCP_POOL(llc_connection_pool, sizeof(struct llc_connection) + LLCP_STATIC_URI_SIZE, LLCP_STATIC_CONNECTIONS);
+
 struct llc_connection *llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap);
 
 struct llc_connection *
@@ -53,7 +63,7 @@ llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap)
 
   struct llc_connection *res;
 
-  if ((res = malloc(sizeof *res))) {
+  if ((res = llcp_pool_new(llc_connection_pool, sizeof *res))) {
     res->link = link;
     res->thread = 0;
     res->service_sap = local_sap;
@@ -61,6 +71,17 @@ llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap)
     res->remote_sap = remote_sap;
     res->remote_uri = NULL;
     res->status = DLC_DISCONNECTED;
+    if (pthread_mutex_init(&res->status_lock, NULL) != 0) {
+      LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot initialize status mutex");
+      llcp_pool_delete(llc_connection_pool, res);
+      return NULL;
+    }
+    if (pthread_cond_init(&res->status_changed, NULL) != 0) {
+      LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot initialize status condition");
+      pthread_mutex_destroy(&res->status_lock);
+      llcp_pool_delete(llc_connection_pool, res);
+      return NULL;
+    }
 
     res->state.s  = 0;
     res->state.sa = 0;
@@ -70,9 +91,20 @@ llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap)
     res->remote_miu = LLCP_DEFAULT_MIU;
     res->rwr = LLCP_DEFAULT_RW;
     res->rwl = LLCP_DEFAULT_RW;
-
-    res->mq_up_name   = NULL;
-    res->mq_down_name = NULL;
+    res->remote_busy = 0;
+    res->local_busy = 0;
+    res->high_watermark = 0;
+    res->low_watermark = 0;
+    res->busy.count = 0;
+    res->busy.time = 0;
+    res->consumption.bytes = 0;
+    res->consumption.pdus = 0;
+    res->consumption.busy = 0;
+    res->consumption.received.tv_sec = 0;
+    res->consumption.received.tv_nsec = 0;
+
+    res->mq_up_name[0]   = '\0';
+    res->mq_down_name[0] = '\0';
     res->llc_up   = (mqd_t) - 1;
     res->llc_down = (mqd_t) - 1;
 
@@ -84,36 +116,109 @@ llc_connection_new(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap)
   return res;
 }
 
+/*
+ * Size the receive window of a Data Link Connection.  The up queue holds two
+ * windows, so the window is bounded by half the service receive buffer and
+ * RW.  When the service consumption is known, it is further limited to the
+ * PDUs the application can consume during a link turnaround: fast consumers
+ * get large windows, slow ones get small windows and stop the remote LLC
+ * early.
+ */
+static void
+llc_connection_size_receive_window(struct llc_connection *connection)
+{
+  const struct llc_service *service = connection->link->available_services[connection->service_sap];
+  size_t window;
+
+  window = service->receive_buffer / (2 * (3 + connection->local_miu));
+  window = MIN(window, service->rw);
+
+  uint64_t turnaround = (connection->link->local_lto.tv_sec + connection->link->remote_lto.tv_sec) * 1000000 +
+                        connection->link->local_lto.tv_usec + connection->link->remote_lto.tv_usec;
+  if (service->consumption.rate && turnaround) {
+    uint16_t size = service->consumption.size ? service->consumption.size : connection->local_miu;
+    uint64_t consumed = (uint64_t) service->consumption.rate * turnaround / 1000000 / size;
+
+    window = MIN(window, 1 + consumed);
+  }
+
+  connection->rwl = MAX(1, MIN(window, LLCP_MAX_RW));
+  LLC_CONNECTION_LOG(LLC_PRIORITY_DEBUG, "Data Link Connection [%d -> %d] receive window: %d", connection->local_sap, connection->remote_sap, connection->rwl);
+}
+
+/*
+ * Fold what was observed on a connection into its service consumption
+ * estimate, for sizing the receive window of the next connections.
+ */
+static void
+llc_connection_update_consumption(struct llc_connection *connection)
+{
+  struct llc_service *service;
+
+  if (connection->consumption.pdus < 2)
+    return;
+  if (!connection->link || !(service = connection->link->available_services[connection->service_sap]))
+    return;
+
+  uint64_t rate = UINT32_MAX;
+  if (connection->consumption.busy)
+    rate = MIN(rate, connection->consumption.bytes * 1000000000ULL / connection->consumption.busy);
+  uint16_t size = connection->consumption.bytes / connection->consumption.pdus;
+
+  if (service->consumption.rate) {
+    service->consumption.rate = (3ULL * service->consumption.rate + rate) / 4;
+    service->consumption.size = (3 * service->consumption.size + size) / 4;
+  } else {
+    service->consumption.rate = rate;
+    service->consumption.size = size;
+  }
+}
+
 int
 llc_connection_start(struct llc_connection *connection)
 {
   assert(connection);
 
+  /*
+   * The up queue holds two receive windows: one the service has not read
+   * yet and one the remote LLC may send once we acknowledged it.  Fall back
+   * to a smaller window if the system does not allow that many messages.
+   */
   struct mq_attr attr_up = {
     .mq_msgsize = 3 + connection->local_miu,
-    .mq_maxmsg  = 2,
+    .mq_maxmsg  = 2 * MAX(1, connection->rwl),
   };
 
-  if (asprintf(&connection->mq_up_name, "/libllcp-%d-%p-%s", getpid(), (void *) connection, "up") < 0) {
-    LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot print to allocated string");
-    return -1;
+  snprintf(connection->mq_up_name, sizeof(connection->mq_up_name), "/libllcp-%d-%p-%s", getpid(), (void *) connection, "up");
+  while (((connection->llc_up = mq_open(connection->mq_up_name, O_RDWR | O_CREAT, 0666, &attr_up)) == (mqd_t) - 1) &&
+         (errno == EINVAL) && (attr_up.mq_maxmsg > 2)) {
+    attr_up.mq_maxmsg--;
+    connection->rwl = MIN(connection->rwl, attr_up.mq_maxmsg / 2);
   }
-  connection->llc_up = mq_open(connection->mq_up_name, O_RDWR | O_CREAT, 0666, &attr_up);
   if (connection->llc_up == (mqd_t) - 1) {
     LLC_CONNECTION_LOG(LLC_PRIORITY_FATAL, "Cannot open message queue '%s'", connection->mq_up_name);
     llc_connection_free(connection);
     return -1;
   }
 
+  /*
+   * Once we acknowledge received PDUs, the remote LLC may send a whole
+   * window more: only do so while that still fits in the up queue.
+   */
+  connection->high_watermark = attr_up.mq_maxmsg - connection->rwl + 1;
+  connection->low_watermark = connection->high_watermark / 2;
+
+  /*
+   * The remote MIU of outgoing connections is only known once the CC PDU is
+   * received, so the down queue is sized for the largest PDU.  PDUs are
+   * checked against the remote MIU when they are enqueued.
+   */
   struct mq_attr attr_down = {
-    .mq_msgsize = 3 + connection->remote_miu,
+    .mq_msgsize = LLCP_MAX_PDU_SIZE,
     .mq_maxmsg  = 2,
   };
 
-  if (asprintf(&connection->mq_down_name, "/libllcp-%d-%p-%s", getpid(), (void *) connection, "down") < 0) {
-    LLC_CONNECTION_MSG(LLC_PRIORITY_FATAL, "Cannot print to allocated string");
-    return -1;
-  }
+  snprintf(connection->mq_down_name, sizeof(connection->mq_down_name), "/libllcp-%d-%p-%s", getpid(), (void *) connection, "down");
   connection->llc_down = mq_open(connection->mq_down_name, O_RDWR | O_CREAT | O_NONBLOCK, 0666, &attr_down);
   if (connection->llc_down == (mqd_t) - 1) {
     LLC_CONNECTION_LOG(LLC_PRIORITY_FATAL, "Cannot open message queue '%s'", connection->mq_down_name);
@@ -132,57 +237,35 @@ llc_data_link_connection_new(struct llc_link *link, const struct pdu *pdu, int *
 
   struct llc_connection *res;
 
-  char sn[BUFSIZ];
+  struct llcp_parameters params;
   int8_t service_sap = pdu->dsap;
-  uint16_t miux, miu = LLCP_DEFAULT_MIU;
+  uint16_t miu = LLCP_DEFAULT_MIU;
   uint8_t rw = 2;
 
   *reason = -1;
 
-  size_t offset = 0;
-  while (offset < pdu->information_size) {
-    if (offset > pdu->information_size - 2) {
-      LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV field in parameters list");
-      return NULL;
-    }
-    if (offset + 2 + pdu->information[offset + 1] > pdu->information_size) {
-      LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Incomplete TLV value in parameters list (expected %d bytes but only %d left)", pdu->information[offset + 1], pdu->information_size - (offset + 2));
-      return NULL;
-    }
-    switch (pdu->information[offset]) {
-      case LLCP_PARAMETER_MIUX:
-        if (parameter_decode_miux(pdu->information + offset, 2 + pdu->information[offset + 1], &miux) < 0) {
-          LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Invalid MIUX parameter");
-          return NULL;
-        }
-        miu = 128 + miux;
-        break;
-      case LLCP_PARAMETER_RW:
-        if (parameter_decode_rw(pdu->information + offset, 2 + pdu->information[offset + 1], &rw) < 0) {
-          LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Invalid RW parameter");
-          return NULL;
-        }
-        break;
-      case LLCP_PARAMETER_SN:
-        if (parameter_decode_sn(pdu->information + offset, 2 + pdu->information[offset + 1], sn, sizeof(sn)) < 0) {
-          LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Invalid SN parameter");
-          return NULL;
-        }
-        if (pdu->dsap == 0x01) {
-          service_sap = llc_link_find_sap_by_uri(link, sn);
-          if (!service_sap) {
-            *reason = 0x02;
-            return NULL;
-          }
-        } else {
-          LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Ignoring SN parameter (DSAP is %d, not 1)", pdu->dsap);
-        }
-        break;
-      default:
-        LLC_CONNECTION_LOG(LLC_PRIORITY_INFO, "Unknown TLV Field 0x%02x (length: %d)",
-                           pdu->information[offset], pdu->information[offset + 1]);
+  if (parameters_decode(pdu->information, pdu->information_size, &params) < 0) {
+    LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Invalid TLV parameters list");
+    return NULL;
+  }
+
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_MIUX))
+    miu = 128 + params.miux;
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_RW))
+    rw = params.rw;
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_SN)) {
+    if (pdu->dsap == 0x01) {
+      char sn[UINT8_MAX + 1];
+      memcpy(sn, params.sn, params.sn_len);
+      sn[params.sn_len] = '\0';
+      service_sap = llc_link_find_sap_by_uri(link, sn);
+      if (!service_sap) {
+        *reason = 0x02;
+        return NULL;
+      }
+    } else {
+      LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Ignoring SN parameter (DSAP is %d, not 1)", pdu->dsap);
     }
-    offset += 2 + pdu->information[offset + 1];
   }
 
   if (!link->available_services[service_sap]) {
@@ -207,6 +290,7 @@ llc_data_link_connection_new(struct llc_link *link, const struct pdu *pdu, int *
     res->rwr = rw;
     res->remote_miu = miu;
     res->local_miu  = link->available_services[service_sap]->miu;
+    llc_connection_size_receive_window(res);
 
     if (llc_connection_start(res) < 0) {
       llc_connection_free(res);
@@ -228,6 +312,7 @@ llc_outgoing_data_link_connection_new(struct llc_link *link, uint8_t local_sap,
     //res->rwr = rw;
     //res->remote_miu = miu;
     res->local_miu  = link->available_services[local_sap]->miu;
+    llc_connection_size_receive_window(res);
 
     if (llc_connection_start(res) < 0) {
       llc_connection_free(res);
@@ -242,6 +327,18 @@ struct llc_connection *
 llc_outgoing_data_link_connection_new_by_uri(struct llc_link *link, uint8_t local_sap, const char *remote_uri) {
   struct llc_connection *res;
 
+  /* Connect directly to services resolved by llc_link_resolve_uris() */
+  int remote_sap = llc_link_resolved_sap(link, remote_uri);
+  switch (remote_sap) {
+    case -1:
+      break;
+    case 0:
+      LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Remote service '%s' is not available", remote_uri);
+      return NULL;
+    default:
+      return llc_outgoing_data_link_connection_new(link, local_sap, remote_sap);
+  }
+
   if ((res = llc_connection_new(link, local_sap, 1))) {
     link->transmission_handlers[local_sap] = res;
     res->service_sap = local_sap;
@@ -249,7 +346,18 @@ llc_outgoing_data_link_connection_new_by_uri(struct llc_link *link, uint8_t loca
     //res->rwr = rw;
     //res->remote_miu = miu;
     res->local_miu  = link->available_services[local_sap]->miu;
-    res->remote_uri = strdup(remote_uri);
+    llc_connection_size_receive_window(res);
+#if defined(LLCP_STATIC_ALLOCATION)
+    if (strlen(remote_uri) >= LLCP_STATIC_URI_SIZE) {
+      LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Service name too long: '%s'", remote_uri);
+      link->transmission_handlers[local_sap] = NULL;
+      llc_connection_free(res);
+      return NULL;
+    }
+    res->remote_uri = strcpy((char *)(res + 1), remote_uri);
+#else
+    res->remote_uri = llcp_strdup(remote_uri);
+#endif
 
     if (llc_connection_start(res) < 0) {
       llc_connection_free(res);
@@ -266,22 +374,24 @@ llc_logical_data_link_new(struct llc_link *link, const struct pdu *pdu) {
   assert(pdu);
 
   struct llc_connection *res;
-  uint8_t sap = 0;
 
   if (!link->available_services[pdu->dsap]) {
     return NULL;
   }
 
-  while (link->datagram_handlers[sap] && (sap <= MAX_LOGICAL_DATA_LINK))
-    sap++;
-
-  if (sap > MAX_LOGICAL_DATA_LINK) {
-    LLC_CONNECTION_MSG(LLC_PRIORITY_CRIT, "No place left for new Logical Data Link");
+  if (link->datagram_handlers[pdu->dsap]) {
+    LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Logical Data Link on SAP %d already exists", pdu->dsap);
     return NULL;
   }
 
-  if ((res = llc_connection_new(link, pdu->dsap, pdu->ssap))) {
-    link->datagram_handlers[sap] = res;
+  /* The Logical Data Link receives the UI PDUs of any remote SAP */
+  if ((res = llc_connection_new(link, pdu->dsap, 0))) {
+    link->datagram_handlers[pdu->dsap] = res;
+    /* UI PDUs are only limited by the link MIU */
+    res->local_miu = link->local_miu;
+    res->remote_miu = link->remote_miu;
+    /* Queue as many of them as the service receive buffer holds */
+    llc_connection_size_receive_window(res);
 
     if (llc_connection_start(res) < 0) {
       llc_connection_free(res);
@@ -298,10 +408,16 @@ llc_connection_connect(struct llc_connection *connection)
   assert(connection);
   assert(connection->link);
 
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[(2 + UINT8_MAX) + 3];    /* SN and RW parameters */
   size_t len = 0;
+  int r;
   if (connection->remote_uri) {
-    int r = parameter_encode_sn(buffer, sizeof(buffer) - len, connection->remote_uri);
+    r = parameter_encode_sn(buffer, sizeof(buffer) - len, connection->remote_uri);
+    if (r >= 0)
+      len += r;
+  }
+  if (connection->rwl != LLCP_DEFAULT_RW) {
+    r = parameter_encode_rw(buffer + len, sizeof(buffer) - len, connection->rwl);
     if (r >= 0)
       len += r;
   }
@@ -312,7 +428,7 @@ llc_connection_connect(struct llc_connection *connection)
 
   if (res >= 0) {
     connection->link->transmission_handlers[connection->local_sap] = connection;
-    connection->status = DLC_NEW;
+    llc_connection_set_status(connection, DLC_NEW);
     res = llc_connection_start(connection);
   }
 
@@ -326,8 +442,8 @@ llc_connection_accept(struct llc_connection *connection)
 
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accepted", connection->local_sap, connection->remote_sap);
 
-  connection->status = DLC_ACCEPTED;
   connection->thread = 0;
+  llc_connection_set_status(connection, DLC_ACCEPTED);
   pthread_exit(NULL);
 }
 
@@ -338,11 +454,31 @@ llc_connection_reject(struct llc_connection *connection)
 
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] rejected", connection->local_sap, connection->remote_sap);
 
-  connection->status = DLC_REJECTED;
   connection->thread = 0;
+  llc_connection_set_status(connection, DLC_REJECTED);
   pthread_exit(NULL);
 }
 
+static void
+llc_connection_wait_down_queue(struct llc_connection *connection)
+{
+#if defined(__linux__)
+  /* Message queue descriptors are file descriptors on Linux */
+  struct pollfd fd = {
+    .fd = connection->llc_down,
+    .events = POLLOUT,
+  };
+  poll(&fd, 1, LLC_CONNECTION_SEND_POLL);
+#else
+  (void) connection;
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = LLC_CONNECTION_SEND_POLL * 1000000,
+  };
+  nanosleep(&delay, NULL);
+#endif
+}
+
 int
 llc_connection_send_pdu(struct llc_connection *connection, const struct pdu *pdu)
 {
@@ -354,12 +490,24 @@ llc_connection_send_pdu(struct llc_connection *connection, const struct pdu *pdu
     return -1;
   }
 
-  uint8_t buffer[BUFSIZ];
+  if (pdu->information_size > connection->remote_miu) {
+    LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "PDU too large for the remote MIU (%d)", connection->remote_miu);
+    return -1;
+  }
+
+  uint8_t buffer[3 + connection->remote_miu];
   int len = pdu_pack(pdu, buffer, sizeof(buffer));
 
-  if (mq_send(connection->llc_down, (char *) buffer, len, 0) < 0) {
-    LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Error enqueuing PDU");
-    return -1;
+  /*
+   * The down queue fills up while the remote LLC is busy or its receive
+   * window is closed: wait for the link to drain it rather than failing.
+   */
+  while (mq_send(connection->llc_down, (char *) buffer, len, 0) < 0) {
+    if ((errno != EAGAIN) || (connection->status != DLC_CONNECTED)) {
+      LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Error enqueuing PDU");
+      return -1;
+    }
+    llc_connection_wait_down_queue(connection);
   }
 
   return 0;
@@ -368,6 +516,11 @@ llc_connection_send_pdu(struct llc_connection *connection, const struct pdu *pdu
 int
 llc_connection_send(struct llc_connection *connection, const uint8_t *data, size_t len)
 {
+  if (len > LLCP_SEND_MIU(connection->remote_miu)) {
+    LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "Data too large for the remote MIU (%d)", LLCP_SEND_MIU(connection->remote_miu));
+    return -1;
+  }
+
   struct pdu *pdu = pdu_new_i(connection->remote_sap, connection->local_sap, connection, data, len);
   int res = llc_connection_send_pdu(connection, pdu);
   pdu_free(pdu);
@@ -380,17 +533,34 @@ llc_connection_recv(struct llc_connection *connection, uint8_t *data, size_t len
 {
   int res;
 
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[3 + connection->local_miu];
+  struct timespec now;
+
+  /* Account the time the application spent since the previous PDU */
+  if (connection->consumption.pdus) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    connection->consumption.busy += (now.tv_sec - connection->consumption.received.tv_sec) * 1000000000LL +
+                                    (now.tv_nsec - connection->consumption.received.tv_nsec);
+  }
+
   res = mq_receive(connection->llc_up, (char *) buffer, sizeof(buffer), 0);
   if (res < 0) {
     LLC_CONNECTION_LOG(LLC_PRIORITY_ERROR, "mq_receive: %s", strerror(errno));
     return -1;
   }
 
-  struct pdu *pdu = pdu_unpack(buffer, res);
+  struct pdu *pdu;
+  if (!(pdu = pdu_unpack(buffer, res))) {
+    LLC_CONNECTION_MSG(LLC_PRIORITY_ERROR, "Cannot unpack PDU");
+    return -1;
+  }
   len = MIN(pdu->information_size, len);
   memcpy(data, pdu->information, len);
 
+  connection->consumption.bytes += pdu->information_size;
+  connection->consumption.pdus++;
+  clock_gettime(CLOCK_MONOTONIC, &connection->consumption.received);
+
   if (ssap)
     *ssap = pdu->ssap;
 
@@ -406,39 +576,69 @@ llc_connection_stop(struct llc_connection *connection)
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Stopping Data Link Connection [%d -> %d]", connection->local_sap, connection->remote_sap);
 
   if (connection->thread == pthread_self()) {
-    connection->status = DLC_DISCONNECTED;
+    llc_connection_set_status(connection, DLC_DISCONNECTED);
     pthread_exit(NULL);
-  } else {
+  } else if (connection->thread) {
     llcp_threadslayer(connection->thread);
     connection->thread = 0;
   }
   return 0;
 }
 
+/*
+ * Change the status of a connection and wake up the threads waiting for it
+ * in llc_connection_wait().
+ */
+void
+llc_connection_set_status(struct llc_connection *connection, enum llc_connection_status status)
+{
+  assert(connection);
+
+  pthread_mutex_lock(&connection->status_lock);
+  connection->status = status;
+  pthread_cond_broadcast(&connection->status_changed);
+  pthread_mutex_unlock(&connection->status_lock);
+}
+
 int
 llc_connection_wait(struct llc_connection *connection, void **value_ptr)
+{
+  return llc_connection_timedwait(connection, NULL, value_ptr);
+}
+
+/*
+ * Wait until the connection is established or failed, then join its thread.
+ * abstime (CLOCK_REALTIME) only bounds the connection establishment; NULL
+ * waits forever.  Returns -1 with errno set to ETIMEDOUT on timeout.
+ */
+int
+llc_connection_timedwait(struct llc_connection *connection, const struct timespec *abstime, void **value_ptr)
 {
   assert(connection);
 
-  struct timespec ts = {
-    .tv_sec = 0,
-    .tv_nsec = 100000
-  };
+  int res = 0;
 
-  for (;;) {
-    switch (connection->status) {
-      case DLC_NEW:
-      case DLC_ACCEPTED:
-      case DLC_RECEIVED_CC:
-        nanosleep(&ts, NULL);
-        break;
-      case DLC_CONNECTED:
-        return pthread_join(connection->thread, value_ptr);
-        break;
-      default:
-        return -1;
-    }
+  pthread_mutex_lock(&connection->status_lock);
+  while ((res == 0) &&
+         ((connection->status == DLC_NEW) || (connection->status == DLC_ACCEPTED) || (connection->status == DLC_RECEIVED_CC))) {
+    if (abstime)
+      res = pthread_cond_timedwait(&connection->status_changed, &connection->status_lock, abstime);
+    else
+      res = pthread_cond_wait(&connection->status_changed, &connection->status_lock);
+  }
+  int status = connection->status;
+  pthread_t thread = connection->thread;
+  pthread_mutex_unlock(&connection->status_lock);
+
+  if (res) {
+    errno = res;
+    return -1;
   }
+
+  if (status != DLC_CONNECTED)
+    return -1;
+
+  return pthread_join(thread, value_ptr);
 }
 
 void
@@ -448,17 +648,25 @@ llc_connection_free(struct llc_connection *connection)
 
   LLC_CONNECTION_LOG(LLC_PRIORITY_TRACE, "Freeing Data Link Connection [%d -> %d]", connection->local_sap, connection->remote_sap);
 
+  llc_connection_update_consumption(connection);
+
   if (connection->llc_up != (mqd_t) - 1)
     mq_close(connection->llc_up);
   if (connection->llc_down != (mqd_t) - 1)
     mq_close(connection->llc_down);
-  if (connection->mq_up_name)
+  if (connection->mq_up_name[0])
     mq_unlink(connection->mq_up_name);
-  if (connection->mq_down_name)
+  if (connection->mq_down_name[0])
     mq_unlink(connection->mq_down_name);
 
-  free(connection->mq_up_name);
-  free(connection->mq_down_name);
-  free(connection->remote_uri);
-  free(connection);
+#if !defined(LLCP_STATIC_ALLOCATION)
+  llcp_free(connection->remote_uri);
+#endif
+
+  /* Let a waiter woken up by the last status change release the lock */
+  pthread_mutex_lock(&connection->status_lock);
+  pthread_mutex_unlock(&connection->status_lock);
+  pthread_cond_destroy(&connection->status_changed);
+  pthread_mutex_destroy(&connection->status_lock);
+  llcp_pool_delete(llc_connection_pool, connection);
 }
@@ -27,6 +27,9 @@
 #include <mqueue.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
+
+#include "llcp.h"
 
 #ifdef __cplusplus
 extern  "C" {
@@ -40,7 +43,7 @@ struct llc_connection {
   uint8_t remote_sap;
   uint8_t local_sap;
   char *remote_uri;
-  enum {
+  enum llc_connection_status {
     DLC_NEW,
     DLC_ACCEPTED,
     DLC_REJECTED,
@@ -49,9 +52,11 @@ struct llc_connection {
     DLC_DISCONNECTED,
     DLC_TERMINATED
   } status;
+  pthread_mutex_t status_lock;
+  pthread_cond_t status_changed;
   pthread_t thread;
-  char *mq_up_name;
-  char *mq_down_name;
+  char mq_up_name[LLCP_MQ_NAME_SIZE];
+  char mq_down_name[LLCP_MQ_NAME_SIZE];
   mqd_t llc_up;
   mqd_t llc_down;
   struct {
@@ -64,6 +69,21 @@ struct llc_connection {
   uint16_t remote_miu;    /* Maximum Information Unit Size for I PDUs */
   uint8_t rwl;    /* Local Receive Window Size */
   uint8_t rwr;    /* Remote Receive Window Size */
+  uint8_t remote_busy;    /* The remote LLC sent RNR */
+  uint8_t local_busy;     /* We sent RNR */
+  long high_watermark;    /* Received PDUs queued before sending RNR */
+  long low_watermark;     /* Received PDUs queued before sending RR again */
+  struct {
+    uint32_t count;         /* Times we sent RNR */
+    uint64_t time;          /* Time spent busy, up to the last RR (ns) */
+    struct timespec since;
+  } busy;
+  struct {
+    size_t bytes;           /* Information bytes consumed by the application */
+    uint32_t pdus;          /* PDUs consumed by the application */
+    uint64_t busy;          /* Time spent by the application between two receptions (ns) */
+    struct timespec received;
+  } consumption;
   struct llc_link *link;
   void *user_data;
 };
@@ -76,10 +96,13 @@ int		 llc_connection_connect(struct llc_connection *connection);
 void		 llc_connection_accept(struct llc_connection *connection);
 void		 llc_connection_reject(struct llc_connection *connection);
 int		 llc_connection_send_pdu(struct llc_connection *connection, const struct pdu *pdu);
+/* Sends at most the remote MIU, capped at LLCP_STATIC_MIU in the static profile */
 int		 llc_connection_send(struct llc_connection *connection, const uint8_t *data, size_t len);
 int		 llc_connection_recv(struct llc_connection *connection, uint8_t *data, size_t len, uint8_t *ssap);
 int		 llc_connection_stop(struct llc_connection *connection);
+void		 llc_connection_set_status(struct llc_connection *connection, enum llc_connection_status status);
 int		 llc_connection_wait(struct llc_connection *connection, void **value_ptr);
+int		 llc_connection_timedwait(struct llc_connection *connection, const struct timespec *abstime, void **value_ptr);
 void		 llc_connection_free(struct llc_connection *connection);
 
 #ifdef __cplusplus
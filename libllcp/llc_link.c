@@ -21,22 +21,24 @@
 
 #include "config.h"
 
+#include <sys/param.h>
 #include <sys/types.h>
 
 #include <assert.h>
 #include <fcntl.h>
-#if defined(HAVE_PTHREAD_NP_H)
-#  include <pthread_np.h>
-#endif
+#include <sched.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "llc_connection.h"
 #include "llcp_log.h"
 #include "llcp_parameters.h"
 #include "llcp_pdu.h"
+#include "llcp_pool.h"
 #include "llc_link.h"
 #include "llc_service.h"
 #include "llc_service_llc.h"
@@ -47,11 +49,14 @@
 #define LLC_LINK_MSG(priority, message) llcp_log_log (LOG_LLC_LINK, priority, "%s", message)
 #define LLC_LINK_LOG(priority, format, ...) llcp_log_log (LOG_LLC_LINK, priority, format, __VA_ARGS__)
 
+LLCP_POOL(llc_link_pool, sizeof(struct llc_link), LLCP_STATIC_LINKS);
+LLCP_POOL(llc_link_sdp_uri_pool, LLCP_STATIC_URI_SIZE, LLCP_STATIC_LINKS * LLCP_STATIC_SDP_URIS);
+
 struct llc_link *
 llc_link_new(void) {
   struct llc_link *link;
 
-  if ((link = malloc(sizeof(*link)))) {
+  if ((link = llcp_pool_new(llc_link_pool, sizeof(*link)))) {
     link->status = LL_DEACTIVATED;
     link->version.major = LLCP_VERSION_MAJOR;
     link->version.minor = LLCP_VERSION_MINOR;
@@ -61,14 +66,26 @@ llc_link_new(void) {
       link->datagram_handlers[i] = NULL;
       link->transmission_handlers[i] = NULL;
     }
+    link->bound_saps = 0;
+    memset(link->service_index, 0, sizeof(link->service_index));
+    pthread_mutex_init(&link->sdp_cache_lock, NULL);
+    pthread_mutex_init(&link->lock, NULL);
+    link->thread = (pthread_t) NULL;
+    memset(&link->thread_attributes, 0, sizeof(link->thread_attributes));
+    link->sdp_tid = 0;
+    memset(link->sdp_cache, 0, sizeof(link->sdp_cache));
     link->cut_test_context = NULL;
     link->mac_link = NULL;
+    link->miu = LLCP_DEFAULT_MIU;
     link->local_miu = LLCP_DEFAULT_MIU;
-
-    if ((asprintf(&link->mq_up_name, "/libllcp-%d-%p-up", getpid(), (void *) link) < 0) ||
-        (asprintf(&link->mq_down_name, "/libllcp-%d-%p-down", getpid(), (void *) link) < 0)) {
-      LLC_LINK_MSG(LLC_PRIORITY_FATAL, "Cannot print to allocated string");
-    }
+    link->pax = 0;
+    link->pax_pending = 0;
+    memset(&link->adaptation, 0, sizeof(link->adaptation));
+    memset(&link->scheduler, 0, sizeof(link->scheduler));
+    memset(&link->deferred, 0, sizeof(link->deferred));
+
+    snprintf(link->mq_up_name, sizeof(link->mq_up_name), "/libllcp-%d-%p-up", getpid(), (void *) link);
+    snprintf(link->mq_down_name, sizeof(link->mq_down_name), "/libllcp-%d-%p-down", getpid(), (void *) link);
     link->llc_up   = (mqd_t) - 1;
     link->llc_down = (mqd_t) - 1;
 
@@ -84,16 +101,62 @@ llc_link_new(void) {
   return link;
 }
 
+/*
+ * Service name index.
+ *
+ * Services bound to advertised SAPs with an URI are stored in an open
+ * addressing hash table so that looking up a SAP by service name does not
+ * involve walking all bound services.  The index is maintained by
+ * llc_link_service_bind() and llc_link_service_unbind().
+ */
+
+static uint32_t
+llc_link_uri_hash(const char *uri)
+{
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  while (*uri) {
+    hash ^= (uint8_t) * uri++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void
+llc_link_service_index_insert(struct llc_link *link, uint8_t sap)
+{
+  uint32_t hash = llc_link_uri_hash(link->available_services[sap]->uri);
+  size_t i = hash & (LLC_LINK_SERVICE_INDEX_SIZE - 1);
+
+  while (link->service_index[i].sap)
+    i = (i + 1) & (LLC_LINK_SERVICE_INDEX_SIZE - 1);
+
+  link->service_index[i].hash = hash;
+  link->service_index[i].sap = sap;
+}
+
+static void
+llc_link_service_index_rebuild(struct llc_link *link)
+{
+  memset(link->service_index, 0, sizeof(link->service_index));
+
+  for (uint8_t sap = 1; sap <= MAX_LLC_LINK_ADVERTISED_SERVICE; sap++) {
+    if (link->available_services[sap] && link->available_services[sap]->uri)
+      llc_link_service_index_insert(link, sap);
+  }
+}
+
 int
 llc_link_free_sap(struct llc_link *link)
 {
-  int sap;
-  for (sap = 0x10; link->available_services[sap] && (sap <= 0x1F); sap++);
-  if (sap > 0x1F) {
+  /* SAPs 0x10 to 0x1F are available for services advertised by name */
+  uint64_t free_saps = ~link->bound_saps & 0x00000000FFFF0000ULL;
+
+  if (!free_saps) {
     LLC_LINK_MSG(LLC_PRIORITY_ERROR, "No free SAP");
     return -1;
   }
-  return sap;
+  return ffsll(free_saps) - 1;
 }
 
 int
@@ -114,6 +177,10 @@ llc_link_service_bind(struct llc_link *link, struct llc_service *service, int8_t
 
   service->sap = sap;
   link->available_services[sap] = service;
+  link->bound_saps |= 1ULL << sap;
+
+  if (service->uri && (sap >= 1) && (sap <= MAX_LLC_LINK_ADVERTISED_SERVICE))
+    llc_link_service_index_insert(link, sap);
 
   LLC_LINK_LOG(LLC_PRIORITY_TRACE, "service %p bound to SAP %d", (void *) service, sap);
 
@@ -126,30 +193,48 @@ llc_link_service_unbind(struct llc_link *link, uint8_t sap)
   if (link->available_services[sap]) {
     link->available_services[sap]->sap = -1;
     link->available_services[sap] = NULL;
+    link->bound_saps &= ~(1ULL << sap);
+    llc_link_service_index_rebuild(link);
   }
 }
 
-uint16_t
-llc_link_get_wks(const struct llc_link *link)
+/*
+ * Set the local MIU announced when the link is activated.
+ */
+int
+llc_link_set_miu(struct llc_link *link, uint16_t miu)
 {
-  uint16_t wks = 0x0000;
-  for (int i = 0; i < 16; i++) {
-    wks |= (link->available_services[i] ? 1 : 0) << i;
+  assert(link);
+
+  if ((miu < LLCP_DEFAULT_MIU) || (miu > LLCP_LOCAL_MAX_MIU)) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Invalid MIU: %d", miu);
+    return -1;
   }
 
-  return wks;
+  link->miu = miu;
+  if (link->status != LL_ACTIVATED)
+    link->local_miu = miu;
+  return 0;
+}
+
+uint16_t
+llc_link_get_wks(const struct llc_link *link)
+{
+  return link->bound_saps & 0xFFFF;
 }
 
 int
 llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameters, size_t length)
 {
   assert(link);
-  assert(flags == (flags & 0x03));
+  assert(flags == (flags & 0x07));
 
+  /* The thread of a recycled link reads them while processing PDUs */
+  pthread_mutex_lock(&link->lock);
   link->role = flags & 0x01;
   link->version.major = LLCP_VERSION_MAJOR;
   link->version.minor = LLCP_VERSION_MINOR;
-  link->local_miu  = LLCP_DEFAULT_MIU;
+  link->local_miu  = link->miu;
   link->remote_miu = LLCP_DEFAULT_MIU;
   link->remote_wks = 0x0001;
   link->local_lto.tv_sec  = 1;
@@ -159,11 +244,7 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
   link->local_lsc  = 3;
   link->remote_lsc = 3;
 
-  if (llc_link_configure(link, parameters, length) < 0) {
-    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Link configuration failed");
-    llc_link_deactivate(link);
-    return -1;
-  }
+  int res = llc_link_configure(link, parameters, length);
 
   switch (flags & 0x01) {
     case LLC_INITIATOR:
@@ -171,15 +252,41 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
       break;
   }
 
-  if (!(flags & LLC_PAX_PDU_PROHIBITED)) {
-    /* FIXME: Exchange PAX PDU */
+  /*
+   * The initial link parameters come from the MAC activation.  When allowed,
+   * PAX PDUs are used afterwards to renegotiate them (see
+   * llc_link_renegotiate()).
+   */
+  link->pax = !(flags & LLC_PAX_PDU_PROHIBITED);
+  link->pax_pending = 0;
+  link->adaptation.full_pdus = 0;
+  link->adaptation.idle_pdus = 0;
+  link->adaptation.bulk = 0;
+
+  /*
+   * A recycled link still has its thread and message queues
+   */
+  int recycled = (link->llc_up != (mqd_t) - 1);
+  if (recycled && (res == 0))
+    link->status = LL_ACTIVATED;
+  pthread_mutex_unlock(&link->lock);
+
+  if (res < 0) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Link configuration failed");
+    llc_link_deactivate(link);
+    return -1;
+  }
+  if (recycled) {
+    LLC_LINK_MSG(LLC_PRIORITY_INFO, "LLC Link restarted");
+    return 0;
   }
 
   /*
    * Start link
    */
+  /* Queues are large enough for the MIU to be raised through PAX PDUs */
   struct mq_attr attr_up = {
-    .mq_msgsize = 3 + link->local_miu,
+    .mq_msgsize = 3 + LLCP_MAX_MIU,
     .mq_maxmsg  = 2,
   };
   LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "mq_open (%s)", link->mq_up_name);
@@ -190,7 +297,7 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
   }
 
   struct mq_attr attr_down = {
-    .mq_msgsize = 3 + link->remote_miu,
+    .mq_msgsize = 3 + LLCP_MAX_MIU,
     .mq_maxmsg  = 2,
   };
   LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "mq_open (%s)", link->mq_down_name);
@@ -200,10 +307,11 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
     return -1;
   }
 
-  if ((pthread_create(&link->thread, NULL, llc_service_llc_thread, link)) == 0) {
-#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
-    pthread_set_name_np(link->thread, "LLC Link");
-#endif
+  if (flags & LLC_NO_THREAD) {
+    /* The PDUs are processed by a llcp_engine worker */
+    link->thread = (pthread_t) NULL;
+    LLC_LINK_MSG(LLC_PRIORITY_INFO, "LLC Link started without a thread");
+  } else if (llcp_thread_create(&link->thread, &link->thread_attributes, 0, "LLC Link", llc_service_llc_thread, link) == 0) {
     LLC_LINK_MSG(LLC_PRIORITY_INFO, "LLC Link started successfully");
   } else {
     return -1;
@@ -217,130 +325,246 @@ llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameter
 int
 llc_link_configure(struct llc_link *link, const uint8_t *parameters, size_t length)
 {
-  struct llcp_version version;
-  uint16_t miux;
-  uint8_t lto;
-  uint8_t opt;
+  struct llcp_parameters params;
 
   LLC_LINK_LOG(LLC_PRIORITY_TRACE, "llc_link_configure (%p, %p, %d)", (void *)link, (void *) parameters, length);
 
-  size_t offset = 0;
-  while (offset < length) {
-    if (offset > length - 2) {
-      LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV field in parameters list");
-      return -1;
-    }
-    if (offset + 2 + parameters[offset + 1] > length) {
-      LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Incomplete TLV value in parameters list (expected %d bytes but only %d left)", parameters[offset + 1], length - (offset + 2));
+  if (parameters_decode(parameters, length, &params) < 0) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid TLV parameters list");
+    return -1;
+  }
+
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_VERSION)) {
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (remote)", params.version.major, params.version.minor);
+    if (llcp_version_agreement(link, params.version) < 0) {
+      LLC_LINK_MSG(LLC_PRIORITY_WARN, "LLCP Version Agreement Procedure failed");
       return -1;
     }
-    switch (parameters[offset]) {
-      case LLCP_PARAMETER_VERSION:
-        if (parameter_decode_version(parameters + offset, 2 + parameters[offset + 1], &version) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid Version TLV parameter");
-          return -1;
-        }
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (remote)", version.major, version.minor);
-        if (llcp_version_agreement(link, version) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_WARN, "LLCP Version Agreement Procedure failed");
-          return -1;
-        }
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (agreed)", version.major, version.minor);
-        break;
-      case LLCP_PARAMETER_MIUX:
-        if (parameter_decode_miux(parameters + offset, 2 + parameters[offset + 1], &miux) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid MIUX TLV parameter");
-          return -1;
-        }
-        link->remote_miu = miux + 128;
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "MIUX: %d (0x%02x)", miux + 128, miux);
-        break;
-      case LLCP_PARAMETER_WKS:
-        if (parameter_decode_wks(parameters + offset, 2 + parameters[offset + 1], &link->remote_wks) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid WKS TLV parameter");
-          return -1;
-        }
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "WKS: 0x%04x", link->remote_wks);
-        break;
-      case LLCP_PARAMETER_LTO:
-        if (parameter_decode_lto(parameters + offset, 2 + parameters[offset + 1], &lto) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid LTO TLV parameter");
-          return -1;
-        }
-        link->remote_lto.tv_sec = (lto * 10 * 1000) / 1000000;
-        link->remote_lto.tv_usec = (lto * 10 * 1000) % 1000000;
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "LTO: %d ms (0x%02x)", 10 * lto, lto);
-        break;
-      case LLCP_PARAMETER_OPT:
-        if (parameter_decode_opt(parameters + offset, 2 + parameters[offset + 1], &opt) < 0) {
-          LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid OPT TLV parameter");
-          return -1;
-        }
-        link->remote_lsc = opt & 0x03;
-        LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "OPT: 0x%02x", opt);
-        break;
-      default:
-        LLC_LINK_LOG(LLC_PRIORITY_INFO, "Unknown TLV Field 0x%02x (length: %d)",
-                     parameters[offset], parameters[offset + 1]);
-    }
-    offset += 2 + parameters[offset + 1];
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "Version: %d.%d (agreed)", link->version.major, link->version.minor);
   }
-  if (offset != length) {
-    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Unprocessed TLV parameters");
-    return -1;
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_MIUX)) {
+    link->remote_miu = params.miux + 128;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "MIUX: %d (0x%02x)", params.miux + 128, params.miux);
+  }
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_WKS)) {
+    link->remote_wks = params.wks;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "WKS: 0x%04x", link->remote_wks);
   }
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_LTO)) {
+    link->remote_lto.tv_sec = (params.lto * 10 * 1000) / 1000000;
+    link->remote_lto.tv_usec = (params.lto * 10 * 1000) % 1000000;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "LTO: %d ms (0x%02x)", 10 * params.lto, params.lto);
+  }
+  if (params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_OPT)) {
+    link->remote_lsc = params.opt & 0x03;
+    LLC_LINK_LOG(LLC_PRIORITY_DEBUG, "OPT: 0x%02x", params.opt);
+  }
+
   return 0;
 }
 
 int
 llc_link_encode_parameters(const struct llc_link *link, uint8_t *parameters, size_t length)
 {
-  int n;
-  uint8_t *parameter = parameters;
+  struct llcp_parameters params = {
+    .present = LLCP_PARAMETER_BIT(LLCP_PARAMETER_VERSION) |
+    LLCP_PARAMETER_BIT(LLCP_PARAMETER_MIUX) |
+    LLCP_PARAMETER_BIT(LLCP_PARAMETER_WKS) |
+    LLCP_PARAMETER_BIT(LLCP_PARAMETER_LTO) |
+    LLCP_PARAMETER_BIT(LLCP_PARAMETER_OPT),
+    .version = link->version,
+    .miux = link->local_miu - LLCP_DEFAULT_MIU,
+    .wks = llc_link_get_wks(link),
+    .lto = link->local_lto.tv_sec * 100 + link->local_lto.tv_usec / 10000,
+    .opt = link->opt,
+  };
+
+  return parameters_encode(parameters, length, &params);
+}
+
+/*
+ * Parameters Exchange.
+ *
+ * Once the link is active, either side may send a PAX PDU carrying its
+ * current link parameters.  A PAX PDU received while none of ours is pending
+ * is answered with our own parameters.
+ */
 
-  if ((n = parameter_encode_version(parameter, length, link->version)) < 0)
+int
+llc_link_pax_pack(const struct llc_link *link, uint8_t *buffer, size_t length)
+{
+  if (length < 2)
     return -1;
-  parameter += n;
-  length -= n;
 
-  if ((n = parameter_encode_miux(parameter, length, link->local_miu)) < 0)
+  buffer[0] = (0 << 2) | (PDU_PAX >> 2);
+  buffer[1] = (PDU_PAX << 6) | 0;
+
+  int res = llc_link_encode_parameters(link, buffer + 2, length - 2);
+  if (res < 0)
     return -1;
-  parameter += n;
-  length -= n;
 
-  if ((n = parameter_encode_wks(parameter, length, llc_link_get_wks(link))) < 0)
+  return 2 + res;
+}
+
+/* Same as llc_link_renegotiate(), with link->lock held */
+static int
+llc_link_renegotiate_locked(struct llc_link *link, uint16_t miu, uint8_t lto)
+{
+  if (link->status != LL_ACTIVATED) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "LLC Link is not activated");
+    return -1;
+  }
+  if (!link->pax) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "PAX PDUs are prohibited on this LLC Link");
     return -1;
-  parameter += n;
-  length -= n;
+  }
+  if (miu && ((miu < LLCP_DEFAULT_MIU) || (miu > LLCP_LOCAL_MAX_MIU))) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Invalid MIU: %d", miu);
+    return -1;
+  }
 
-  uint8_t lto = link->local_lto.tv_sec * 100 + link->local_lto.tv_usec / 10000;
-  if ((n = parameter_encode_lto(parameter, length, lto)) < 0)
+  if (miu)
+    link->local_miu = miu;
+  if (lto) {
+    link->local_lto.tv_sec = (lto * 10 * 1000) / 1000000;
+    link->local_lto.tv_usec = (lto * 10 * 1000) % 1000000;
+  }
+
+  uint8_t buffer[64];
+  int len = llc_link_pax_pack(link, buffer, sizeof(buffer));
+  if (len < 0) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Cannot build PAX PDU");
     return -1;
-  parameter += n;
-  length -= n;
+  }
 
-  if ((n = parameter_encode_opt(parameter, length, link->opt)) < 0)
+  link->pax_pending = 1;
+  if (mq_send(link->llc_down, (char *) buffer, len, 0) < 0) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Error enqueuing PAX PDU");
+    link->pax_pending = 0;
     return -1;
-  parameter += n;
-  length -= n;
+  }
+
+  LLC_LINK_LOG(LLC_PRIORITY_INFO, "Renegotiating link parameters (MIU: %d, LTO: %d ms)", link->local_miu, link->local_lto.tv_sec * 1000 + link->local_lto.tv_usec / 1000);
+
+  return 0;
+}
+
+/*
+ * Change the local MIU and LTO (in 10 ms units) of an active link and
+ * announce them to the remote LLC.  A zero value leaves the corresponding
+ * parameter unchanged.
+ */
+int
+llc_link_renegotiate(struct llc_link *link, uint16_t miu, uint8_t lto)
+{
+  int res;
+
+  assert(link);
 
-  return parameter - parameters;
+  /* The LLC Link thread reads them while processing PDUs */
+  pthread_mutex_lock(&link->lock);
+  res = llc_link_renegotiate_locked(link, miu, lto);
+  pthread_mutex_unlock(&link->lock);
+
+  return res;
+}
+
+/*
+ * Let the LLC Link thread renegotiate parameters from the observed traffic:
+ * after LLC_LINK_BULK_THRESHOLD consecutive PDUs filling the local MIU, the
+ * MIU is raised to bulk_miu and the LTO set to bulk_lto; after
+ * LLC_LINK_IDLE_THRESHOLD consecutive SYMM PDUs the LTO is set back to
+ * idle_lto.  A zero bulk_miu disables adaptation.
+ */
+int
+llc_link_set_adaptive_parameters(struct llc_link *link, uint16_t bulk_miu, uint8_t bulk_lto, uint8_t idle_lto)
+{
+  assert(link);
+
+  if (bulk_miu && ((bulk_miu < LLCP_DEFAULT_MIU) || (bulk_miu > LLCP_LOCAL_MAX_MIU))) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Invalid MIU: %d", bulk_miu);
+    return -1;
+  }
+
+  link->adaptation.bulk_miu = bulk_miu;
+  link->adaptation.bulk_lto = bulk_lto;
+  link->adaptation.idle_lto = idle_lto;
+  link->adaptation.full_pdus = 0;
+  link->adaptation.idle_pdus = 0;
+
+  return 0;
+}
+
+/* Applies to the threads started afterwards */
+int
+llc_link_set_thread_attributes(struct llc_link *link, const struct llcp_thread_attributes *attributes)
+{
+  assert(link);
+  assert(attributes);
+
+  if (attributes->priority && ((attributes->priority < sched_get_priority_min(SCHED_FIFO)) ||
+                               (attributes->priority > sched_get_priority_max(SCHED_FIFO)))) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Invalid SCHED_FIFO priority: %d", attributes->priority);
+    return -1;
+  }
+
+  link->thread_attributes = *attributes;
+
+  return 0;
+}
+
+/* Called by the LLC Link thread for each received PDU */
+void
+llc_link_adapt_parameters(struct llc_link *link, const struct pdu *pdu)
+{
+  if (!link->pax || !link->adaptation.bulk_miu)
+    return;
+
+  switch (pdu->ptype) {
+    case PDU_SYMM:
+      link->adaptation.full_pdus = 0;
+      if (link->adaptation.bulk && (++link->adaptation.idle_pdus >= LLC_LINK_IDLE_THRESHOLD)) {
+        LLC_LINK_MSG(LLC_PRIORITY_INFO, "LLC Link is idle");
+        link->adaptation.bulk = 0;
+        link->adaptation.idle_pdus = 0;
+        llc_link_renegotiate_locked(link, 0, link->adaptation.idle_lto);
+      }
+      break;
+    case PDU_UI:
+    case PDU_I:
+      link->adaptation.idle_pdus = 0;
+      if (pdu->information_size < link->local_miu) {
+        link->adaptation.full_pdus = 0;
+      } else if (!link->adaptation.bulk && (++link->adaptation.full_pdus >= LLC_LINK_BULK_THRESHOLD)) {
+        LLC_LINK_MSG(LLC_PRIORITY_INFO, "Bulk transfer on LLC Link");
+        link->adaptation.bulk = 1;
+        link->adaptation.full_pdus = 0;
+        llc_link_renegotiate_locked(link, MAX(link->local_miu, link->adaptation.bulk_miu), link->adaptation.bulk_lto);
+      }
+      break;
+    default:
+      link->adaptation.idle_pdus = 0;
+      break;
+  }
 }
 
 uint8_t
 llc_link_find_sap_by_uri(const struct llc_link *link, const char *uri)
 {
   LLC_LINK_LOG(LLC_PRIORITY_TRACE, "Searching SAP for service '%s'", uri);
-  int8_t res = 0;
-  for (int i = 1; i <= MAX_LLC_LINK_ADVERTISED_SERVICE; i++) {
-    if (link->available_services[i]) {
-      if (link->available_services[i]->uri &&
-          (0 == strcmp(link->available_services[i]->uri, uri))) {
-        LLC_LINK_LOG(LLC_PRIORITY_INFO, "Service '%s' is bound to SAP '%d'", uri, i);
-        res = i;
-        break;
-      }
+  uint8_t res = 0;
+  uint32_t hash = llc_link_uri_hash(uri);
+  size_t i = hash & (LLC_LINK_SERVICE_INDEX_SIZE - 1);
+
+  while (link->service_index[i].sap) {
+    uint8_t sap = link->service_index[i].sap;
+    if ((link->service_index[i].hash == hash) &&
+        (0 == strcmp(link->available_services[sap]->uri, uri))) {
+      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Service '%s' is bound to SAP '%d'", uri, sap);
+      res = sap;
+      break;
     }
+    i = (i + 1) & (LLC_LINK_SERVICE_INDEX_SIZE - 1);
   }
 
   if (!res)
@@ -349,6 +573,169 @@ llc_link_find_sap_by_uri(const struct llc_link *link, const char *uri)
   return res;
 }
 
+/*
+ * Remote services resolution.
+ *
+ * llc_link_resolve_uris() sends Service Discovery Requests for several
+ * services at once.  The link thread stores the SDRES answers in the link's
+ * SDP cache where llc_link_resolved_sap() can find them until the link is
+ * deactivated.
+ */
+
+/* Must be called with sdp_cache_lock held */
+static int
+llc_link_sdp_cache_find(const struct llc_link *link, const char *uri)
+{
+  for (int i = 0; i < LLC_LINK_SDP_CACHE_SIZE; i++) {
+    if (link->sdp_cache[i].uri && (0 == strcmp(link->sdp_cache[i].uri, uri)))
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Send Service Discovery Requests for the services not in the SDP cache yet.
+ * Returns the number of requests sent, or -1 if none could be while some
+ * were needed.  Requests stop at the first service that cannot be
+ * requested, after the ones before it were sent.
+ */
+int
+llc_link_resolve_uris(struct llc_link *link, const char *uris[], size_t count)
+{
+  assert(link);
+  assert(uris);
+
+  uint8_t buffer[link->remote_miu];
+  size_t max_len = sizeof(buffer);
+  int requested = 0;
+  int failed = 0;
+  size_t i = 0;
+
+  while ((i < count) && !failed) {
+    size_t len = 0;
+    size_t slots[LLC_LINK_SDP_CACHE_SIZE];
+    size_t added = 0;
+
+    pthread_mutex_lock(&link->sdp_cache_lock);
+    for (; i < count; i++) {
+      if (llc_link_sdp_cache_find(link, uris[i]) >= 0)
+        continue;
+
+      size_t uri_len = strlen(uris[i]);
+      if ((uri_len > LLCP_SDREQ_MAX_URI_SIZE) || (3 + uri_len > max_len)) {
+        LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Service name '%s' does not fit in a SNL PDU", uris[i]);
+        failed = 1;
+        break;
+      }
+      if (len + 3 + uri_len > max_len)
+        break; /* Send this SNL PDU and put the request in the next one */
+
+      /* Entries are never evicted: a pending request has to find its name */
+      size_t slot;
+      for (slot = 0; (slot < LLC_LINK_SDP_CACHE_SIZE) && link->sdp_cache[slot].uri; slot++)
+        ;
+      if (slot == LLC_LINK_SDP_CACHE_SIZE) {
+        LLC_LINK_LOG(LLC_PRIORITY_ERROR, "No room left to resolve '%s'", uris[i]);
+        failed = 1;
+        break;
+      }
+#if defined(LLCP_STATIC_ALLOCATION)
+      if (uri_len >= LLCP_STATIC_URI_SIZE) {
+        LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Service name too long: '%s'", uris[i]);
+        failed = 1;
+        break;
+      }
+#endif
+      if (!(link->sdp_cache[slot].uri = llcp_pool_new(llc_link_sdp_uri_pool, uri_len + 1))) {
+        LLC_LINK_LOG(LLC_PRIORITY_ERROR, "No room left to resolve '%s'", uris[i]);
+        failed = 1;
+        break;
+      }
+      strcpy(link->sdp_cache[slot].uri, uris[i]);
+
+      uint8_t tid = link->sdp_tid++;
+      len += parameter_encode_sdreq(buffer + len, max_len - len, tid, uris[i]);
+
+      link->sdp_cache[slot].tid = tid;
+      link->sdp_cache[slot].sap = -1;
+      slots[added++] = slot;
+      LLC_LINK_LOG(LLC_PRIORITY_TRACE, "Service Discovery Request #0x%02x for '%s'", tid, uris[i]);
+    }
+    pthread_mutex_unlock(&link->sdp_cache_lock);
+
+    if (len) {
+      struct pdu *pdu = pdu_new(LLCP_SDP_SAP, PDU_SNL, LLCP_SDP_SAP, 0, 0, buffer, len);
+      int res = llc_link_send_pdu(link, pdu);
+      pdu_free(pdu);
+      if (res < 0) {
+        /* Nobody will answer these: let a later call request them again */
+        pthread_mutex_lock(&link->sdp_cache_lock);
+        for (size_t n = 0; n < added; n++) {
+          llcp_pool_delete(llc_link_sdp_uri_pool, link->sdp_cache[slots[n]].uri);
+          link->sdp_cache[slots[n]].uri = NULL;
+        }
+        pthread_mutex_unlock(&link->sdp_cache_lock);
+        failed = 1;
+        break;
+      }
+      requested += added;
+    }
+  }
+
+  return (failed && !requested) ? -1 : requested;
+}
+
+/*
+ * Return the remote SAP of the given service, 0 if the remote LLC reported
+ * the service as not available, and -1 if the service is not resolved (yet).
+ */
+int
+llc_link_resolved_sap(struct llc_link *link, const char *uri)
+{
+  assert(link);
+  assert(uri);
+
+  int res = -1;
+
+  pthread_mutex_lock(&link->sdp_cache_lock);
+  int slot = llc_link_sdp_cache_find(link, uri);
+  if (slot >= 0)
+    res = link->sdp_cache[slot].sap;
+  pthread_mutex_unlock(&link->sdp_cache_lock);
+
+  return res;
+}
+
+void
+llc_link_sdp_cache_update(struct llc_link *link, uint8_t tid, uint8_t sap)
+{
+  size_t slot;
+
+  pthread_mutex_lock(&link->sdp_cache_lock);
+  for (slot = 0; slot < LLC_LINK_SDP_CACHE_SIZE; slot++) {
+    if (link->sdp_cache[slot].uri && (link->sdp_cache[slot].sap < 0) && (link->sdp_cache[slot].tid == tid))
+      break;
+  }
+  if (slot < LLC_LINK_SDP_CACHE_SIZE) {
+    link->sdp_cache[slot].sap = sap;
+    LLC_LINK_LOG(LLC_PRIORITY_INFO, "Remote service '%s' is bound to SAP %d", link->sdp_cache[slot].uri, sap);
+  } else {
+    LLC_LINK_LOG(LLC_PRIORITY_WARN, "Unexpected Service Discovery Response #0x%02x", tid);
+  }
+  pthread_mutex_unlock(&link->sdp_cache_lock);
+}
+
+static void
+llc_link_sdp_cache_flush(struct llc_link *link)
+{
+  pthread_mutex_lock(&link->sdp_cache_lock);
+  for (size_t i = 0; i < LLC_LINK_SDP_CACHE_SIZE; i++) {
+    llcp_pool_delete(llc_link_sdp_uri_pool, link->sdp_cache[i].uri);
+    link->sdp_cache[i].uri = NULL;
+  }
+  pthread_mutex_unlock(&link->sdp_cache_lock);
+}
+
 int
 llc_link_send_pdu(struct llc_link *link, const struct pdu *pdu)
 {
@@ -359,7 +746,12 @@ llc_link_send_pdu(struct llc_link *link, const struct pdu *pdu)
     return -1;
   }
 
-  uint8_t buffer[BUFSIZ];
+  if (pdu->information_size > link->remote_miu) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "PDU too large for the remote MIU (%d)", link->remote_miu);
+    return -1;
+  }
+
+  uint8_t buffer[3 + link->remote_miu];
   int len = pdu_pack(pdu, buffer, sizeof(buffer));
 
   if (mq_send(link->llc_down, (char *) buffer, len, 0) < 0) {
@@ -373,6 +765,11 @@ llc_link_send_pdu(struct llc_link *link, const struct pdu *pdu)
 int
 llc_link_send_data(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap, const uint8_t *data, size_t len)
 {
+  if (len > LLCP_SEND_MIU(link->remote_miu)) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Data too large for the remote MIU (%d)", LLCP_SEND_MIU(link->remote_miu));
+    return -1;
+  }
+
   struct pdu *pdu = pdu_new(remote_sap, PDU_UI, local_sap, 0, 0, data, len);
   int res = llc_link_send_pdu(link, pdu);
   pdu_free(pdu);
@@ -380,6 +777,177 @@ llc_link_send_data(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap,
   return res;
 }
 
+/*
+ * Send UI PDUs in as few frames as possible: consecutive datagrams that fit
+ * together in the remote MIU are aggregated in a single AGF PDU.  Returns
+ * the number of datagrams enqueued, -1 if none was.
+ */
+int
+llc_link_send_datagrams(struct llc_link *link, const struct llc_datagram *datagrams, size_t count)
+{
+  assert(link);
+  assert(link->status == LL_ACTIVATED);
+  assert(datagrams || !count);
+
+  for (size_t i = 0; i < count; i++) {
+    if (datagrams[i].data.iov_len > link->remote_miu) {
+      LLC_LINK_LOG(LLC_PRIORITY_ERROR, "Datagram %d too large for the remote MIU (%d)", (int) i, link->remote_miu);
+      return -1;
+    }
+  }
+
+  uint8_t buffer[2 + link->remote_miu];
+  size_t sent = 0;
+
+  while (sent < count) {
+    /* Take as many datagrams as fit in the information field of an AGF PDU */
+    size_t information_size = 4 + datagrams[sent].data.iov_len;
+    size_t n = 1;
+    while ((sent + n < count) && (information_size + 4 + datagrams[sent + n].data.iov_len <= link->remote_miu))
+      information_size += 4 + datagrams[sent + n++].data.iov_len;
+
+    struct pdu pdu = {
+      .ptype = PDU_UI,
+      .dsap = datagrams[sent].remote_sap,
+      .ssap = datagrams[sent].local_sap,
+      .information = datagrams[sent].data.iov_base,
+      .information_size = datagrams[sent].data.iov_len,
+    };
+    int len;
+
+    if (n == 1) {
+      len = pdu_pack(&pdu, buffer, sizeof(buffer));
+    } else {
+      struct pdu agf = {
+        .ptype = PDU_AGF,
+      };
+      len = pdu_pack(&agf, buffer, sizeof(buffer));
+      for (size_t i = sent; i < sent + n; i++) {
+        pdu.dsap = datagrams[i].remote_sap;
+        pdu.ssap = datagrams[i].local_sap;
+        pdu.information = datagrams[i].data.iov_base;
+        pdu.information_size = datagrams[i].data.iov_len;
+        buffer[len++] = (2 + pdu.information_size) >> 8;
+        buffer[len++] = 2 + pdu.information_size;
+        len += pdu_pack(&pdu, buffer + len, sizeof(buffer) - len);
+      }
+    }
+
+    if (mq_send(link->llc_down, (char *) buffer, len, 0) < 0) {
+      LLC_LINK_MSG(LLC_PRIORITY_ERROR, "Error enqueuing PDU");
+      break;
+    }
+    sent += n;
+  }
+
+  return sent ? (int) sent : -1;
+}
+
+/* Stop and free the connections of a handler table */
+static void
+llc_link_stop_handlers(struct llc_connection *handlers[], const char *kind)
+{
+  uint8_t local_sap;
+  uint8_t remote_sap;
+
+  for (int i = 0; i <= MAX_LLC_LINK_SERVICE; i++) {
+    if (handlers[i]) {
+      remote_sap = handlers[i]->remote_sap;
+      local_sap = handlers[i]->local_sap;
+      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Stopping %s [%d -> %d]", kind, local_sap, remote_sap);
+      llc_connection_stop(handlers[i]);
+      llc_connection_free(handlers[i]);
+      handlers[i] = NULL;
+      LLC_LINK_LOG(LLC_PRIORITY_INFO, "%s [%d -> %d] stopped", kind, local_sap, remote_sap);
+    }
+  }
+}
+
+static void
+llc_link_stop_connections(struct llc_link *link)
+{
+  llc_link_stop_handlers(link->datagram_handlers, "Logical Data Link");
+  llc_link_stop_handlers(link->transmission_handlers, "Data Link Connection");
+}
+
+/* Discard the replies waiting for room in the down queue */
+static void
+llc_link_discard_deferred(struct llc_link *link)
+{
+  while (link->deferred.count) {
+    pdu_free(link->deferred.pdus[link->deferred.first]);
+    link->deferred.first = (link->deferred.first + 1) % LLC_LINK_DEFERRED_REPLIES;
+    link->deferred.count--;
+  }
+  link->deferred.first = 0;
+}
+
+/* Discard the PDUs left in a message queue */
+static void
+llc_link_drain(const char *name)
+{
+  char buffer[LLCP_MAX_PDU_SIZE];
+  mqd_t mq;
+
+  if ((mq = mq_open(name, O_RDONLY | O_NONBLOCK)) == (mqd_t) - 1) {
+    LLC_LINK_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", name);
+    return;
+  }
+  while (mq_receive(mq, buffer, sizeof(buffer), NULL) >= 0)
+    ;
+  mq_close(mq);
+}
+
+/*
+ * End the current activation of the LLC Link but keep its thread and message
+ * queues running, so that the next llc_link_activate() call only has to
+ * reset the protocol state.  Connections are stopped as on deactivation.
+ * The MAC Link stops exchanging PDUs but stays attached: activate it again
+ * to resume.  llc_link_deactivate() releases the thread and queues.
+ */
+int
+llc_link_recycle(struct llc_link *link)
+{
+  struct llc_connection *datagram_handlers[MAX_LLC_LINK_SERVICE + 1];
+  struct llc_connection *transmission_handlers[MAX_LLC_LINK_SERVICE + 1];
+
+  assert(link);
+
+  if (link->llc_up == (mqd_t) - 1) {
+    LLC_LINK_MSG(LLC_PRIORITY_ERROR, "LLC Link is not running");
+    return -1;
+  }
+
+  LLC_LINK_MSG(LLC_PRIORITY_INFO, "Recycling LLC Link");
+
+  if (link->mac_link)
+    mac_link_deactivate(link->mac_link, MAC_DEACTIVATE_ON_REQUEST);
+
+  pthread_mutex_lock(&link->lock);
+  link->status = LL_DEACTIVATED;
+  for (int i = 0; i <= MAX_LLC_LINK_SERVICE; i++) {
+    datagram_handlers[i] = link->datagram_handlers[i];
+    transmission_handlers[i] = link->transmission_handlers[i];
+    link->datagram_handlers[i] = NULL;
+    link->transmission_handlers[i] = NULL;
+  }
+  llc_link_drain(link->mq_up_name);
+  llc_link_drain(link->mq_down_name);
+  llc_link_discard_deferred(link);
+  link->pax_pending = 0;
+  memset(&link->scheduler, 0, sizeof(link->scheduler));
+  pthread_mutex_unlock(&link->lock);
+
+  /* Services may wait for link->lock (llc_link_renegotiate()): stop them unlocked */
+  llc_link_stop_handlers(datagram_handlers, "Logical Data Link");
+  llc_link_stop_handlers(transmission_handlers, "Data Link Connection");
+
+  llc_link_sdp_cache_flush(link);
+  LLC_LINK_MSG(LLC_PRIORITY_INFO, "LLC Link recycled");
+
+  return 0;
+}
+
 void
 llc_link_deactivate(struct llc_link *link)
 {
@@ -407,42 +975,21 @@ llc_link_deactivate(struct llc_link *link)
     }
   }
 
-  uint8_t local_sap;
-  uint8_t remote_sap;
-
-  for (int i = 0; i <= MAX_LOGICAL_DATA_LINK; i++) {
-    if (link->datagram_handlers[i]) {
-      remote_sap = link->datagram_handlers[i]->remote_sap;
-      local_sap = link->datagram_handlers[i]->local_sap;
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Stopping Logical Data Link [%d -> %d]", local_sap, remote_sap);
-      llc_connection_stop(link->datagram_handlers[i]);
-      llc_connection_free(link->datagram_handlers[i]);
-      link->datagram_handlers[i] = NULL;
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Logical Data Link [%d -> %d] stopped", local_sap, remote_sap);
-    }
-  }
-  for (int i = 0; i <= MAX_LLC_LINK_SERVICE; i++) {
-    if (link->transmission_handlers[i]) {
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Stopping Data Link Connection [%d -> %d]", local_sap, remote_sap);
-      llc_connection_stop(link->transmission_handlers[i]);
-      llc_connection_free(link->transmission_handlers[i]);
-      link->transmission_handlers[i] = NULL;
-      LLC_LINK_LOG(LLC_PRIORITY_INFO, "Data Link Connection [%d -> %d] stopped", local_sap, remote_sap);
-    }
-  }
+  llc_link_stop_connections(link);
 
   if (link->llc_up != (mqd_t) - 1)
     mq_close(link->llc_up);
   if (link->llc_down != (mqd_t) - 1)
     mq_close(link->llc_down);
 
-  if (link->mq_up_name)
-    mq_unlink(link->mq_up_name);
-  if (link->mq_down_name)
-    mq_unlink(link->mq_down_name);
+  mq_unlink(link->mq_up_name);
+  mq_unlink(link->mq_down_name);
 
   link->llc_up   = (mqd_t) - 1;
   link->llc_down = (mqd_t) - 1;
+
+  llc_link_discard_deferred(link);
+  llc_link_sdp_cache_flush(link);
   LLC_LINK_MSG(LLC_PRIORITY_INFO, "LLC Link deactivated");
 }
 
@@ -451,6 +998,10 @@ llc_link_free(struct llc_link *link)
 {
   assert(link);
 
+  /* Release the thread and message queues of a recycled link first */
+  if (link->llc_up != (mqd_t) - 1)
+    llc_link_deactivate(link);
+
   for (int i = MAX_LLC_LINK_SERVICE; i >= 0; i--) {
     if (link->available_services[i]) {
       LLC_LINK_LOG(LLC_PRIORITY_INFO, "Freeing service %d", i);
@@ -459,8 +1010,9 @@ llc_link_free(struct llc_link *link)
     }
   }
 
-  free(link->mq_up_name);
-  free(link->mq_down_name);
+  llc_link_sdp_cache_flush(link);
+  pthread_mutex_destroy(&link->sdp_cache_lock);
+  pthread_mutex_destroy(&link->lock);
 
-  free(link);
+  llcp_pool_delete(llc_link_pool, link);
 }
@@ -22,7 +22,10 @@
 #ifndef _LLC_LINK_H
 #define _LLC_LINK_H
 
+#include <sys/uio.h>
+
 #include <mqueue.h>
+#include <pthread.h>
 #include <stdint.h>
 
 #include "llcp_pdu.h"
@@ -32,6 +35,26 @@
 extern  "C" {
 #endif /* __cplusplus */
 
+#define LLC_LINK_SERVICE_INDEX_SIZE 64 /* Power of 2, at least twice MAX_LLC_LINK_ADVERTISED_SERVICE */
+#define LLC_LINK_SDP_CACHE_SIZE (MAX_LLC_LINK_SERVICE + 1) /* Remote services resolved at once */
+
+/* Link parameters adaptation thresholds, in received PDUs */
+#define LLC_LINK_BULK_THRESHOLD 4
+#define LLC_LINK_IDLE_THRESHOLD 32
+
+/* Transmit scheduler flows: Logical Data Links, then Data Link Connections */
+#define LLC_LINK_FLOWS (2 * (MAX_LLC_LINK_SERVICE + 1))
+
+/* Replies kept for the next turns when the down queue is full */
+#define LLC_LINK_DEFERRED_REPLIES 8
+
+/* A UI PDU for llc_link_send_datagrams() */
+struct llc_datagram {
+  uint8_t local_sap;
+  uint8_t remote_sap;
+  struct iovec data;
+};
+
 struct llc_link {
   uint8_t role;
   enum {
@@ -39,6 +62,7 @@ struct llc_link {
     LL_DEACTIVATED,
   } status;
   struct llcp_version version;
+  uint16_t miu;           /* Local MIU announced on activation */
   uint16_t local_miu;
   uint16_t remote_miu;
   uint16_t remote_wks;
@@ -48,30 +72,81 @@ struct llc_link {
   uint8_t remote_lsc;
   uint8_t opt;
 
+  /* Parameters Exchange */
+  uint8_t pax;            /* PAX PDUs are allowed on this link */
+  uint8_t pax_pending;    /* Our last PAX PDU was not answered yet */
+  struct {
+    uint16_t bulk_miu;    /* MIU to announce on bulk transfers, 0 disables adaptation */
+    uint8_t bulk_lto;
+    uint8_t idle_lto;
+    uint8_t full_pdus;    /* Consecutive PDUs received at the local MIU */
+    uint8_t idle_pdus;    /* Consecutive SYMM PDUs received */
+    uint8_t bulk;
+  } adaptation;
+
   pthread_t thread;
-  char *mq_up_name;
-  char *mq_down_name;
+  struct llcp_thread_attributes thread_attributes;  /* LLC Link, MAC Link and connection threads */
+  pthread_mutex_t lock;   /* Held while the link processes a PDU */
+  char mq_up_name[LLCP_MQ_NAME_SIZE];
+  char mq_down_name[LLCP_MQ_NAME_SIZE];
   mqd_t llc_up;
   mqd_t llc_down;
 
   struct llc_service *available_services[MAX_LLC_LINK_SERVICE + 1];
-  struct llc_connection *datagram_handlers[MAX_LOGICAL_DATA_LINK];
+  uint64_t bound_saps;    /* Bitmap of SAPs a service is bound to */
+  struct {
+    uint32_t hash;
+    uint8_t sap;          /* 0 for an empty slot */
+  } service_index[LLC_LINK_SERVICE_INDEX_SIZE];
+  /* Remote services resolved through SNL, kept until the link is deactivated */
+  pthread_mutex_t sdp_cache_lock;
+  uint8_t sdp_tid;
+  struct {
+    char *uri;
+    uint8_t tid;
+    int8_t sap;           /* -1 while the SDRES is pending */
+  } sdp_cache[LLC_LINK_SDP_CACHE_SIZE];
+
+  struct llc_connection *datagram_handlers[MAX_LLC_LINK_SERVICE + 1];  /* Logical Data Links, by local SAP */
   struct llc_connection *transmission_handlers[MAX_LLC_LINK_SERVICE + 1];
 
+  /* Transmit scheduler (deficit round-robin) */
+  struct {
+    int current;          /* Flow being served */
+    int32_t deficit[LLC_LINK_FLOWS];  /* Bytes left to the flow this round */
+  } scheduler;
+  struct {
+    struct pdu *pdus[LLC_LINK_DEFERRED_REPLIES];
+    size_t first;
+    size_t count;
+  } deferred;
+
   /* Unit tests metadata */
   void *cut_test_context;
   struct mac_link *mac_link;
 };
 
 struct llc_link	*llc_link_new(void);
+int		 llc_link_set_miu(struct llc_link *link, uint16_t miu);
 int		 llc_link_service_bind(struct llc_link *link, struct llc_service *service, int8_t sap);
 void		 llc_link_service_unbind(struct llc_link *link, uint8_t sap);
 int		 llc_link_activate(struct llc_link *link, uint8_t flags, const uint8_t *parameters, size_t length);
 int		 llc_link_configure(struct llc_link *link, const uint8_t *parameters, size_t length);
 int		 llc_link_encode_parameters(const struct llc_link *link, uint8_t *parameters, size_t length);
+int		 llc_link_pax_pack(const struct llc_link *link, uint8_t *buffer, size_t length);
+int		 llc_link_renegotiate(struct llc_link *link, uint16_t miu, uint8_t lto);
+int		 llc_link_set_adaptive_parameters(struct llc_link *link, uint16_t bulk_miu, uint8_t bulk_lto, uint8_t idle_lto);
+int		 llc_link_set_thread_attributes(struct llc_link *link, const struct llcp_thread_attributes *attributes);
+void		 llc_link_adapt_parameters(struct llc_link *link, const struct pdu *pdu);
 uint8_t		 llc_link_find_sap_by_uri(const struct llc_link *link, const char *uri);
+int		 llc_link_resolve_uris(struct llc_link *link, const char *uris[], size_t count);
+int		 llc_link_resolved_sap(struct llc_link *link, const char *uri);
+void		 llc_link_sdp_cache_update(struct llc_link *link, uint8_t tid, uint8_t sap);
 int		 llc_link_send_pdu(struct llc_link *link, const struct pdu *pdu);
+/* Sends at most the remote MIU, capped at LLCP_STATIC_MIU in the static profile */
 int		 llc_link_send_data(struct llc_link *link, uint8_t local_sap, uint8_t remote_sap, const uint8_t *data, size_t len);
+int		 llc_link_send_datagrams(struct llc_link *link, const struct llc_datagram *datagrams, size_t count);
+int		 llc_link_recycle(struct llc_link *link);
 void		 llc_link_deactivate(struct llc_link *link);
 void		 llc_link_free(struct llc_link *link);
 
@@ -35,12 +35,19 @@
 #include "llc_link.h"
 #include "llcp_log.h"
 #include "llcp_pdu.h"
+#include "llcp_pool.h"
 #include "llc_service.h"
 
 #define LOG_LLC_SERVICE "libllcp.llc.service"
 #define LLC_SERVICE_MSG(priority, message) llcp_log_log (LOG_LLC_SERVICE, priority, "%s", message)
 #define LLC_SERVICE_LOG(priority, format, ...) llcp_log_log (LOG_LLC_SERVICE, priority, format, __VA_ARGS__)
 
+/* Default memory for each connection receive buffer: 4 PDUs of the default MIU */
+#define LLC_SERVICE_DEFAULT_RECEIVE_BUFFER (4 * (3 + LLCP_DEFAULT_MIU))
+
+/* The URI of a service is kept in the same block */
+LLCP_POOL(llc_service_pool, sizeof(struct llc_service) + LLCP_STATIC_URI_SIZE, LLCP_STATIC_SERVICES);
+
 struct llc_service *
 llc_service_new(void * (*accept_routine)(void *), void * (*thread_routine)(void *), void *user_data) {
   return llc_service_new_with_uri(accept_routine, thread_routine, NULL, user_data);
@@ -52,13 +59,23 @@ llc_service_new_with_uri(void * (*accept_routine)(void *), void * (*thread_routi
 
   struct llc_service *service;
 
-  if ((service = malloc(sizeof(*service)))) {
+  if ((service = llcp_pool_new(llc_service_pool, sizeof(*service)))) {
 
-    service->uri = (uri) ? strdup(uri) : NULL;
+    service->uri = NULL;
+    if (uri && !llc_service_set_uri(service, uri)) {
+      llcp_pool_delete(llc_service_pool, service);
+      return NULL;
+    }
 
+    service->accept_callback = NULL;
     service->accept_routine = accept_routine;
     service->thread_routine = thread_routine;
     service->miu = LLCP_DEFAULT_MIU;
+    service->rw = LLCP_MAX_RW;
+    service->weight = 1;
+    service->receive_buffer = LLC_SERVICE_DEFAULT_RECEIVE_BUFFER;
+    service->consumption.rate = 0;
+    service->consumption.size = 0;
     service->user_data = user_data;
   }
 
@@ -76,7 +93,7 @@ void
 llc_service_set_miu(struct llc_service *service, uint16_t miu)
 {
   assert(service);
-  assert(((miu - 128) & 0xfc00) == 0x0000);
+  assert((miu >= LLCP_DEFAULT_MIU) && (miu <= LLCP_LOCAL_MAX_MIU));
   service->miu = miu;
 }
 
@@ -92,6 +109,57 @@ llc_service_set_rw(struct llc_service *service, uint8_t rw)
   service->rw = rw;
 }
 
+uint8_t
+llc_service_get_weight(const struct llc_service *service)
+{
+  assert(service);
+  return service->weight;
+}
+
+/*
+ * On a busy link, connections of this service send weight times as many
+ * bytes as connections of a service of weight 1.
+ */
+void
+llc_service_set_weight(struct llc_service *service, uint8_t weight)
+{
+  assert(service);
+  assert(weight);
+  service->weight = weight;
+}
+
+size_t
+llc_service_get_receive_buffer(const struct llc_service *service)
+{
+  assert(service);
+  return service->receive_buffer;
+}
+
+/*
+ * Bound the memory used to buffer received PDUs on each connection.  The
+ * receive window advertised to the remote LLC never exceeds what fits in
+ * this buffer.
+ */
+void
+llc_service_set_receive_buffer(struct llc_service *service, size_t size)
+{
+  assert(service);
+  service->receive_buffer = size;
+}
+
+/*
+ * Have the LLC Link thread decide on incoming connections by calling
+ * accept_callback instead of starting accept_routine in a new thread.  The
+ * callback must not block; it returns 0 to accept the connection and -1 to
+ * reject it.
+ */
+void
+llc_service_set_accept_callback(struct llc_service *service, int (*accept_callback)(struct llc_connection *))
+{
+  assert(service);
+  service->accept_callback = accept_callback;
+}
+
 const char *
 llc_service_get_uri(const struct llc_service *service)
 {
@@ -102,8 +170,16 @@ const char *
 llc_service_set_uri(struct llc_service *service, const char *uri)
 {
   assert(service);
-  free(service->uri);
-  return service->uri = (uri) ? strdup(uri) : NULL;
+#if defined(LLCP_STATIC_ALLOCATION)
+  if (uri && (strlen(uri) >= LLCP_STATIC_URI_SIZE)) {
+    LLC_SERVICE_LOG(LLC_PRIORITY_ERROR, "Service name too long: '%s'", uri);
+    return NULL;
+  }
+  return service->uri = (uri) ? strcpy((char *)(service + 1), uri) : NULL;
+#else
+  llcp_free(service->uri);
+  return service->uri = (uri) ? llcp_strdup(uri) : NULL;
+#endif
 }
 
 void
@@ -111,6 +187,8 @@ llc_service_free(struct llc_service *service)
 {
   assert(service);
 
-  free(service->uri);
-  free(service);
+#if !defined(LLCP_STATIC_ALLOCATION)
+  llcp_free(service->uri);
+#endif
+  llcp_pool_delete(llc_service_pool, service);
 }
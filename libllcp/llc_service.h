@@ -22,6 +22,8 @@
 #ifndef _LLC_SERVICE_H
 #define _LLC_SERVICE_H
 
+#include <sys/types.h>
+
 #include <pthread.h>
 #include <stdint.h>
 
@@ -29,13 +31,22 @@
 extern  "C" {
 #endif /* __cplusplus */
 
+struct llc_connection;
+
 struct llc_service {
   char *uri;
+  int (*accept_callback)(struct llc_connection *);
   void *(*accept_routine)(void *);
   void *(*thread_routine)(void *);
   int8_t sap;
   uint8_t rw;
   uint16_t miu;
+  uint8_t weight;         /* Share of the link transmit bandwidth */
+  size_t receive_buffer;
+  struct {
+    uint32_t rate;	/* Information bytes consumed per second */
+    uint16_t size;	/* Average information size */
+  } consumption;
   void *user_data;
 };
 
@@ -45,6 +56,11 @@ uint16_t	 llc_service_get_miu(const struct llc_service *service);
 void		 llc_service_set_miu(struct llc_service *service, uint16_t miu);
 uint8_t		 llc_service_get_rw(const struct llc_service *service);
 void		 llc_service_set_rw(struct llc_service *service, uint8_t rw);
+uint8_t		 llc_service_get_weight(const struct llc_service *service);
+void		 llc_service_set_weight(struct llc_service *service, uint8_t weight);
+size_t		 llc_service_get_receive_buffer(const struct llc_service *service);
+void		 llc_service_set_receive_buffer(struct llc_service *service, size_t size);
+void		 llc_service_set_accept_callback(struct llc_service *service, int (*accept_callback)(struct llc_connection *));
 const char	*llc_service_get_uri(const struct llc_service *service);
 const char	*llc_service_set_uri(struct llc_service *service, const char *uri);
 void		 llc_service_free(struct llc_service *service);
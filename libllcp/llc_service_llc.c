@@ -29,18 +29,19 @@
 #include <errno.h>
 #include <mqueue.h>
 #include <pthread.h>
-#if defined(HAVE_PTHREAD_NP_H)
-#  include <pthread_np.h>
-#endif
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "llc_link.h"
 #include "llc_connection.h"
 #include "llcp_log.h"
+#include "llcp_parameters.h"
 #include "llcp_pdu.h"
+#include "llcp_pool.h"
 #include "llc_service.h"
+#include "llc_service_sdp.h"
 #include "mac.h"
 
 #define LOG_LLC_SERVICE_LLC "libllcp.llc.llc"
@@ -57,478 +58,856 @@ llc_service_llc_thread_cleanup(void *arg)
    * The cleanup routine is called while sem_log is held.  Trying ot log some
    * information using log4c will lead to a deadlock.
    */
-  struct llc_link *link = (struct llc_link *)arg;
+  mqd_t *queues = (mqd_t *)arg;
+
+  if (queues[0] != (mqd_t) - 1)
+    mq_close(queues[0]);
+
+  if (queues[1] != (mqd_t) - 1)
+    mq_close(queues[1]);
+}
 
-  if (link->llc_up != (mqd_t) - 1)
-    mq_close(link->llc_up);
+/*
+ * Pack a reply obtained from pdu_new() into buffer and release it.  Returns
+ * the length of the PDU to send, 0 if it could not be allocated: the caller
+ * then tries again later or drops the reply.
+ */
+static int
+llc_service_llc_pack_reply(struct pdu *reply, uint8_t *buffer)
+{
+  int len;
 
-  if (link->llc_down != (mqd_t) - 1)
-    mq_close(link->llc_down);
+  if (!reply) {
+    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Cannot allocate reply PDU");
+    return 0;
+  }
+  len = pdu_pack(reply, buffer, LLCP_MAX_PDU_SIZE);
+  pdu_free(reply);
 
-  link->llc_up   = (mqd_t) - 1;
-  link->llc_down = (mqd_t) - 1;
+  return MAX(len, 0);
 }
 
-void *
-llc_service_llc_thread(void *arg)
+/*
+ * Send a PDU to the MAC layer.  The LLC Link thread waits for room in the
+ * down queue, but an llcp_engine worker must not: the replies to an AGF PDU
+ * that do not fit are kept on the link, in order, and sent first on the
+ * next turns.  Returns -1 if the PDU had to be dropped.
+ */
+static int
+llc_service_llc_send(struct llc_link *link, mqd_t llc_down, const uint8_t *buffer, size_t len)
 {
-  struct llc_link *link = (struct llc_link *)arg;
-  mqd_t llc_up, llc_down;
+  struct timespec now = { 0, 0 };
+  struct pdu *pdu;
 
-  int old_cancelstate;
-#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
-  char *thread_name;
-#endif
+  if (link->thread)
+    return mq_send(llc_down, (const char *) buffer, len, 0);
 
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
+  if (!link->deferred.count) {
+    if (mq_timedsend(llc_down, (const char *) buffer, len, 0, &now) == 0)
+      return 0;
+    if ((errno != EAGAIN) && (errno != ETIMEDOUT))
+      return -1;
+  }
 
-  llc_up = mq_open(link->mq_up_name, O_RDONLY);
-  llc_down = mq_open(link->mq_down_name, O_WRONLY);
+  if (link->deferred.count == LLC_LINK_DEFERRED_REPLIES) {
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Dropping %zu bytes PDU: too many deferred replies", len);
+    return -1;
+  }
+  if (!(pdu = pdu_unpack(buffer, len))) {
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot defer %zu bytes PDU", len);
+    return -1;
+  }
+  link->deferred.pdus[(link->deferred.first + link->deferred.count) % LLC_LINK_DEFERRED_REPLIES] = pdu;
+  link->deferred.count++;
+  LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Deferring %zu bytes PDU", len);
 
-  if (llc_up == (mqd_t) - 1)
-    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", link->mq_up_name);
-  if (llc_down == (mqd_t) - 1)
-    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", link->mq_down_name);
+  return 0;
+}
 
-  pthread_cleanup_push(llc_service_llc_thread_cleanup, arg);
-  pthread_setcancelstate(old_cancelstate, NULL);
-  LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Link activated");
-  for (;;) {
-    int res;
-    uint8_t buffer[1024];
-    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "mq_receive+");
-    pthread_testcancel();
-    res = mq_receive(llc_up, (char *) buffer, sizeof(buffer), NULL);
-    pthread_testcancel();
-    if (res < 0) {
-      pthread_testcancel();
-    }
-    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Received %d bytes", res);
+/* Send the PDUs deferred by llc_service_llc_send() as room allows */
+static void
+llc_service_llc_send_deferred(struct llc_link *link, mqd_t llc_down, uint8_t *buffer)
+{
+  struct timespec now = { 0, 0 };
 
-    if (res < 2) {
-      /* FIXME: Maybe we'd rather quit */
-      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "Too short for a PDU (expected 2 bytes, got %d)", res);
-      buffer[0] = buffer[1] = '\0';
-      res = 2;
-    }
+  while (link->deferred.count) {
+    struct pdu *pdu = link->deferred.pdus[link->deferred.first];
+    int len = pdu_pack(pdu, buffer, LLCP_MAX_PDU_SIZE);
+    if ((len >= 0) && (mq_timedsend(llc_down, (const char *) buffer, len, 0, &now) < 0))
+      break;
+    pdu_free(pdu);
+    link->deferred.first = (link->deferred.first + 1) % LLC_LINK_DEFERRED_REPLIES;
+    link->deferred.count--;
+  }
+}
 
-    struct pdu *pdu;
-    struct pdu **pdus, **p;
-    struct llc_connection *connection;
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
-    pdu = pdu_unpack((uint8_t *) buffer, res);
-    switch (pdu->ptype) {
-      case PDU_SYMM:
-        assert(!pdu->dsap);
-        assert(!pdu->ssap);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Symmetry PDU");
+/*
+ * Receive flow control: send RNR once the connection up queue reaches its
+ * high watermark, and RR once the service drained it down to its low
+ * watermark.  Returns the length of the PDU to send, 0 if none.
+ */
+static int
+llc_service_llc_receive_flow_control(struct llc_connection *connection, uint8_t *buffer)
+{
+  struct mq_attr attr;
+  struct timespec now;
+  int len;
+
+  if (mq_getattr(connection->llc_up, &attr) < 0)
+    return 0;
+
+  if (!connection->local_busy && (attr.mq_curmsgs >= connection->high_watermark)) {
+    if (!(len = llc_service_llc_pack_reply(pdu_new_rnr(connection), buffer)))
+      return 0;
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_INFO, "Data Link Connection [%d -> %d] receive buffer is full", connection->local_sap, connection->remote_sap);
+    connection->local_busy = 1;
+    connection->busy.count++;
+    clock_gettime(CLOCK_MONOTONIC, &connection->busy.since);
+  } else if (connection->local_busy && (attr.mq_curmsgs <= connection->low_watermark)) {
+    if (!(len = llc_service_llc_pack_reply(pdu_new_rr(connection), buffer)))
+      return 0;
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_INFO, "Data Link Connection [%d -> %d] receive buffer drained", connection->local_sap, connection->remote_sap);
+    connection->local_busy = 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    connection->busy.time += (now.tv_sec - connection->busy.since.tv_sec) * 1000000000LL +
+                             (now.tv_nsec - connection->busy.since.tv_nsec);
+  } else {
+    return 0;
+  }
+
+  connection->state.ra = connection->state.r;
+
+  return len;
+}
+
+/*
+ * Start the service thread of a Logical Data Link.  Returns -1 if it cannot
+ * be launched.
+ */
+static int
+llc_service_llc_datagram_start(struct llc_link *link, struct llc_connection *connection)
+{
+  char thread_name[32];
+
+  connection->user_data = link->available_services[connection->service_sap]->user_data;
+  snprintf(thread_name, sizeof(thread_name), "LDL on SAP %d", connection->service_sap);
+  if (llcp_thread_create(&connection->thread, &link->thread_attributes, 0, thread_name, link->available_services[connection->service_sap]->thread_routine, connection) < 0) {
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Logical Data Link on SAP %d thread", connection->local_sap);
+    connection->thread = 0;
+    return -1;
+  }
+  llc_connection_set_status(connection, DLC_CONNECTED);
+
+  return 0;
+}
+
+/*
+ * Tell whether the service thread of a Logical Data Link is gone, and reap
+ * it.  Connectionless services may handle a single datagram and return.
+ */
+static int
+llc_service_llc_datagram_ended(struct llc_connection *connection)
+{
+  if (!connection->thread)
+    return 1;
+#if defined(HAVE_PTHREAD_TRYJOIN_NP)
+  if (pthread_tryjoin_np(connection->thread, NULL) != 0)
+    return 0;
+#else
+  if ((connection->status != DLC_DISCONNECTED) && (0 == pthread_kill(connection->thread, 0)))
+    return 0;
+  pthread_join(connection->thread, NULL);
+#endif
+  connection->thread = 0;
+
+  return 1;
+}
+
+/*
+ * Handle a single PDU.  frame holds its packed form, which is forwarded as is
+ * to the connections.  buffer is LLCP_MAX_PDU_SIZE bytes of scratch space for
+ * replies; it may hold frame, which is not read anymore once a reply is
+ * built.  Returns -1 once the link has been disconnected.
+ */
+static int
+llc_service_llc_dispatch(struct llc_link *link, mqd_t llc_down, const struct pdu *pdu, const uint8_t *frame, size_t frame_len, uint8_t *buffer)
+{
+  char thread_name[32];
+  struct llc_connection *connection;
+
+  switch (pdu->ptype) {
+    case PDU_SYMM:
+      assert(!pdu->dsap);
+      assert(!pdu->ssap);
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Symmetry PDU");
+      break;
+    case PDU_PAX:
+      assert(!pdu->dsap);
+      assert(!pdu->ssap);
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Parameter Exchange PDU");
+      if (!link->pax) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_WARN, "PAX PDU received on a link where they are prohibited");
         break;
-      case PDU_PAX:
-        assert(!pdu->dsap);
-        assert(!pdu->ssap);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Parameter Exchange PDU");
-        assert(0 == llc_link_configure(link, pdu->information, pdu->information_size));
+      }
+      if (llc_link_configure(link, pdu->information, pdu->information_size) < 0) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Invalid PAX PDU");
         break;
-      case PDU_AGF:
-        assert(!pdu->dsap);
-        assert(!pdu->ssap);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Aggregated Frame PDU");
-        p = pdus = pdu_dispatch(pdu);
-        while (*p) {
-          uint8_t buffer[BUFSIZ];
-          ssize_t length = pdu_pack(*p, buffer, sizeof(buffer));
-          mq_send(link->llc_up, (char *) buffer, length, 1);
-          pdu_free(*p);
-          p++;
-        }
+      }
+      if (link->pax_pending) {
+        /* The remote LLC answered our own PAX PDU */
+        link->pax_pending = 0;
+        break;
+      }
 
-        free(pdus);
+      int pax_len;
+      if ((pax_len = llc_link_pax_pack(link, buffer, LLCP_MAX_PDU_SIZE)) < 0) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Cannot build PAX PDU");
         break;
-      case PDU_SNL:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Service Name Lookup PDU");
-        if (!((link->version.major == 1) && (link->version.minor >= 1))) {
-          /*
-           * Even if we negociate LLCP 1.0, some LLCP implementation will
-           * use LLCP 1.1 SNL to discover available services so warn
-           * about this problem but perform th operation anyway.
-           */
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ALERT, "SNL PDU (LLCP 1.1) received on LLCP %d.%d link", link->version.major, link->version.minor);
+      }
+      if (llc_service_llc_send(link, llc_down, buffer, pax_len) < 0) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send PAX");
+      }
+      break;
+    case PDU_AGF:
+      assert(!pdu->dsap);
+      assert(!pdu->ssap);
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Aggregated Frame PDU");
+      /*
+       * Encapsulated PDUs are read in place from the information field and
+       * handled right away, in the order they were aggregated.
+       */
+      for (size_t offset = 0; offset < pdu->information_size;) {
+        struct pdu encapsulated;
+        size_t length;
+
+        if (offset + 2 > pdu->information_size) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Incomplete AGF PDU");
+          break;
         }
-        goto spawn_logical_data_link;
-
-      case PDU_UI:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Unnumbered Information PDU");
-spawn_logical_data_link:
-        if (!link->available_services[pdu->dsap]) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
+        length = pdu->information[offset] << 8 | pdu->information[offset + 1];
+        offset += 2;
+        if ((offset + length > pdu->information_size) ||
+            (pdu_unpack_view(pdu->information + offset, length, &encapsulated) < 0)) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Invalid PDU in AGF PDU");
           break;
         }
+        if (encapsulated.ptype == PDU_AGF) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_WARN, "Ignoring AGF PDU in AGF PDU");
+        } else {
+          llc_link_adapt_parameters(link, &encapsulated);
+          if (llc_service_llc_dispatch(link, llc_down, &encapsulated, pdu->information + offset, length, buffer) < 0)
+            return -1;
+        }
+        offset += length;
+      }
+      break;
+    case PDU_SNL:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Service Name Lookup PDU");
+      if (!((link->version.major == 1) && (link->version.minor >= 1))) {
+        /*
+         * Even if we negociate LLCP 1.0, some LLCP implementation will
+         * use LLCP 1.1 SNL to discover available services so warn
+         * about this problem but perform th operation anyway.
+         */
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ALERT, "SNL PDU (LLCP 1.1) received on LLCP %d.%d link", link->version.major, link->version.minor);
+      }
 
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Logical Data Link [%d -> %d]", pdu->ssap, pdu->dsap);
-        if (!(connection = llc_logical_data_link_new(link, pdu))) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Logical Data Link [%d -> %d]", pdu->ssap, pdu->dsap);
+      /*
+       * Answer all service discovery requests right away rather than
+       * spawning a Logical Data Link for the SDP service, in as many SNL
+       * PDUs as the remote MIU requires.
+       */
+      int snl_len;
+      size_t snl_offset = 0;
+      while ((snl_len = llc_service_sdp_snl(link, pdu, &snl_offset, buffer, MIN(LLCP_MAX_PDU_SIZE, 2u + LLCP_SEND_MIU(link->remote_miu)))) > 0) {
+        if (llc_service_llc_send(link, llc_down, buffer, snl_len) < 0) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send SNL");
           break;
         }
+      }
+      if (snl_len < 0)
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Invalid SNL PDU");
+      break;
+    case PDU_UI:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Unnumbered Information PDU");
+      if (!link->available_services[pdu->dsap]) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
+        break;
+      }
 
-        connection->user_data = link->available_services[pdu->dsap]->user_data;
-        if (pthread_create(&connection->thread, NULL, link->available_services[pdu->dsap]->thread_routine, connection) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Logical Data Link [%d -> %d] thread", connection->local_sap, connection->remote_sap);
+      /*
+       * A single Logical Data Link per service SAP receives the UI PDUs of
+       * all remote SAPs: only start it for the first one, and start its
+       * service again if it returned.
+       */
+      if ((connection = link->datagram_handlers[pdu->dsap]) && llc_service_llc_datagram_ended(connection)) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Restarting Logical Data Link on SAP %d", pdu->dsap);
+        if (llc_service_llc_datagram_start(link, connection) < 0) {
+          link->datagram_handlers[pdu->dsap] = NULL;
+          llc_connection_free(connection);
           break;
         }
-#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
-        asprintf(&thread_name, "LDL on SAP %d", connection->service_sap);
-        pthread_set_name_np(connection->thread, thread_name);
-        free(thread_name);
-#endif
-
-        if (mq_send(connection->llc_up, (char *) buffer, res, 0) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot send data to Logical Data Link [%d -> %d]", connection->local_sap, connection->remote_sap);
+      }
+      if (!connection) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Logical Data Link on SAP %d", pdu->dsap);
+        if (!(connection = llc_logical_data_link_new(link, pdu))) {
+          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Logical Data Link on SAP %d", pdu->dsap);
+          break;
+        }
+        if (llc_service_llc_datagram_start(link, connection) < 0) {
+          link->datagram_handlers[pdu->dsap] = NULL;
+          llc_connection_free(connection);
           break;
         }
+      }
 
+      /* Datagrams are unreliable: drop them rather than wait for a slow service */
+      struct timespec now = { 0, 0 };
+      if (mq_timedsend(connection->llc_up, (const char *) frame, frame_len, 0, &now) < 0) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Dropping UI PDU [%d -> %d]: Logical Data Link not ready", pdu->ssap, pdu->dsap);
         break;
-      case PDU_RR:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Receive Ready PDU");
+      }
 
-        assert(link->transmission_handlers[pdu->dsap]);
-        link->transmission_handlers[pdu->dsap]->state.sa = pdu->nr;
+      break;
+    case PDU_RR:
+    case PDU_RNR:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, (pdu->ptype == PDU_RR) ? "Receive Ready PDU" : "Receive Not Ready PDU");
+      if (!(connection = link->transmission_handlers[pdu->dsap])) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "No Data Link Connection on SAP %d", pdu->dsap);
         break;
-      case PDU_CONNECT:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Connect PDU");
-        if (!link->available_services[pdu->dsap]) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
-          struct pdu *reply;
-          int len;
-          uint8_t reason[] = { 0x02 };    // 0x02 ==> no service bound to the specified target SAP
-          reply = pdu_new_dm(pdu->ssap, pdu->dsap, reason);
-          len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Cannot reject connection");
-          }
-          break;
-        }
+      }
 
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Data Link Connection [%d -> %d] accept routine", pdu->ssap, pdu->dsap);
-        int error;
-        if (!(connection = llc_data_link_connection_new(link, pdu, &error))) {
-          struct pdu *reply;
-          int len;
-          uint8_t reason[] = { error };
-
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Data Link Connection [%d -> %d] (reason = %02x)", pdu->ssap, pdu->dsap, error);
-          reply = pdu_new_dm(pdu->ssap, pdu->dsap, reason);
-          len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't Reject connection");
-          }
-          break;
-        }
-        if (!link->available_services[connection->service_sap]->accept_routine) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Data Link Connection [%d -> %d] accepted (no accept routine provided)", connection->local_sap, connection->remote_sap);
-          connection->status = DLC_ACCEPTED;
-        } else if (pthread_create(&connection->thread, NULL, link->available_services[connection->service_sap]->accept_routine, connection) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Data Link Connection [%d -> %d] accept routine", connection->local_sap, connection->remote_sap);
-          break;
+      /*
+       * Both acknowledge I PDUs.  RNR stops the transmission of I PDUs on
+       * the connection until the remote LLC sends RR.
+       */
+      connection->state.sa = pdu->nr;
+      connection->remote_busy = (pdu->ptype == PDU_RNR);
+      break;
+    case PDU_CONNECT:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Connect PDU");
+      if (!link->available_services[pdu->dsap]) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "No service bound to SAP %d", pdu->dsap);
+        int len;
+        uint8_t reason[] = { 0x02 };    // 0x02 ==> no service bound to the specified target SAP
+        if ((len = llc_service_llc_pack_reply(pdu_new_dm(pdu->ssap, pdu->dsap, reason), buffer)) &&
+            (llc_service_llc_send(link, llc_down, buffer, len) < 0)) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Cannot reject connection");
         }
-#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
-        asprintf(&thread_name, "DLC Accept on SAP %d", connection->service_sap);
-        pthread_set_name_np(connection->thread, thread_name);
-        free(thread_name);
-#endif
+        break;
+      }
 
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accept routine launched (service %d)", connection->local_sap, connection->remote_sap, connection->service_sap);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Spawning Data Link Connection [%d -> %d] accept routine", pdu->ssap, pdu->dsap);
+      int error;
+      if (!(connection = llc_data_link_connection_new(link, pdu, &error))) {
+        int len;
+        uint8_t reason[] = { error };
+
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot establish Data Link Connection [%d -> %d] (reason = %02x)", pdu->ssap, pdu->dsap, error);
+        if ((len = llc_service_llc_pack_reply(pdu_new_dm(pdu->ssap, pdu->dsap, reason), buffer)) &&
+            (llc_service_llc_send(link, llc_down, buffer, len) < 0)) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't Reject connection");
+        }
         break;
-      case PDU_DISC:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Disconnect PDU");
-        if (!pdu->dsap && !pdu->ssap) {
-          link->status = LL_DEACTIVATED;
-          pthread_exit((void *) 2);
-          break;
+      }
+      if (link->available_services[connection->service_sap]->accept_callback) {
+        /* Decide right away: the CC or DM goes out in this exchange */
+        connection->user_data = link->available_services[connection->service_sap]->user_data;
+        if (link->available_services[connection->service_sap]->accept_callback(connection) < 0) {
+          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] rejected", connection->local_sap, connection->remote_sap);
+          llc_connection_set_status(connection, DLC_REJECTED);
         } else {
-          struct pdu *reply;
-
-          llc_connection_stop(link->transmission_handlers[pdu->dsap]);
-          llc_connection_free(link->transmission_handlers[pdu->dsap]);
-          link->transmission_handlers[pdu->dsap] = NULL;
-
-          uint8_t reason[1] = { 0x00 };
-          reply = pdu_new_dm(pdu->ssap, pdu->dsap, reason);
-          int len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send DM");
-          }
+          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accepted", connection->local_sap, connection->remote_sap);
+          llc_connection_set_status(connection, DLC_ACCEPTED);
         }
         break;
-      case PDU_CC:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Connection Complete PDU");
-        connection = link->transmission_handlers[pdu->dsap];
-        connection->remote_sap = pdu->ssap;
-        connection->status = DLC_RECEIVED_CC;
+      }
+      if (!link->available_services[connection->service_sap]->accept_routine) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Data Link Connection [%d -> %d] accepted (no accept routine provided)", connection->local_sap, connection->remote_sap);
+        llc_connection_set_status(connection, DLC_ACCEPTED);
         break;
-      case PDU_DM:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Disconnected Mode PDU");
-        llc_connection_stop(link->transmission_handlers[pdu->dsap]);
-        link->transmission_handlers[pdu->dsap]->status = DLC_REJECTED;
+      }
+      snprintf(thread_name, sizeof(thread_name), "DLC Accept %d", connection->service_sap);
+      if (llcp_thread_create(&connection->thread, &link->thread_attributes, 0, thread_name, link->available_services[connection->service_sap]->accept_routine, connection) < 0) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot launch Data Link Connection [%d -> %d] accept routine", connection->local_sap, connection->remote_sap);
         break;
-      case PDU_I:
-        assert(link->transmission_handlers[pdu->dsap]);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Information PDU");
+      }
+
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accept routine launched (service %d)", connection->local_sap, connection->remote_sap, connection->service_sap);
+      break;
+    case PDU_DISC:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Disconnect PDU");
+      if (!pdu->dsap && !pdu->ssap) {
+        link->status = LL_DEACTIVATED;
+        return -1;
+      } else {
+        llc_connection_stop(link->transmission_handlers[pdu->dsap]);
+        llc_connection_free(link->transmission_handlers[pdu->dsap]);
+        link->transmission_handlers[pdu->dsap] = NULL;
+
+        uint8_t reason[1] = { 0x00 };
+        int len;
+        if ((len = llc_service_llc_pack_reply(pdu_new_dm(pdu->ssap, pdu->dsap, reason), buffer)) &&
+            (llc_service_llc_send(link, llc_down, buffer, len) < 0)) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send DM");
+        }
+      }
+      break;
+    case PDU_CC:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Connection Complete PDU");
+      connection = link->transmission_handlers[pdu->dsap];
+      connection->remote_sap = pdu->ssap;
+      struct llcp_parameters cc_params;
+      if (parameters_decode(pdu->information, pdu->information_size, &cc_params) < 0) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Invalid CC parameters");
+      } else {
+        if (cc_params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_MIUX))
+          connection->remote_miu = LLCP_DEFAULT_MIU + cc_params.miux;
+        if (cc_params.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_RW))
+          connection->rwr = cc_params.rw;
+      }
+      llc_connection_set_status(connection, DLC_RECEIVED_CC);
+      break;
+    case PDU_DM:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Disconnected Mode PDU");
+      llc_connection_stop(link->transmission_handlers[pdu->dsap]);
+      llc_connection_set_status(link->transmission_handlers[pdu->dsap], DLC_REJECTED);
+      break;
+    case PDU_I:
+      assert(link->transmission_handlers[pdu->dsap]);
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Information PDU");
 #if defined(HAVE_DEBUG)
-        struct mq_attr attr;
-        mq_getattr(link->transmission_handlers[pdu->dsap]->llc_up, &attr);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "MQ: %d / %d x %d bytes", attr.mq_curmsgs, attr.mq_maxmsg, attr.mq_msgsize);
+      struct mq_attr attr;
+      mq_getattr(link->transmission_handlers[pdu->dsap]->llc_up, &attr);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "MQ: %d / %d x %d bytes", attr.mq_curmsgs, attr.mq_maxmsg, attr.mq_msgsize);
 #endif
-        if (pdu->ns != link->transmission_handlers[pdu->dsap]->state.r) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Invalid N(S)");
-          struct pdu *reply = pdu_new_frmr(pdu->ssap, pdu->dsap, pdu, link->transmission_handlers[pdu->dsap], FRMR_S);
-          int len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
-          }
-
-          break;
+      if (pdu->ns != link->transmission_handlers[pdu->dsap]->state.r) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Invalid N(S)");
+        int len;
+        if ((len = llc_service_llc_pack_reply(pdu_new_frmr(pdu->ssap, pdu->dsap, pdu, link->transmission_handlers[pdu->dsap], FRMR_S), buffer)) &&
+            (llc_service_llc_send(link, llc_down, buffer, len) < 0)) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
         }
 
-        if (pdu->information_size > link->transmission_handlers[pdu->dsap]->local_miu) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "Information PDU too long: %d (MIU: %d)", pdu->information_size, link->transmission_handlers[pdu->dsap]->local_miu);
-          struct pdu *reply = pdu_new_frmr(pdu->ssap, pdu->dsap, pdu, link->transmission_handlers[pdu->dsap], FRMR_I);
-          int len = pdu_pack(reply, buffer, sizeof(buffer));
-          pdu_free(reply);
-          if (mq_send(llc_down, (char *) buffer, len, 0) < 0) {
-            LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
-          }
+        break;
+      }
 
-          break;
+      if (pdu->information_size > link->transmission_handlers[pdu->dsap]->local_miu) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "Information PDU too long: %d (MIU: %d)", pdu->information_size, link->transmission_handlers[pdu->dsap]->local_miu);
+        int len;
+        if ((len = llc_service_llc_pack_reply(pdu_new_frmr(pdu->ssap, pdu->dsap, pdu, link->transmission_handlers[pdu->dsap], FRMR_I), buffer)) &&
+            (llc_service_llc_send(link, llc_down, buffer, len) < 0)) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
         }
 
-        INC_MOD_16(link->transmission_handlers[pdu->dsap]->state.r);
-        link->transmission_handlers[pdu->dsap]->state.sa = pdu->nr;
-
-        if (mq_send(link->transmission_handlers[pdu->dsap]->llc_up, (char *) buffer, res, 0) < 0) {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Error sending %d bytes to service %d", res, pdu->dsap);
-        } else {
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_INFO, "Send %d bytes to service %d", res, pdu->dsap);
-        }
         break;
-      case PDU_FRMR:
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Frame Reject PDU");
-        assert(pdu->information_size == 4);
-        if (pdu->information[0] & 0x80) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU was invalid or malformed");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU was valid and wellformed");
-        }
-        if (pdu->information[0] & 0x40) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU has incorect or unexpected information field");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU has no incorect or unexpected information field");
-        }
-        if (pdu->information[0] & 0x20) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid receive sequence number N(R)");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid receive sequence number N(R)");
-        }
-        if (pdu->information[0] & 0x10) {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid send sequence number N(S)");
-        } else {
-          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid send sequence number N(S)");
-        }
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Rejected frame informations:");
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  PDU type: %d", pdu->information[0] & 0x0F);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  Sequence: %02x", pdu->information[1]);
-        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Receiver status:");
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(S):  %02x", pdu->information[2] >> 4);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(R):  %02x", pdu->information[2] & 0x0F);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(SA): %02x", pdu->information[3] >> 4);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(RA): %02x", pdu->information[3] & 0x0F);
+      }
 
+      /*
+       * An llcp_engine worker runs links without a thread and must not wait
+       * for a service.  Receive flow control keeps a well-behaved remote LLC
+       * from filling the up queue: reject the I PDU of one that does.
+       */
+      connection = link->transmission_handlers[pdu->dsap];
+      struct timespec deadline = { 0, 0 };
+      if ((link->thread ? mq_send(connection->llc_up, (const char *) frame, frame_len, 0) :
+           mq_timedsend(connection->llc_up, (const char *) frame, frame_len, 0, &deadline)) < 0) {
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Error sending %zu bytes to service %d", frame_len, pdu->dsap);
+        int len;
+        if ((len = llc_service_llc_pack_reply(pdu_new_frmr(pdu->ssap, pdu->dsap, pdu, connection, FRMR_S), buffer)) &&
+            (llc_service_llc_send(link, llc_down, buffer, len) < 0)) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Can't send FRMR");
+        }
         break;
-      default:
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Unsupported LLC PDU: 0x%02x", pdu->ptype);
-        abort();
-    }
-    pdu_free(pdu);
-    pthread_setcancelstate(old_cancelstate, NULL);
+      }
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_INFO, "Send %zu bytes to service %d", frame_len, pdu->dsap);
+
+      INC_MOD_16(connection->state.r);
+      connection->state.sa = pdu->nr;
+      break;
+    case PDU_FRMR:
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Frame Reject PDU");
+      assert(pdu->information_size == 4);
+      if (pdu->information[0] & 0x80) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU was invalid or malformed");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU was valid and wellformed");
+      }
+      if (pdu->information[0] & 0x40) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU has incorect or unexpected information field");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU has no incorect or unexpected information field");
+      }
+      if (pdu->information[0] & 0x20) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid receive sequence number N(R)");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid receive sequence number N(R)");
+      }
+      if (pdu->information[0] & 0x10) {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "PDU contains an invalid send sequence number N(S)");
+      } else {
+        LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "PDU contains a valid send sequence number N(S)");
+      }
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Rejected frame informations:");
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  PDU type: %d", pdu->information[0] & 0x0F);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  Sequence: %02x", pdu->information[1]);
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_ERROR, "Receiver status:");
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(S):  %02x", pdu->information[2] >> 4);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(R):  %02x", pdu->information[2] & 0x0F);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(SA): %02x", pdu->information[3] >> 4);
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "  V(RA): %02x", pdu->information[3] & 0x0F);
+
+      break;
+    default:
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Unsupported LLC PDU: 0x%02x", pdu->ptype);
+      abort();
+  }
 
-    /* ---------------- */
+  return 0;
+}
 
-    ssize_t length = 0;
-    for (int i = 0; i <= MAX_LOGICAL_DATA_LINK; i++) {
-      if (link->datagram_handlers[i]) {
-        pthread_t thread = link->datagram_handlers[i]->thread;
-        length = mq_receive(link->datagram_handlers[i]->llc_down, (char *) buffer, sizeof(buffer), NULL);
-        if (length > 0)
+/*
+ * Get the next PDU of a Logical Data Link into buffer, and garbage-collect
+ * the Logical Data Link once it is done.  Returns the PDU length, 0 if none.
+ */
+static ssize_t
+llc_service_llc_datagram_pdu(struct llc_link *link, int i, uint8_t *buffer)
+{
+  struct llc_connection *connection = link->datagram_handlers[i];
+  ssize_t length = mq_receive(connection->llc_down, (char *) buffer, LLCP_MAX_PDU_SIZE, NULL);
+  if (length > 0)
+    return length;
+  switch (errno) {
+    case EAGAIN:
+      if (llc_service_llc_datagram_ended(connection)) {
+        struct mq_attr attr;
+        /* Datagrams arrived after the service returned: run it again */
+        if (link->available_services[connection->service_sap] &&
+            (mq_getattr(connection->llc_up, &attr) == 0) && attr.mq_curmsgs &&
+            (llc_service_llc_datagram_start(link, connection) == 0))
           break;
-        switch (errno) {
-          case EAGAIN:
-            if (!thread) {
-              /*
-               * The service is not running anymore and it's down
-               * queue is empty.  It can be garbage collected.
-               */
-              LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Logical Data Link [%d -> %d]", link->datagram_handlers[i]->local_sap, link->datagram_handlers[i]->remote_sap);
-              llc_connection_free(link->datagram_handlers[i]);
-              link->datagram_handlers[i] = NULL;
-            }
-            /* FALLTHROUGH */
-          case EINTR:
-          case ETIMEDOUT: /* XXX Should not happend */
-            /* NOOP */
-            break;
-          default:
-            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can' read from service %d message queue", i);
-            break;
-        }
+        /*
+         * The service is not running anymore and it's down
+         * queue is empty.  It can be garbage collected.
+         */
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Logical Data Link [%d -> %d]", link->datagram_handlers[i]->local_sap, link->datagram_handlers[i]->remote_sap);
+        llc_connection_free(link->datagram_handlers[i]);
+        link->datagram_handlers[i] = NULL;
       }
-    }
-    for (int i = 1; i <= MAX_LLC_LINK_SERVICE; i++) {
-      if (link->transmission_handlers[i]) {
-        pthread_t thread = link->transmission_handlers[i]->thread;
-        length = mq_receive(link->transmission_handlers[i]->llc_down, (char *) buffer, sizeof(buffer), NULL);
-        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Read %d bytes from service %d", length, i);
-        if (length > 0) {
+      /* FALLTHROUGH */
+    case EINTR:
+    case ETIMEDOUT: /* XXX Should not happend */
+      /* NOOP */
+      break;
+    default:
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can' read from service %d message queue", i);
+      break;
+  }
+
+  return 0;
+}
+
+/*
+ * Get the next PDU of a Data Link Connection into buffer: flow control,
+ * data, acknowledgement or connection management.  Returns the PDU length,
+ * 0 if none.
+ */
+static ssize_t
+llc_service_llc_connection_pdu(struct llc_link *link, int i, uint8_t *buffer)
+{
+  char thread_name[32];
+  struct llc_connection *connection = link->transmission_handlers[i];
+  pthread_t thread = link->transmission_handlers[i]->thread;
+  ssize_t length;
+
+  if ((connection->status == DLC_CONNECTED) &&
+      ((length = llc_service_llc_receive_flow_control(connection, buffer)) > 0))
+    return length;
+  if (connection->remote_busy || (connection->state.s == (connection->state.sa + connection->rwr) % 16)) {
+    /*
+     * The remote LLC can't take more data now.  Leave the PDUs in the
+     * queue, so that the service sees backpressure, and keep servicing
+     * the connection.
+     */
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] %s.  Postponing message delivery", connection->local_sap, connection->remote_sap, connection->remote_busy ? "remote LLC is busy" : "send-window is full");
+    length = -1;
+    errno = EAGAIN;
+  } else {
+    length = mq_receive(link->transmission_handlers[i]->llc_down, (char *) buffer, LLCP_MAX_PDU_SIZE, NULL);
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Read %d bytes from service %d", length, i);
+  }
+  if (length > 0) {
 #if defined(HAVE_DEBUG)
-          LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "%d %d %d %d",
-                              link->transmission_handlers[i]->state.s,
-                              link->transmission_handlers[i]->state.sa,
-                              link->transmission_handlers[i]->state.r,
-                              link->transmission_handlers[i]->state.ra
-                             );
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "%d %d %d %d",
+                        link->transmission_handlers[i]->state.s,
+                        link->transmission_handlers[i]->state.sa,
+                        link->transmission_handlers[i]->state.r,
+                        link->transmission_handlers[i]->state.ra
+                       );
 #endif
-          struct pdu *pdu = pdu_unpack(buffer, length);
-
-          if (pdu->ptype == PDU_I) {
-            if (link->transmission_handlers[i]->state.s == link->transmission_handlers[i]->state.sa + link->transmission_handlers[i]->rwr) {
-              /*
-               * We can't send data now
-               */
-              LLC_SERVICE_LLC_LOG(LLC_PRIORITY_WARN, "Data Link Connection [%d -> %d] send-window is full.  Postponing message delivery", link->transmission_handlers[i]->local_sap, link->transmission_handlers[i]->remote_sap);
-              mq_send(link->transmission_handlers[i]->llc_down, (char *) buffer, length, 1);
-              length = -1;
-              continue;
-            }
-          }
-          struct pdu *reply = pdu_new_i(pdu->dsap, pdu->ssap, link->transmission_handlers[i], pdu->information, pdu->information_size);
-          length = pdu_pack(pdu, buffer, sizeof(buffer));
-          free(reply);
-          pdu_free(pdu);
-          INC_MOD_16(link->transmission_handlers[i]->state.s);
-          break;
-        }
-        switch (errno) {
-          case EAGAIN:
-            if (thread) {
-              /*
-               * If we have received some data not yet acknoledge, do it now.
-               */
+    struct pdu pdu;
+    if (pdu_unpack_view(buffer, length, &pdu) < 0) {
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Dropping PDU from service %d", i);
+      return 0;
+    }
+
+    if (pdu.ptype == PDU_I) {
+      /*
+       * Sequence numbers are only known when the PDU is actually sent:
+       * fill in N(S) and N(R) in place.
+       */
+      buffer[2] = connection->state.s << 4 | connection->state.r;
+      INC_MOD_16(connection->state.s);
+      connection->state.ra = connection->state.r;
+    }
+    return length;
+  }
+  switch (errno) {
+    case EAGAIN:
+      if (thread) {
+        /*
+         * If we have received some data not yet acknoledge, do it now.
+         */
 #if defined(HAVE_DEBUG)
-              LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "%d %d %d %d",
-                                  link->transmission_handlers[i]->state.s,
-                                  link->transmission_handlers[i]->state.sa,
-                                  link->transmission_handlers[i]->state.r,
-                                  link->transmission_handlers[i]->state.ra
-                                 );
+        LLC_SERVICE_LLC_LOG(LLC_PRIORITY_DEBUG, "%d %d %d %d",
+                            link->transmission_handlers[i]->state.s,
+                            link->transmission_handlers[i]->state.sa,
+                            link->transmission_handlers[i]->state.r,
+                            link->transmission_handlers[i]->state.ra
+                           );
 #endif
 
-              if (link->transmission_handlers[i]->state.ra != link->transmission_handlers[i]->state.r) {
-                LLC_SERVICE_LLC_MSG(LLC_PRIORITY_WARN, "Send acknoledgment for received data");
-                struct pdu *reply;
-                struct mq_attr attr;
-                mq_getattr(link->transmission_handlers[i]->llc_up, &attr);
-                if (attr.mq_curmsgs == attr.mq_maxmsg) {
-                  LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Message queue is full");
-                  reply = pdu_new_rnr(link->transmission_handlers[i]);
-                } else {
-                  reply = pdu_new_rr(link->transmission_handlers[i]);
-                }
-                length = pdu_pack(reply, buffer, sizeof(buffer));
-                pdu_free(reply);
-                link->transmission_handlers[i]->state.ra = link->transmission_handlers[i]->state.r;
-                break;
-              }
-            } else {
-              struct pdu *reply;
-              uint8_t reason[] = { 0x00 };
-              switch (link->transmission_handlers[i]->status) {
-                case DLC_NEW:
-                case DLC_CONNECTED:
-                  /*
-                   * The llc_connection thread is running.
-                   * Do nothing.
-                   */
-                  break;
-                case DLC_ACCEPTED:
-                  LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accepted (service %d).  Sending CC", connection->local_sap, connection->remote_sap, connection->service_sap);
-                  reply = pdu_new_cc(connection);
-                  length = pdu_pack(reply, buffer, sizeof(buffer));
-                  pdu_free(reply);
-                  /* FALLTHROUGH */
-                case DLC_RECEIVED_CC:
-                  connection->user_data = link->available_services[connection->service_sap]->user_data;
-                  if (pthread_create(&connection->thread, NULL, connection->link->available_services[connection->service_sap]->thread_routine, connection) < 0) {
-                    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Cannot start Data Link Connection thread");
-                    link->transmission_handlers[i]->status = DLC_DISCONNECTED;
-                    break;
-                  }
-#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
-                  asprintf(&thread_name, "DLC on SAP %d", connection->service_sap);
-                  pthread_set_name_np(connection->thread, thread_name);
-                  free(thread_name);
-#endif
-                  link->transmission_handlers[i]->status = DLC_CONNECTED;
-                  break;
-                case DLC_REJECTED:
-                  reason[0] = 0x03;
-                  link->transmission_handlers[i]->status = DLC_DISCONNECTED;
-                  /* FALLTHROUGH */
-                case DLC_DISCONNECTED:
-                  reply = pdu_new_dm(connection->remote_sap, connection->local_sap, reason);
-                  length = pdu_pack(reply, buffer, sizeof(buffer));
-                  pdu_free(reply);
-                  link->transmission_handlers[i]->status = DLC_TERMINATED;
-                  /* FALLTHROUGH */
-                case DLC_TERMINATED:
-                  /*
-                   * The service is not running anymore and it's down
-                   * queue is empty.  It can be garbage collected.
-                   */
-                  LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Data Link Connection [%d -> %d]", link->transmission_handlers[i]->local_sap, link->transmission_handlers[i]->remote_sap);
-                  llc_connection_free(link->transmission_handlers[i]);
-                  link->transmission_handlers[i] = NULL;
-                  break;
-              }
-            }
+        if (link->transmission_handlers[i]->state.ra != link->transmission_handlers[i]->state.r) {
+          LLC_SERVICE_LLC_MSG(LLC_PRIORITY_WARN, "Send acknoledgment for received data");
+          if (!(length = llc_service_llc_pack_reply(connection->local_busy ? pdu_new_rnr(connection) : pdu_new_rr(connection), buffer)))
+            return 0;
+          link->transmission_handlers[i]->state.ra = link->transmission_handlers[i]->state.r;
+          return length;
+        }
+      } else {
+        uint8_t reason[] = { 0x00 };
+        length = 0;
+        switch (link->transmission_handlers[i]->status) {
+          case DLC_NEW:
+          case DLC_CONNECTED:
+            /*
+             * The llc_connection thread is running.
+             * Do nothing.
+             */
+            break;
+          case DLC_ACCEPTED:
+            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Data Link Connection [%d -> %d] accepted (service %d).  Sending CC", connection->local_sap, connection->remote_sap, connection->service_sap);
+            /* Stay accepted and try again if the CC cannot be built */
+            if (!(length = llc_service_llc_pack_reply(pdu_new_cc(connection), buffer)))
+              break;
             /* FALLTHROUGH */
-          case EINTR:
-          case ETIMEDOUT: /* XXX Should not happend */
-            /* NOOP */
+          case DLC_RECEIVED_CC:
+            connection->user_data = link->available_services[connection->service_sap]->user_data;
+            snprintf(thread_name, sizeof(thread_name), "DLC on SAP %d", connection->service_sap);
+            if (llcp_thread_create(&connection->thread, &link->thread_attributes, 0, thread_name, connection->link->available_services[connection->service_sap]->thread_routine, connection) < 0) {
+              LLC_SERVICE_LLC_MSG(LLC_PRIORITY_FATAL, "Cannot start Data Link Connection thread");
+              llc_connection_set_status(link->transmission_handlers[i], DLC_DISCONNECTED);
+              break;
+            }
+            llc_connection_set_status(link->transmission_handlers[i], DLC_CONNECTED);
             break;
-          default:
-            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can't read from service %d message queue", i);
+          case DLC_REJECTED:
+            reason[0] = 0x03;
+            llc_connection_set_status(link->transmission_handlers[i], DLC_DISCONNECTED);
+            /* FALLTHROUGH */
+          case DLC_DISCONNECTED:
+            if (!(length = llc_service_llc_pack_reply(pdu_new_dm(connection->remote_sap, connection->local_sap, reason), buffer)))
+              break;
+            llc_connection_set_status(link->transmission_handlers[i], DLC_TERMINATED);
+            /* FALLTHROUGH */
+          case DLC_TERMINATED:
+            /*
+             * The service is not running anymore and it's down
+             * queue is empty.  It can be garbage collected.
+             */
+            LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Garbage-collecting Data Link Connection [%d -> %d]", link->transmission_handlers[i]->local_sap, link->transmission_handlers[i]->remote_sap);
+            llc_connection_free(link->transmission_handlers[i]);
+            link->transmission_handlers[i] = NULL;
             break;
         }
+        if (length > 0)
+          return length;
       }
-    }
+      /* FALLTHROUGH */
+    case EINTR:
+    case ETIMEDOUT: /* XXX Should not happend */
+      /* NOOP */
+      break;
+    default:
+      LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Can't read from service %d message queue", i);
+      break;
+  }
 
-    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "mq_send+");
-    pthread_testcancel();
+  return 0;
+}
+
+/* Service weight of a flow, see llc_service_llc_schedule() */
+static int
+llc_service_llc_flow_weight(const struct llc_link *link, int flow)
+{
+  const struct llc_connection *connection;
+  const struct llc_service *service;
+
+  if (flow <= MAX_LLC_LINK_SERVICE) {
+    if (!(connection = link->datagram_handlers[flow]))
+      return 1;
+    service = link->available_services[connection->local_sap];
+  } else {
+    if (!(connection = link->transmission_handlers[flow - MAX_LLC_LINK_SERVICE - 1]))
+      return 1;
+    service = link->available_services[connection->service_sap];
+  }
+
+  return service ? service->weight : 1;
+}
 
-    if (length <= 0) {
-      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Nothing to send");
-      continue;
+/*
+ * Pick the next PDU to send with deficit round-robin.  Each Logical Data
+ * Link and Data Link Connection is a flow.  When its turn comes, a flow is
+ * granted its service weight times the link MIU in bytes, and keeps sending
+ * until it used it up or has nothing left to send.  A flow may overdraw
+ * with its last PDU: the debt is paid back on its next turns.  Returns the
+ * length of the PDU in buffer, 0 if no flow has anything to send.
+ */
+static ssize_t
+llc_service_llc_schedule(struct llc_link *link, uint8_t *buffer)
+{
+  int32_t quantum = 3 + link->remote_miu;
+
+  /* Visiting every flow twice leaves room for one debt repayment */
+  for (int n = 0; n < 2 * LLC_LINK_FLOWS; n++) {
+    int flow = link->scheduler.current;
+    int32_t *deficit = &link->scheduler.deficit[flow];
+    ssize_t length = 0;
+
+    if (*deficit <= 0)
+      *deficit += quantum * llc_service_llc_flow_weight(link, flow);
+
+    if (*deficit > 0) {
+      if (flow <= MAX_LLC_LINK_SERVICE) {
+        if (link->datagram_handlers[flow])
+          length = llc_service_llc_datagram_pdu(link, flow, buffer);
+      } else {
+        if (link->transmission_handlers[flow - MAX_LLC_LINK_SERVICE - 1])
+          length = llc_service_llc_connection_pdu(link, flow - MAX_LLC_LINK_SERVICE - 1, buffer);
+      }
+
+      if (length > 0) {
+        *deficit -= length;
+        if (*deficit <= 0)
+          link->scheduler.current = (flow + 1) % LLC_LINK_FLOWS;
+        return length;
+      }
+
+      /* Idle flows do not save up credit */
+      *deficit = 0;
     }
+    link->scheduler.current = (flow + 1) % LLC_LINK_FLOWS;
+  }
 
-    res = mq_send(llc_down, (char *) buffer, length, 0);
-    pthread_testcancel();
+  return 0;
+}
+
+/*
+ * Handle a PDU received from the MAC layer, then send at most one PDU from
+ * the link's connections.  buffer must be LLCP_MAX_PDU_SIZE bytes long.
+ * Returns -1 once the link has been disconnected.
+ */
+int
+llc_service_llc_process(struct llc_link *link, mqd_t llc_down, uint8_t *buffer, int res)
+{
+  if (res < 2) {
+    /* FIXME: Maybe we'd rather quit */
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_FATAL, "Too short for a PDU (expected 2 bytes, got %d)", res);
+    buffer[0] = buffer[1] = '\0';
+    res = 2;
+  }
+
+  struct pdu *pdu;
+  if ((pdu = pdu_unpack((uint8_t *) buffer, res))) {
+    llc_link_adapt_parameters(link, pdu);
+    int disconnected = llc_service_llc_dispatch(link, llc_down, pdu, buffer, res, buffer);
+    pdu_free(pdu);
+    if (disconnected < 0)
+      return -1;
+  } else {
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot unpack %d bytes PDU", res);
+  }
+
+  /* ---------------- */
+
+  /* Deferred replies take the turn of the scheduled PDUs */
+  llc_service_llc_send_deferred(link, llc_down, buffer);
+  if (link->deferred.count)
+    return 0;
+
+  ssize_t length = llc_service_llc_schedule(link, buffer);
+
+  LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "mq_send+");
+
+  if (length <= 0) {
+    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "Nothing to send");
+    return 0;
+  }
+
+  if (llc_service_llc_send(link, llc_down, buffer, length) < 0) {
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "Cannot send %d bytes", length);
+  } else {
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Sent %d bytes", length);
+  }
 
+  return 0;
+}
+
+void *
+llc_service_llc_thread(void *arg)
+{
+  struct llc_link *link = (struct llc_link *)arg;
+  mqd_t queues[2];
+
+  int old_cancelstate;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
+
+  mqd_t llc_up = queues[0] = mq_open(link->mq_up_name, O_RDONLY);
+  mqd_t llc_down = queues[1] = mq_open(link->mq_down_name, O_WRONLY);
+
+  if (llc_up == (mqd_t) - 1)
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", link->mq_up_name);
+  if (llc_down == (mqd_t) - 1)
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_ERROR, "mq_open(%s)", link->mq_down_name);
+
+  pthread_cleanup_push(llc_service_llc_thread_cleanup, queues);
+  pthread_setcancelstate(old_cancelstate, NULL);
+  LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Link activated");
+  for (;;) {
+    int res;
+    uint8_t buffer[LLCP_MAX_PDU_SIZE];
+    LLC_SERVICE_LLC_MSG(LLC_PRIORITY_TRACE, "mq_receive+");
+    pthread_testcancel();
+    res = mq_receive(llc_up, (char *) buffer, sizeof(buffer), NULL);
+    pthread_testcancel();
     if (res < 0) {
       pthread_testcancel();
     }
-    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Sent %d bytes", length);
+    LLC_SERVICE_LLC_LOG(LLC_PRIORITY_TRACE, "Received %d bytes", res);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
+    pthread_mutex_lock(&link->lock);
+    /*
+     * Once disconnected, the thread keeps waiting for PDUs so that the link
+     * can be recycled for the next activation.
+     */
+    if (llc_service_llc_process(link, llc_down, buffer, res) < 0)
+      LLC_SERVICE_LLC_MSG(LLC_PRIORITY_INFO, "Link disconnected");
+    pthread_mutex_unlock(&link->lock);
+    pthread_setcancelstate(old_cancelstate, NULL);
+    pthread_testcancel();
   }
   pthread_cleanup_pop(1);
   return NULL;
@@ -22,6 +22,12 @@
 #ifndef _LLC_SERVICE_LLC_H
 #define _LLC_SERVICE_LLC_H
 
+#include <mqueue.h>
+#include <stdint.h>
+
+struct llc_link;
+
+int		 llc_service_llc_process(struct llc_link *link, mqd_t llc_down, uint8_t *buffer, int res);
 void		*llc_service_llc_thread(void *arg);
 
 #endif /* !_LLC_SERVICE_LLC_H */
@@ -21,9 +21,13 @@
 
 #include "config.h"
 
+#include <sys/param.h>
+
+#include <assert.h>
 #include <fcntl.h>
 #include <mqueue.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "llcp.h"
@@ -33,6 +37,7 @@
 #include "llc_service.h"
 #include "llc_service_sdp.h"
 #include "llcp_parameters.h"
+#include "llcp_pdu.h"
 
 #define LOG_LLC_SDP "libllcp.llc.sdp"
 #define LLC_SDP_MSG(priority, message) llcp_log_log (LOG_LLC_SDP, priority, "(%p) %s", pthread_self (), message)
@@ -40,6 +45,97 @@
 
 /* Service Discovery Protocol */
 
+/*
+ * Answer the SDREQ parameters of a SNL PDU with a SNL PDU, and record the
+ * SDRES parameters in the link's SDP cache.
+ *
+ * Parameters are read from *offset in the information field of pdu.  When
+ * the answers do not all fit in len bytes, *offset is left on the first
+ * SDREQ that was not answered, so that the next call builds another SNL PDU
+ * with the remaining answers; it reaches the end of the information field
+ * otherwise.
+ *
+ * The reply is packed in buffer and its length is returned.  When there is
+ * nothing to answer, 0 is returned.  Malformed PDUs make the function return
+ * -1.  This function does not allocate memory so that it can be called from
+ * the LLC Link thread.
+ */
+int
+llc_service_sdp_snl(struct llc_link *link, const struct pdu *pdu, size_t *offset, uint8_t *buffer, size_t len)
+{
+  assert(link);
+  assert(pdu);
+  assert(offset);
+  assert(buffer);
+
+  if (len < 2) {
+    LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Insuficient buffer space");
+    return -1;
+  }
+
+  /* The SNL reply is exchanged between the SDP SAPs */
+  buffer[0] = (pdu->ssap << 2) | (PDU_SNL >> 2);
+  buffer[1] = (PDU_SNL << 6) | pdu->dsap;
+  size_t n = 2;
+
+  while (*offset < pdu->information_size) {
+    const uint8_t *tlv = pdu->information + *offset;
+
+    if (*offset > pdu->information_size - 2) {
+      LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV field in parameters list");
+      return -1;
+    }
+    if (*offset + 2 + tlv[1] > pdu->information_size) {
+      LLC_SDP_LOG(LLC_PRIORITY_ERROR, "Incomplete TLV value in parameters list (expected %d bytes but only %d left)", tlv[1], pdu->information_size - (*offset + 2));
+      return -1;
+    }
+
+    uint8_t tid;
+    uint8_t sap;
+    char uri[UINT8_MAX];
+    int r;
+
+    switch (tlv[0]) {
+      case LLCP_PARAMETER_SDREQ:
+        if (parameter_decode_sdreq(tlv, 2 + tlv[1], &tid, uri, sizeof(uri)) < 0) {
+          LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Ignoring invalid SDREQ parameter");
+          break;
+        }
+        LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Service Discovery Request #0x%02x for '%s'", tid, uri);
+
+        sap = llc_link_find_sap_by_uri(link, uri);
+
+        if (!sap) {
+          LLC_SDP_LOG(LLC_PRIORITY_ERROR, "No registered service provide '%s'", uri);
+        }
+        if ((r = parameter_encode_sdres(buffer + n, len - n, tid, sap)) < 0) {
+          if (n == 2) {
+            LLC_SDP_LOG(LLC_PRIORITY_ERROR, "No room for answering Service Discovery Request #0x%02x", tid);
+            return -1;
+          }
+          /* Answer it in the next SNL PDU */
+          LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Postponing answer to Service Discovery Request #0x%02x", tid);
+          return n;
+        }
+        n += r;
+        break;
+      case LLCP_PARAMETER_SDRES:
+        if (parameter_decode_sdres(tlv, 2 + tlv[1], &tid, &sap) < 0) {
+          LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Ignoring invalid SDRES parameter");
+          break;
+        }
+        LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Service Discovery Response #0x%02x: SAP %d", tid, sap);
+        llc_link_sdp_cache_update(link, tid, sap);
+        break;
+      default:
+        LLC_SDP_LOG(LLC_PRIORITY_INFO, "Unknown TLV Field 0x%02x (length: %d)", tlv[0], tlv[1]);
+    }
+    *offset += 2 + tlv[1];
+  }
+
+  return (n > 2) ? (int) n : 0;
+}
+
 void
 llc_service_sdp_thread_cleanup(void *arg)
 {
@@ -72,7 +168,7 @@ llc_service_sdp_thread(void *arg)
 
   int res;
 
-  uint8_t buffer[1024];
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
   LLC_SDP_MSG(LLC_PRIORITY_TRACE, "mq_receive+");
   pthread_testcancel();
   res = mq_receive(llc_up, (char *) buffer, sizeof(buffer), NULL);
@@ -82,32 +178,18 @@ llc_service_sdp_thread(void *arg)
   }
   LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Received %d bytes", res);
 
-  uint8_t tid;
-  char *uri;
-
-  switch (buffer[2]) {
-    case LLCP_PARAMETER_SDREQ:
-      if (parameter_decode_sdreq(buffer + 2, res - 2, &tid, &uri) < 0) {
-        LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Ignoring PDU");
-      } else {
-        LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Service Discovery Request #0x%02x for '%s'", tid, uri);
-
-        uint8_t sap = llc_link_find_sap_by_uri(connection->link, uri);
-
-        if (!sap) {
-          LLC_SDP_LOG(LLC_PRIORITY_ERROR, "No registered service provide '%s'", uri);
-        }
-        buffer[0] = 0x06;
-        buffer[1] = 0x41;
-        int n = parameter_encode_sdres(buffer + 2, sizeof(buffer) - 2, tid, sap);
-
-        mq_send(llc_down, (char *) buffer, n + 2, 0);
-        LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Sent %d bytes", n + 2);
-
-      }
-      break;
-    default:
-      LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Invalid parameter type");
+  struct pdu *pdu;
+
+  if ((res >= 2) && (pdu = pdu_unpack(buffer, res))) {
+    /* As many SNL PDUs as needed to answer all requests */
+    size_t offset = 0;
+    while ((res = llc_service_sdp_snl(connection->link, pdu, &offset, buffer, MIN(sizeof(buffer), 2u + connection->link->remote_miu))) > 0) {
+      mq_send(llc_down, (char *) buffer, res, 0);
+      LLC_SDP_LOG(LLC_PRIORITY_TRACE, "Sent %d bytes", res);
+    }
+    pdu_free(pdu);
+  } else {
+    LLC_SDP_MSG(LLC_PRIORITY_ERROR, "Ignoring PDU");
   }
 
   pthread_cleanup_pop(1);
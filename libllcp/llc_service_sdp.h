@@ -22,6 +22,14 @@
 #ifndef _LLC_SERVICE_SDP_H
 #define _LLC_SERVICE_SDP_H
 
+#include <sys/types.h>
+
+#include <stdint.h>
+
+struct llc_link;
+struct pdu;
+
+int		 llc_service_sdp_snl(struct llc_link *link, const struct pdu *pdu, size_t *offset, uint8_t *buffer, size_t len);
 void		*llc_service_sdp_thread(void *arg);
 
 #endif /* !_LLC_SERVICE_SDP_H */
@@ -27,11 +27,17 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <mqueue.h>
 #include <pthread.h>
+#if defined(HAVE_PTHREAD_NP_H)
+#  include <pthread_np.h>
+#endif
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "llc_link.h"
 #include "llcp_log.h"
@@ -88,6 +94,111 @@ llcp_version_agreement(struct llc_link *link, struct llcp_version version)
   return res;
 }
 
+/*
+ * Prepare the attributes of a thread, with the stack size, CPU affinity and
+ * SCHED_FIFO priority of attributes that are asked for.  Attributes that
+ * cannot be set are dropped with a warning.
+ */
+static int
+llcp_thread_attr_init(pthread_attr_t *attr, const struct llcp_thread_attributes *attributes, int stack, int affinity, int fifo, const char *name)
+{
+  (void) name;
+
+  if (pthread_attr_init(attr) != 0)
+    return -1;
+
+  if (stack) {
+    /* Some systems only take whole pages */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size = MAX(attributes->stack_size, (size_t) PTHREAD_STACK_MIN);
+    size = (size + page_size - 1) / page_size * page_size;
+    if (pthread_attr_setstacksize(attr, size) != 0)
+      LLCP_LOG(LLC_PRIORITY_WARN, "Cannot set the stack size of thread '%s' to %zu bytes", name, size);
+  }
+
+#if defined(HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP) && HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP
+  if (affinity) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < 64; i++) {
+      if (attributes->cpus & ((uint64_t) 1 << i))
+        CPU_SET(i, &cpus);
+    }
+    if (pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus) != 0)
+      LLCP_LOG(LLC_PRIORITY_WARN, "Cannot set the CPU affinity of thread '%s'", name);
+  }
+#else
+  (void) affinity;
+#endif
+
+  if (fifo) {
+    struct sched_param param = { .sched_priority = attributes->priority };
+    if ((pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED) != 0) ||
+        (pthread_attr_setschedpolicy(attr, SCHED_FIFO) != 0) ||
+        (pthread_attr_setschedparam(attr, &param) != 0)) {
+      LLCP_LOG(LLC_PRIORITY_WARN, "Cannot run thread '%s' with SCHED_FIFO priority %d", name, attributes->priority);
+      pthread_attr_setinheritsched(attr, PTHREAD_INHERIT_SCHED);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Start a thread of the library.  The SCHED_FIFO priority is only applied to
+ * realtime threads, and dropped with a warning if the process is not allowed
+ * to use it.  A stack size or CPU affinity the system rejects is dropped the
+ * same way.
+ */
+int
+llcp_thread_create(pthread_t *thread, const struct llcp_thread_attributes *attributes, int realtime, const char *name, void *(*routine)(void *), void *arg)
+{
+  pthread_attr_t attr;
+  int res;
+
+  int stack = attributes && attributes->stack_size;
+  int affinity = attributes && attributes->cpus;
+  int fifo = realtime && attributes && attributes->priority;
+
+  for (;;) {
+    if (llcp_thread_attr_init(&attr, attributes, stack, affinity, fifo, name) < 0)
+      return -1;
+    res = pthread_create(thread, &attr, routine, arg);
+    pthread_attr_destroy(&attr);
+
+    if (fifo && (EPERM == res)) {
+      LLCP_LOG(LLC_PRIORITY_WARN, "Not allowed to run thread '%s' with SCHED_FIFO", name);
+      fifo = 0;
+    } else if ((stack || affinity) && (EINVAL == res)) {
+      LLCP_LOG(LLC_PRIORITY_WARN, "Invalid stack size or CPU affinity for thread '%s', using the defaults", name);
+      stack = affinity = 0;
+    } else if (fifo && (EINVAL == res)) {
+      LLCP_LOG(LLC_PRIORITY_WARN, "Invalid SCHED_FIFO priority %d for thread '%s'", attributes->priority, name);
+      fifo = 0;
+    } else {
+      break;
+    }
+  }
+
+  if (res != 0) {
+    errno = res;
+    return -1;
+  }
+
+#if defined(HAVE_DECL_PTHREAD_SET_NAME_NP) && HAVE_DECL_PTHREAD_SET_NAME_NP
+  pthread_set_name_np(*thread, name);
+#elif defined(HAVE_DECL_PTHREAD_SETNAME_NP) && HAVE_DECL_PTHREAD_SETNAME_NP
+  /* Linux limits thread names to 15 characters */
+  char short_name[16];
+  snprintf(short_name, sizeof(short_name), "%s", name);
+  pthread_setname_np(*thread, short_name);
+#else
+  (void) name;
+#endif
+
+  return 0;
+}
+
 void
 llcp_threadslayer(pthread_t thread)
 {
@@ -100,7 +211,7 @@ llcp_threadslayer(pthread_t thread)
    * only way to unlock a thread blocked on message operations is by
    * sending a signal to it so that it gets a chance to see the
    * cancelation state.  However, if send too early in the thread's life,
-   * the signal may be missed.  So loop on pthread_kill() until it fails.
+   * the signal may be missed.  So keep signaling until the thread is gone.
    *
    * XXX This is a dirty hack.
    */
@@ -108,11 +219,22 @@ llcp_threadslayer(pthread_t thread)
     .tv_sec  = 0,
     .tv_nsec = 10000000,
   };
+#if defined(HAVE_PTHREAD_TRYJOIN_NP)
+  /*
+   * Recent glibc versions let pthread_kill() succeed on a thread that has
+   * terminated but was not joined yet, so only joining tells when to stop.
+   */
+  while (EBUSY == pthread_tryjoin_np(thread, NULL)) {
+    pthread_kill(thread, SIGUSR1);
+    nanosleep(&delay, NULL);
+  }
+#else
   while (0 == pthread_kill(thread, SIGUSR1)) {
     nanosleep(&delay, NULL);
   }
 
   pthread_join(thread, NULL);
+#endif
 }
 
 int
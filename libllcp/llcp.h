@@ -23,6 +23,7 @@
 #define _LLCP_H
 
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -52,12 +53,47 @@ int		 llcp_fini(void);
 
 int		 llcp_version_agreement(struct llc_link *link, struct llcp_version version);
 
+/* Attributes of the threads started for a link, 0 keeps the system default */
+struct llcp_thread_attributes {
+  size_t stack_size;
+  uint64_t cpus;          /* CPU affinity mask, bit n for CPU n */
+  int priority;           /* SCHED_FIFO priority of the MAC Link thread */
+};
+
+int		 llcp_thread_create(pthread_t *thread, const struct llcp_thread_attributes *attributes, int realtime, const char *name, void *(*routine)(void *), void *arg);
 void		 llcp_threadslayer(pthread_t thread);
 
 int		 llcp_disconnect(struct llc_link *link);
 
-#define MAX_LOGICAL_DATA_LINK 8
-//          DATA_LINK_CONNECTION
+/*
+ * Heap memory of the library is obtained from the allocator set with
+ * llcp_set_allocator(), malloc(3) by default.  Set it before creating any
+ * object: memory is released through the allocator in use at that time.
+ */
+struct llcp_allocator {
+  void *(*allocate)(void *context, size_t size);
+  void (*release)(void *context, void *ptr);
+  void *context;
+};
+
+void		 llcp_set_allocator(const struct llcp_allocator *allocator);
+void		 llcp_free(void *ptr);
+
+/*
+ * Heap allocations made at a given place of the library (debug builds only).
+ * Places beyond the first 64 ones are accounted together in a last "(other)"
+ * site.
+ */
+struct llcp_allocation_site {
+  const char *file;
+  int line;
+  size_t allocations;
+  size_t bytes;
+};
+
+size_t		 llcp_allocation_sites(struct llcp_allocation_site *sites, size_t count);
+void		 llcp_allocation_reset(void);
+
 #define MAX_LLC_LINK_ADVERTISED_SERVICE 0x1F
 #define MAX_LLC_LINK_SERVICE 0x3F
 #define SAP_AUTO -1
@@ -71,9 +107,17 @@ int		 llcp_disconnect(struct llc_link *link);
 #define LLC_TARGET    1
 
 #define LLC_PAX_PDU_PROHIBITED 0x02
+#define LLC_NO_THREAD          0x04 /* The link is run by a llcp_engine worker */
 
 #define LLCP_DEFAULT_RW 1
+#define LLCP_MAX_RW 15
 #define LLCP_DEFAULT_MIU 128
+#define LLCP_MAX_MIU (LLCP_DEFAULT_MIU + 0x07FF)
+/* Header, sequence and information fields of the largest PDU */
+#define LLCP_MAX_PDU_SIZE (3 + LLCP_MAX_MIU)
+
+/* Message queue names: "/libllcp-<pid>-<address>-down" */
+#define LLCP_MQ_NAME_SIZE 64
 
 /*
  * http://www.nfc-forum.org/specs/nfc_forum_assigned_numbers_register
@@ -0,0 +1,476 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+/*
+ * Multi-link engine.
+ *
+ * Instead of running one LLC Link thread per link, an engine runs many links
+ * on a fixed set of worker threads, one per CPU by default.  Each link is
+ * assigned to the least loaded worker (its shard) when activated, and the
+ * worker handles the PDUs the MAC layer delivers on the link's up queue.
+ * Only the LLC Link thread is replaced: each MAC Link keeps its exchange
+ * thread and each Data Link Connection its service thread.  MAC Links run
+ * their LLC Link on an engine once given one with mac_link_set_engine().
+ *
+ * A worker never blocks on a link: a PDU stays in the up queue until the
+ * MAC layer made room in the down queue for the answers.
+ *
+ * On Linux, message queue descriptors are file descriptors and idle workers
+ * poll(2) them.  Elsewhere, idle workers check their links every
+ * LLCP_ENGINE_POLL_TIMEOUT milliseconds.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#if defined(__linux__)
+#  include <poll.h>
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "llcp.h"
+#include "llcp_engine.h"
+#include "llcp_log.h"
+#include "llcp_pool.h"
+#include "llc_link.h"
+#include "llc_service_llc.h"
+
+#define LOG_LLCP_ENGINE "libllcp.engine"
+#define LLCP_ENGINE_MSG(priority, message) llcp_log_log (LOG_LLCP_ENGINE, priority, "%s", message)
+#define LLCP_ENGINE_LOG(priority, format, ...) llcp_log_log (LOG_LLCP_ENGINE, priority, format, __VA_ARGS__)
+
+struct llcp_engine_worker {
+  pthread_t thread;
+  size_t index;
+  int running;
+  int wakeup[2];          /* Pipe used to interrupt an idle worker */
+  pthread_mutex_t lock;   /* Held while links are processed */
+  struct {
+    struct llc_link *link;
+    mqd_t llc_up;
+    mqd_t llc_down;
+    int disconnected;
+    int ready;            /* PDUs may be waiting in llc_up */
+    int blocked;          /* llc_down has no room for the replies to a PDU */
+  } slots[LLCP_ENGINE_WORKER_LINKS];
+  size_t count;
+  unsigned generation;    /* Incremented when links are attached or detached */
+  struct llcp_engine_stats stats;
+};
+
+struct llcp_engine {
+  size_t count;
+  int running;
+  struct llcp_engine_worker *workers;
+};
+
+static void
+llcp_engine_worker_wakeup(struct llcp_engine_worker *worker)
+{
+  char c = 0;
+  if (write(worker->wakeup[1], &c, 1) < 0 && (errno != EAGAIN))
+    LLCP_ENGINE_LOG(LLC_PRIORITY_ERROR, "Cannot wake up worker %d", (int) worker->index);
+}
+
+/*
+ * Wait for PDUs on the worker's links and flag the ones that have some.
+ */
+static void
+llcp_engine_worker_wait(struct llcp_engine_worker *worker)
+{
+#if defined(__linux__)
+  struct pollfd fds[1 + LLCP_ENGINE_WORKER_LINKS];
+  size_t slots[LLCP_ENGINE_WORKER_LINKS];
+  nfds_t nfds = 1;
+  unsigned generation;
+
+  fds[0].fd = worker->wakeup[0];
+  fds[0].events = POLLIN;
+
+  pthread_mutex_lock(&worker->lock);
+  for (size_t i = 0; i < worker->count; i++) {
+    if (worker->slots[i].disconnected)
+      continue;
+    slots[nfds - 1] = i;
+    if (worker->slots[i].blocked) {
+      /* Wait for the MAC layer to read the pending PDU */
+      fds[nfds].fd = (int) worker->slots[i].llc_down;
+      fds[nfds++].events = POLLOUT;
+    } else {
+      fds[nfds].fd = (int) worker->slots[i].llc_up;
+      fds[nfds++].events = POLLIN;
+    }
+  }
+  generation = worker->generation;
+  pthread_mutex_unlock(&worker->lock);
+
+  if (poll(fds, nfds, LLCP_ENGINE_POLL_TIMEOUT) > 0) {
+    pthread_mutex_lock(&worker->lock);
+    if (generation != worker->generation) {
+      /* Links were attached or detached meanwhile: check them all */
+      for (size_t i = 0; i < worker->count; i++)
+        worker->slots[i].ready = 1;
+    } else {
+      for (nfds_t i = 1; i < nfds; i++) {
+        if (fds[i].revents & (POLLIN | POLLOUT))
+          worker->slots[slots[i - 1]].ready = 1;
+      }
+    }
+    pthread_mutex_unlock(&worker->lock);
+  }
+#else
+  struct timespec delay = {
+    .tv_sec  = 0,
+    .tv_nsec = LLCP_ENGINE_POLL_TIMEOUT * 1000000,
+  };
+  nanosleep(&delay, NULL);
+
+  pthread_mutex_lock(&worker->lock);
+  for (size_t i = 0; i < worker->count; i++)
+    worker->slots[i].ready = 1;
+  pthread_mutex_unlock(&worker->lock);
+#endif
+
+  char discard[16];
+  while (read(worker->wakeup[0], discard, sizeof(discard)) > 0)
+    ;
+}
+
+static void *
+llcp_engine_worker_thread(void *arg)
+{
+  struct llcp_engine_worker *worker = (struct llcp_engine_worker *) arg;
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
+
+  LLCP_ENGINE_LOG(LLC_PRIORITY_INFO, "Worker %d started", (int) worker->index);
+
+  while (worker->running) {
+    size_t processed = 0;
+    int res;
+
+    pthread_mutex_lock(&worker->lock);
+    for (size_t i = 0; i < worker->count; i++) {
+      if (!worker->slots[i].ready || worker->slots[i].disconnected)
+        continue;
+
+      /*
+       * Handling a PDU sends a reply and a scheduled PDU to llc_down, the
+       * link defers any further reply (see the AGF PDU): leave the PDU in
+       * llc_up until the MAC layer made room for two.
+       */
+      struct mq_attr attr;
+      if ((mq_getattr(worker->slots[i].llc_down, &attr) == 0) && (attr.mq_maxmsg - attr.mq_curmsgs < 2)) {
+        worker->slots[i].blocked = 1;
+        continue;
+      }
+      worker->slots[i].blocked = 0;
+
+      ssize_t len = mq_receive(worker->slots[i].llc_up, (char *) buffer, sizeof(buffer), NULL);
+      if (len < 0) {
+        worker->slots[i].ready = 0;
+        continue;
+      }
+
+      processed++;
+      struct llc_link *link = worker->slots[i].link;
+      pthread_mutex_lock(&link->lock);
+      res = llc_service_llc_process(link, worker->slots[i].llc_down, buffer, len);
+      pthread_mutex_unlock(&link->lock);
+      if (res < 0) {
+        LLCP_ENGINE_LOG(LLC_PRIORITY_INFO, "LLC Link %p disconnected", (void *) worker->slots[i].link);
+        worker->slots[i].disconnected = 1;
+      }
+    }
+    worker->stats.pdus += processed;
+    if (!processed)
+      worker->stats.wakeups++;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (!processed)
+      llcp_engine_worker_wait(worker);
+  }
+
+  LLCP_ENGINE_LOG(LLC_PRIORITY_INFO, "Worker %d stopped", (int) worker->index);
+
+  return NULL;
+}
+
+/*
+ * Create an engine with the given number of workers, or one worker per
+ * online CPU if workers is 0.
+ */
+struct llcp_engine *
+llcp_engine_new(size_t workers) {
+  struct llcp_engine *engine;
+
+  if (!workers) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = (cpus > 0) ? (size_t) cpus : 1;
+  }
+
+  if (!(engine = llcp_malloc(sizeof(*engine)))) {
+    LLCP_ENGINE_MSG(LLC_PRIORITY_FATAL, "Cannot allocate memory");
+    return NULL;
+  }
+
+  if (!(engine->workers = llcp_malloc(workers * sizeof(*engine->workers)))) {
+    LLCP_ENGINE_MSG(LLC_PRIORITY_FATAL, "Cannot allocate memory");
+    llcp_free(engine);
+    return NULL;
+  }
+  memset(engine->workers, 0, workers * sizeof(*engine->workers));
+
+  engine->count = workers;
+  engine->running = 0;
+
+  for (size_t i = 0; i < workers; i++) {
+    struct llcp_engine_worker *worker = &engine->workers[i];
+
+    worker->index = i;
+    worker->count = 0;
+    worker->generation = 0;
+    pthread_mutex_init(&worker->lock, NULL);
+    if (pipe(worker->wakeup) < 0) {
+      LLCP_ENGINE_MSG(LLC_PRIORITY_FATAL, "Cannot create wakeup pipe");
+      engine->count = i;
+      pthread_mutex_destroy(&worker->lock);
+      llcp_engine_free(engine);
+      return NULL;
+    }
+    fcntl(worker->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(worker->wakeup[1], F_SETFL, O_NONBLOCK);
+  }
+
+  return engine;
+}
+
+size_t
+llcp_engine_workers(const struct llcp_engine *engine)
+{
+  assert(engine);
+
+  return engine->count;
+}
+
+int
+llcp_engine_start(struct llcp_engine *engine)
+{
+  assert(engine);
+  assert(!engine->running);
+
+  for (size_t i = 0; i < engine->count; i++) {
+    struct llcp_engine_worker *worker = &engine->workers[i];
+
+    worker->running = 1;
+    if (llcp_thread_create(&worker->thread, NULL, 0, "LLCP Engine", llcp_engine_worker_thread, worker) != 0) {
+      LLCP_ENGINE_LOG(LLC_PRIORITY_FATAL, "Cannot start worker %d", (int) i);
+      worker->running = 0;
+      llcp_engine_stop(engine);
+      return -1;
+    }
+  }
+
+  engine->running = 1;
+  return 0;
+}
+
+/*
+ * Activate an LLC Link and run it on the least loaded worker.
+ */
+int
+llcp_engine_link_activate(struct llcp_engine *engine, struct llc_link *link, uint8_t flags, const uint8_t *parameters, size_t length)
+{
+  assert(engine);
+  assert(link);
+
+  /* A recycled link stays on its worker */
+  for (size_t i = 0; i < engine->count; i++) {
+    struct llcp_engine_worker *worker = &engine->workers[i];
+
+    pthread_mutex_lock(&worker->lock);
+    for (size_t j = 0; j < worker->count; j++) {
+      if (worker->slots[j].link != link)
+        continue;
+
+      int res = llc_link_activate(link, flags | LLC_NO_THREAD, parameters, length);
+      worker->slots[j].disconnected = (res < 0);
+      worker->slots[j].ready = 1;
+      pthread_mutex_unlock(&worker->lock);
+      llcp_engine_worker_wakeup(worker);
+      return res;
+    }
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  struct llcp_engine_worker *worker = NULL;
+  size_t count = LLCP_ENGINE_WORKER_LINKS;
+  for (size_t i = 0; i < engine->count; i++) {
+    pthread_mutex_lock(&engine->workers[i].lock);
+    if (engine->workers[i].count < count) {
+      worker = &engine->workers[i];
+      count = worker->count;
+    }
+    pthread_mutex_unlock(&engine->workers[i].lock);
+  }
+
+  if (!worker) {
+    LLCP_ENGINE_MSG(LLC_PRIORITY_ERROR, "No room left for a new LLC Link");
+    return -1;
+  }
+
+  if (llc_link_activate(link, flags | LLC_NO_THREAD, parameters, length) < 0)
+    return -1;
+
+  mqd_t llc_up = mq_open(link->mq_up_name, O_RDONLY | O_NONBLOCK);
+  mqd_t llc_down = mq_open(link->mq_down_name, O_WRONLY | O_NONBLOCK);
+  if ((llc_up == (mqd_t) - 1) || (llc_down == (mqd_t) - 1)) {
+    LLCP_ENGINE_MSG(LLC_PRIORITY_ERROR, "Cannot open LLC Link message queues");
+    if (llc_up != (mqd_t) - 1)
+      mq_close(llc_up);
+    if (llc_down != (mqd_t) - 1)
+      mq_close(llc_down);
+    llc_link_deactivate(link);
+    return -1;
+  }
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->count == LLCP_ENGINE_WORKER_LINKS) {
+    /* Another LLC Link took the last slot meanwhile */
+    pthread_mutex_unlock(&worker->lock);
+    LLCP_ENGINE_MSG(LLC_PRIORITY_ERROR, "No room left for a new LLC Link");
+    mq_close(llc_up);
+    mq_close(llc_down);
+    llc_link_deactivate(link);
+    return -1;
+  }
+  worker->slots[worker->count].link = link;
+  worker->slots[worker->count].llc_up = llc_up;
+  worker->slots[worker->count].llc_down = llc_down;
+  worker->slots[worker->count].disconnected = 0;
+  worker->slots[worker->count].ready = 1;
+  worker->slots[worker->count].blocked = 0;
+  worker->count++;
+  worker->generation++;
+  pthread_mutex_unlock(&worker->lock);
+
+  llcp_engine_worker_wakeup(worker);
+
+  LLCP_ENGINE_LOG(LLC_PRIORITY_INFO, "LLC Link %p runs on worker %d", (void *) link, (int) worker->index);
+
+  return 0;
+}
+
+void
+llcp_engine_link_deactivate(struct llcp_engine *engine, struct llc_link *link)
+{
+  assert(engine);
+  assert(link);
+
+  for (size_t i = 0; i < engine->count; i++) {
+    struct llcp_engine_worker *worker = &engine->workers[i];
+
+    pthread_mutex_lock(&worker->lock);
+    for (size_t j = 0; j < worker->count; j++) {
+      if (worker->slots[j].link != link)
+        continue;
+
+      mq_close(worker->slots[j].llc_up);
+      mq_close(worker->slots[j].llc_down);
+      worker->slots[j] = worker->slots[--worker->count];
+      worker->generation++;
+      break;
+    }
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  llc_link_deactivate(link);
+}
+
+int
+llcp_engine_get_stats(struct llcp_engine *engine, size_t worker, struct llcp_engine_stats *stats)
+{
+  assert(engine);
+  assert(stats);
+
+  if (worker >= engine->count)
+    return -1;
+
+  pthread_mutex_lock(&engine->workers[worker].lock);
+  *stats = engine->workers[worker].stats;
+  stats->links = engine->workers[worker].count;
+  pthread_mutex_unlock(&engine->workers[worker].lock);
+
+  return 0;
+}
+
+void
+llcp_engine_stop(struct llcp_engine *engine)
+{
+  assert(engine);
+
+  for (size_t i = 0; i < engine->count; i++) {
+    struct llcp_engine_worker *worker = &engine->workers[i];
+
+    if (!worker->running)
+      continue;
+
+    worker->running = 0;
+    llcp_engine_worker_wakeup(worker);
+    pthread_join(worker->thread, NULL);
+  }
+
+  engine->running = 0;
+}
+
+/*
+ * Free the engine.  Links still run by the engine are deactivated.
+ */
+void
+llcp_engine_free(struct llcp_engine *engine)
+{
+  assert(engine);
+
+  llcp_engine_stop(engine);
+
+  for (size_t i = 0; i < engine->count; i++) {
+    struct llcp_engine_worker *worker = &engine->workers[i];
+
+    while (worker->count)
+      llcp_engine_link_deactivate(engine, worker->slots[0].link);
+
+    close(worker->wakeup[0]);
+    close(worker->wakeup[1]);
+    pthread_mutex_destroy(&worker->lock);
+  }
+
+  llcp_free(engine->workers);
+  llcp_free(engine);
+}
@@ -0,0 +1,61 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _LLCP_ENGINE_H
+#define _LLCP_ENGINE_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern  "C" {
+#endif /* __cplusplus */
+
+struct llc_link;
+struct llcp_engine;
+
+/* Maximum number of LLC Links a single worker runs */
+#define LLCP_ENGINE_WORKER_LINKS 64
+
+/* Time an idle worker waits for PDUs before checking its links again (ms) */
+#define LLCP_ENGINE_POLL_TIMEOUT 10
+
+struct llcp_engine_stats {
+  size_t links;           /* LLC Links run by the worker */
+  uint64_t pdus;          /* PDUs processed */
+  uint64_t wakeups;       /* Times the worker woke up with nothing to do */
+};
+
+struct llcp_engine *llcp_engine_new(size_t workers);
+size_t		 llcp_engine_workers(const struct llcp_engine *engine);
+int		 llcp_engine_start(struct llcp_engine *engine);
+int		 llcp_engine_link_activate(struct llcp_engine *engine, struct llc_link *link, uint8_t flags, const uint8_t *parameters, size_t length);
+void		 llcp_engine_link_deactivate(struct llcp_engine *engine, struct llc_link *link);
+int		 llcp_engine_get_stats(struct llcp_engine *engine, size_t worker, struct llcp_engine_stats *stats);
+void		 llcp_engine_stop(struct llcp_engine *engine);
+void		 llcp_engine_free(struct llcp_engine *engine);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_LLCP_ENGINE_H */
@@ -28,7 +28,7 @@
 
 int	 llcp_log_init(void);
 int	 llcp_log_fini(void);
-void llcp_log_log(char *category, int priority, char *format, ...);
+void llcp_log_log(const char *category, int priority, const char *format, ...);
 void llc_log_print_buf_hex(char *s, const uint8_t *buf, int len);
 void llc_log_print_pdu_header(const uint8_t *buf);
 
@@ -347,6 +347,10 @@ parameter_encode_sdreq(uint8_t buffer[], size_t buffer_len, uint8_t tid, const c
 
   size_t uri_len = strlen(uri);
 
+  if (uri_len > LLCP_SDREQ_MAX_URI_SIZE) {
+    LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Service name too long");
+    return -1;
+  }
   if (buffer_len < 3 + uri_len) {
     LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Insuficient buffer space");
     return -1;
@@ -366,7 +370,7 @@ parameter_encode_sdreq(uint8_t buffer[], size_t buffer_len, uint8_t tid, const c
 
 
 int
-parameter_decode_sdreq(const uint8_t buffer[], size_t buffer_len, uint8_t *tid, char **uri)
+parameter_decode_sdreq(const uint8_t buffer[], size_t buffer_len, uint8_t *tid, char *uri, size_t uri_max_len)
 {
   if (buffer_len < 4) {
     LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Invalid TLV field length");
@@ -385,14 +389,15 @@ parameter_decode_sdreq(const uint8_t buffer[], size_t buffer_len, uint8_t *tid,
     LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Invalid TLV header");
     return -1;
   }
-  *tid = buffer[2];
-  if ((*uri = malloc(buffer[1] - 1))) {
-    memcpy(*uri, buffer + 3, buffer[1] - 1);
-    *(*uri + buffer[1] - 1) = '\0';
-  } else {
+  if (uri_max_len < buffer[1]) {
+    LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Insuficient buffer space");
     return -1;
   }
 
+  *tid = buffer[2];
+  memcpy(uri, buffer + 3, buffer[1] - 1);
+  uri[buffer[1] - 1] = '\0';
+
   return 0;
 }
 
@@ -438,3 +443,217 @@ parameter_decode_sdres(const uint8_t buffer[], size_t buffer_len, uint8_t *tid,
 
   return 0;
 }
+
+/*
+ * Table-driven codec for parameters lists.
+ *
+ * parameters_decode() walks a whole TLV list once and fills a struct
+ * llcp_parameters.  parameters_encode() writes all present parameters after
+ * a single buffer size check against parameters_size().
+ */
+
+/*
+ * Value length and maximum value of each parameter, indexed by type.  A
+ * zero max_length marks parameters this codec does not handle.
+ */
+static const struct parameter_format {
+  uint8_t min_length;
+  uint8_t max_length;
+  uint16_t max_value;
+} parameter_formats[] = {
+  [LLCP_PARAMETER_VERSION] = { 1, 1,   0x00FF },
+  [LLCP_PARAMETER_MIUX]    = { 2, 2,   0x07FF },
+  [LLCP_PARAMETER_WKS]     = { 2, 2,   0xFFFF },
+  [LLCP_PARAMETER_LTO]     = { 1, 1,   0x00FF },
+  [LLCP_PARAMETER_RW]      = { 1, 1,   0x000F },
+  [LLCP_PARAMETER_SN]      = { 0, 255, 0x0000 },
+  [LLCP_PARAMETER_OPT]     = { 1, 1,   0x0003 },
+};
+
+#define PARAMETER_FORMATS_COUNT (sizeof(parameter_formats) / sizeof(*parameter_formats))
+
+static inline uint16_t
+parameter_value(const struct llcp_parameters *p, uint8_t type)
+{
+  switch (type) {
+    case LLCP_PARAMETER_MIUX:
+      return p->miux;
+    case LLCP_PARAMETER_RW:
+      return p->rw;
+    case LLCP_PARAMETER_OPT:
+      return p->opt;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Decode a parameters list.  Unknown parameters are skipped.  Returns 0 on
+ * success, and -1 if the list is truncated or a known parameter has an
+ * invalid length.
+ */
+int
+parameters_decode(const uint8_t buffer[], size_t buffer_len, struct llcp_parameters *parameters)
+{
+  if (!parameters) {
+    LLC_TLV_MSG(LLC_PRIORITY_ERROR, "NULL parameters argument");
+    return -1;
+  }
+
+  parameters->present = 0;
+
+  size_t offset = 0;
+  while (offset < buffer_len) {
+    if (buffer_len - offset < 2) {
+      LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV field in parameters list");
+      return -1;
+    }
+
+    uint8_t type = buffer[offset];
+    uint8_t length = buffer[offset + 1];
+    const uint8_t *value = buffer + offset + 2;
+
+    if (buffer_len - offset - 2 < length) {
+      LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Incomplete TLV value in parameters list");
+      return -1;
+    }
+    offset += 2 + length;
+
+    if ((type >= PARAMETER_FORMATS_COUNT) || !parameter_formats[type].max_length)
+      continue;
+
+    if ((length < parameter_formats[type].min_length) || (length > parameter_formats[type].max_length)) {
+      LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Invalid TLV field length");
+      return -1;
+    }
+
+    switch (type) {
+      case LLCP_PARAMETER_VERSION:
+        parameters->version.major = value[0] >> 4;
+        parameters->version.minor = value[0] & 0x0F;
+        break;
+      case LLCP_PARAMETER_MIUX:
+        parameters->miux = (value[0] << 8 | value[1]) & 0x07FF;
+        break;
+      case LLCP_PARAMETER_WKS:
+        parameters->wks = (value[0] << 8 | value[1]) | 0x01;
+        break;
+      case LLCP_PARAMETER_LTO:
+        parameters->lto = value[0];
+        break;
+      case LLCP_PARAMETER_RW:
+        parameters->rw = value[0];
+        break;
+      case LLCP_PARAMETER_SN:
+        parameters->sn = value;
+        parameters->sn_len = length;
+        break;
+      case LLCP_PARAMETER_OPT:
+        parameters->opt = value[0];
+        break;
+    }
+    parameters->present |= LLCP_PARAMETER_BIT(type);
+  }
+
+  return 0;
+}
+
+/*
+ * Return the number of bytes parameters_encode() needs, or -1 if a present
+ * parameter is not supported or has an invalid value.
+ */
+int
+parameters_size(const struct llcp_parameters *parameters)
+{
+  const uint16_t supported = ((1 << PARAMETER_FORMATS_COUNT) - 1) & ~LLCP_PARAMETER_BIT(0);
+
+  if (parameters->present & ~supported) {
+    LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Unsupported parameter");
+    return -1;
+  }
+
+  int size = 0;
+  for (uint8_t type = 1; type < PARAMETER_FORMATS_COUNT; type++) {
+    if (!(parameters->present & LLCP_PARAMETER_BIT(type)))
+      continue;
+
+    const struct parameter_format *format = &parameter_formats[type];
+    if (type == LLCP_PARAMETER_SN) {
+      if (parameters->sn_len && !parameters->sn) {
+        LLC_TLV_MSG(LLC_PRIORITY_ERROR, "NULL sn argument");
+        return -1;
+      }
+      size += 2 + parameters->sn_len;
+    } else {
+      if (parameter_value(parameters, type) > format->max_value) {
+        LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Invalid parameter value");
+        return -1;
+      }
+      size += 2 + format->min_length;
+    }
+  }
+
+  return size;
+}
+
+/*
+ * Encode all present parameters in ascending type order.  Returns the number
+ * of bytes written, or -1 if a value is invalid or the buffer is too small.
+ */
+int
+parameters_encode(uint8_t buffer[], size_t buffer_len, const struct llcp_parameters *parameters)
+{
+  int size = parameters_size(parameters);
+
+  if (size < 0)
+    return -1;
+  if ((size_t) size > buffer_len) {
+    LLC_TLV_MSG(LLC_PRIORITY_ERROR, "Insuficient buffer space");
+    return -1;
+  }
+
+  const uint16_t present = parameters->present;
+  uint8_t *b = buffer;
+
+  if (present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_VERSION)) {
+    *b++ = LLCP_PARAMETER_VERSION;
+    *b++ = 1;
+    *b++ = ((parameters->version.major & 0x0F) << 4) | (parameters->version.minor & 0x0F);
+  }
+  if (present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_MIUX)) {
+    *b++ = LLCP_PARAMETER_MIUX;
+    *b++ = 2;
+    *b++ = parameters->miux >> 8;
+    *b++ = parameters->miux;
+  }
+  if (present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_WKS)) {
+    *b++ = LLCP_PARAMETER_WKS;
+    *b++ = 2;
+    *b++ = (parameters->wks | 0x01) >> 8;
+    *b++ = (parameters->wks | 0x01);
+  }
+  if (present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_LTO)) {
+    *b++ = LLCP_PARAMETER_LTO;
+    *b++ = 1;
+    *b++ = parameters->lto;
+  }
+  if (present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_RW)) {
+    *b++ = LLCP_PARAMETER_RW;
+    *b++ = 1;
+    *b++ = parameters->rw;
+  }
+  if (present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_SN)) {
+    *b++ = LLCP_PARAMETER_SN;
+    *b++ = parameters->sn_len;
+    if (parameters->sn_len)
+      memcpy(b, parameters->sn, parameters->sn_len);
+    b += parameters->sn_len;
+  }
+  if (present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_OPT)) {
+    *b++ = LLCP_PARAMETER_OPT;
+    *b++ = 1;
+    *b++ = parameters->opt;
+  }
+
+  return size;
+}
@@ -37,6 +37,27 @@
 #define LLCP_PARAMETER_SDREQ   0x08
 #define LLCP_PARAMETER_SDRES   0x09
 
+#define LLCP_PARAMETER_BIT(type) (1 << (type))
+
+/* The one byte length of a SDREQ also counts its TID */
+#define LLCP_SDREQ_MAX_URI_SIZE 254
+
+/*
+ * Decoded form of a list of link or connection parameters.  Only parameters
+ * whose bit is set in present are meaningful.
+ */
+struct llcp_parameters {
+  uint16_t present;
+  struct llcp_version version;
+  uint16_t miux;
+  uint16_t wks;
+  uint8_t lto;
+  uint8_t rw;
+  uint8_t opt;
+  const uint8_t *sn;    /* Not NUL terminated, points into the decoded buffer */
+  uint8_t sn_len;
+};
+
 int	 parameter_encode_version(uint8_t buffer[], size_t buffer_len, struct llcp_version version);
 int	 parameter_decode_version(const uint8_t buffer[], size_t buffer_len, struct llcp_version *version);
 int	 parameter_encode_miux(uint8_t buffer[], size_t buffer_len, uint16_t miux);
@@ -52,8 +73,12 @@ int	 parameter_decode_sn(const uint8_t buffer[], size_t buffer_len, char *sn, si
 int	 parameter_encode_opt(uint8_t buffer[], size_t buffer_len, uint8_t opt);
 int	 parameter_decode_opt(const uint8_t buffer[], size_t buffer_len, uint8_t *opt);
 int	 parameter_encode_sdreq(uint8_t buffer[], size_t buffer_len, uint8_t tid, const char *uri);
-int	 parameter_decode_sdreq(const uint8_t buffer[], size_t buffer_len, uint8_t *tid, char **uri);
+int	 parameter_decode_sdreq(const uint8_t buffer[], size_t buffer_len, uint8_t *tid, char *uri, size_t uri_max_len);
 int	 parameter_encode_sdres(uint8_t buffer[], size_t buffer_len, uint8_t tid, uint8_t sap);
 int	 parameter_decode_sdres(const uint8_t buffer[], size_t buffer_len, uint8_t *tid, uint8_t *sap);
 
+int	 parameters_decode(const uint8_t buffer[], size_t buffer_len, struct llcp_parameters *parameters);
+int	 parameters_size(const struct llcp_parameters *parameters);
+int	 parameters_encode(uint8_t buffer[], size_t buffer_len, const struct llcp_parameters *parameters);
+
 #endif /* !_LLCP_PARAMETERS_H */
@@ -31,6 +31,7 @@
 #include "llcp_log.h"
 #include "llcp_parameters.h"
 #include "llcp_pdu.h"
+#include "llcp_pool.h"
 
 #define LOG_LLC_PDU "libllcp.llc.pdu"
 #define LLC_PDU_MSG(priority, message) llcp_log_log (LOG_LLC_PDU, priority, "%s", message)
@@ -61,23 +62,45 @@ pdu_has_sequence_field(const struct pdu *pdu)
   return _pdu_ptype_sequence_field[pdu->ptype];
 }
 
-static inline uint8_t *
-memdup(const uint8_t *mem, size_t len)
+/* The information field of a PDU is kept in the same block */
+LLCP_POOL(pdu_pool, sizeof(struct pdu) + LLCP_STATIC_MIU, LLCP_STATIC_PDUS);
+
+/* Allocate a PDU with room for information_size bytes of information */
+static struct pdu *
+pdu_alloc(size_t information_size)
 {
-  uint8_t *res = NULL;
+  struct pdu *pdu;
 
-  if (mem && (res = malloc(len))) {
-    memcpy(res, mem, len);
+#if defined(LLCP_STATIC_ALLOCATION)
+  if (information_size > LLCP_STATIC_MIU) {
+    LLC_PDU_LOG(LLC_PRIORITY_ERROR, "Information field too large (%d bytes)", (int) information_size);
+    return NULL;
+  }
+  if ((pdu = llcp_pool_new(pdu_pool, sizeof(*pdu))))
+    pdu->information = information_size ? (uint8_t *)(pdu + 1) : NULL;
+#else
+  if ((pdu = llcp_pool_new(pdu_pool, sizeof(*pdu)))) {
+    pdu->information = NULL;
+    if (information_size && !(pdu->information = llcp_malloc(information_size))) {
+      llcp_pool_delete(pdu_pool, pdu);
+      return NULL;
+    }
   }
+#endif
+  if (pdu)
+    pdu->information_size = information_size;
 
-  return res;
+  return pdu;
 }
 
 struct pdu *
 pdu_new(uint8_t dsap, uint8_t ptype, uint8_t ssap, uint8_t nr, uint8_t ns, const uint8_t *information, size_t information_size) {
   struct pdu *pdu;
 
-  if ((pdu = malloc(sizeof(*pdu)))) {
+  if (!information)
+    information_size = 0;
+
+  if ((pdu = pdu_alloc(information_size))) {
     pdu->dsap  = dsap;
     pdu->ptype = ptype;
     pdu->ssap  = ssap;
@@ -85,8 +108,8 @@ pdu_new(uint8_t dsap, uint8_t ptype, uint8_t ssap, uint8_t nr, uint8_t ns, const
     pdu->nr = nr;
     pdu->ns = ns;
 
-    pdu->information_size = information_size;
-    pdu->information = memdup(information, information_size);
+    if (information_size)
+      memcpy(pdu->information, information, information_size);
   }
 
   return pdu;
@@ -96,22 +119,23 @@ struct pdu *
 pdu_new_cc(const struct llc_connection *connection) {
   struct pdu *res;
 
-  uint8_t buffer[BUFSIZ];
-  int len = 0, r;
+  struct llcp_parameters params = {
+    .present = LLCP_PARAMETER_BIT(LLCP_PARAMETER_MIUX) | LLCP_PARAMETER_BIT(LLCP_PARAMETER_RW),
+    .miux = connection->local_miu - LLCP_DEFAULT_MIU,
+    .rw = connection->rwl,
+  };
 
-  r = parameter_encode_miux(buffer + len, sizeof(buffer) - len, connection->local_miu);
-  if (r >= 0)
-    len += r;
-  r = parameter_encode_rw(buffer + len, sizeof(buffer) - len, connection->rwl);
-  if (r >= 0)
-    len += r;
+  uint8_t buffer[16];
+  int len = parameters_encode(buffer, sizeof(buffer), &params);
+  if (len < 0)
+    len = 0;
 
   res = pdu_new(connection->remote_sap, PDU_CC, connection->local_sap, 0, 0, buffer, len);
   return res;
 }
 
 struct pdu *
-pdu_new_frmr(uint8_t dsap, uint8_t ssap, struct pdu *pdu, struct llc_connection *connection, int reason) {
+pdu_new_frmr(uint8_t dsap, uint8_t ssap, const struct pdu *pdu, struct llc_connection *connection, int reason) {
   uint8_t info[] = { reason | pdu->ptype, pdu_has_sequence_field(pdu) ? (pdu->nr << 4 | pdu->ns) : 0, connection->state.s << 4 | connection->state.r, connection->state.sa << 4 | connection->state.ra };
   return pdu_new(dsap, PDU_FRMR, ssap, 0, 0, info, sizeof(info));
 }
@@ -148,32 +172,56 @@ pdu_unpack(const uint8_t *buffer, size_t len) {
   llc_log_print_pdu_header(buffer);
   llc_log_print_buf_hex("PDU-UNPACK:\t", buffer, len);
 
-  if ((pdu = malloc(sizeof *pdu))) {
-    pdu->dsap = buffer[0] >> 2;
-    pdu->ptype = ((buffer[0] & 0x03) << 2) | (buffer[1] >> 6);
-    pdu->ssap = buffer[1] & 0x3F;
+  struct pdu view;
+  if (pdu_unpack_view(buffer, len, &view) < 0)
+    return NULL;
+
+  if ((pdu = pdu_alloc(view.information_size))) {
+    pdu->dsap = view.dsap;
+    pdu->ptype = view.ptype;
+    pdu->ssap = view.ssap;
+    pdu->ns = view.ns;
+    pdu->nr = view.nr;
 
-    int n = 2;
+    if (view.information_size)
+      memcpy(pdu->information, view.information, view.information_size);
+  }
 
-    if (pdu_has_sequence_field(pdu)) {
-      pdu->ns = buffer[n] >> 4;
-      pdu->nr = buffer[n++] & 0x0F;
-    }
+  return pdu;
+}
+
+/*
+ * Decode the PDU in buffer into pdu without copying it: pdu->information
+ * points into buffer and pdu must not be passed to pdu_free().
+ */
+int
+pdu_unpack_view(const uint8_t *buffer, size_t len, struct pdu *pdu)
+{
+  if (len < 2) {
+    LLC_PDU_MSG(LLC_PRIORITY_ERROR, "Truncated PDU");
+    return -1;
+  }
 
-    pdu->information_size = len - n;
-    if (pdu->information_size) {
-      if (!(pdu->information = malloc(pdu->information_size))) {
-        free(pdu);
-        return NULL;
-      }
+  pdu->dsap = buffer[0] >> 2;
+  pdu->ptype = ((buffer[0] & 0x03) << 2) | (buffer[1] >> 6);
+  pdu->ssap = buffer[1] & 0x3F;
+  pdu->nr = pdu->ns = 0;
 
-      memcpy(pdu->information, buffer + n, pdu->information_size);
-    } else {
-      pdu->information = NULL;
+  size_t n = 2;
+
+  if (pdu_has_sequence_field(pdu)) {
+    if (len < 3) {
+      LLC_PDU_MSG(LLC_PRIORITY_ERROR, "Truncated PDU");
+      return -1;
     }
+    pdu->ns = buffer[n] >> 4;
+    pdu->nr = buffer[n++] & 0x0F;
   }
 
-  return pdu;
+  pdu->information_size = len - n;
+  pdu->information = pdu->information_size ? (uint8_t *) buffer + n : NULL;
+
+  return 0;
 }
 
 int
@@ -193,17 +241,11 @@ pdu_aggregate(struct pdu **pdus) {
     pdu++;
   }
 
-  if ((res = malloc(sizeof(*res)))) {
+  if ((res = pdu_alloc(len))) {
     res->ssap = 0;
     res->dsap = 0;
     res->ptype = PDU_AGF;
 
-    res->information_size = len;
-    if (!(res->information = malloc(len))) {
-      free(res);
-      return NULL;
-    }
-
     off_t offset = 0;
     pdu = pdus;
     while (*pdu) {
@@ -248,7 +290,8 @@ pdu_dispatch(struct pdu *pdu) {
     return NULL;
   }
 
-  pdus = malloc((pdu_count + 1) * sizeof(*pdus));
+  if (!(pdus = llcp_malloc((pdu_count + 1) * sizeof(*pdus))))
+    return NULL;
   offset = 0;
   pdu_count = 0;
 
@@ -267,6 +310,11 @@ pdu_dispatch(struct pdu *pdu) {
 void
 pdu_free(struct pdu *pdu)
 {
-  free(pdu->information);
-  free(pdu);
+  /* Senders release whatever pdu_new() returned, even NULL */
+  if (!pdu)
+    return;
+#if !defined(LLCP_STATIC_ALLOCATION)
+  llcp_free(pdu->information);
+#endif
+  llcp_pool_delete(pdu_pool, pdu);
 }
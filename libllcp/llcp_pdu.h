@@ -72,11 +72,13 @@ struct pdu {
 int		 pdu_has_sequence_field(const struct pdu *pdu);
 struct pdu	*pdu_new(uint8_t dsap, uint8_t ptype, uint8_t ssap, uint8_t nr, uint8_t ns, const uint8_t *information, size_t information_size);
 struct pdu	*pdu_new_cc(const struct llc_connection *connction);
-struct pdu	*pdu_new_frmr(uint8_t dsap, uint8_t ssap, struct pdu *pdu, struct llc_connection *connection, int reason);
+struct pdu	*pdu_new_frmr(uint8_t dsap, uint8_t ssap, const struct pdu *pdu, struct llc_connection *connection, int reason);
 int		 pdu_pack(const struct pdu *pdu, uint8_t *buffer, size_t len);
 struct pdu	*pdu_unpack(const uint8_t *buffer, size_t len);
+int		 pdu_unpack_view(const uint8_t *buffer, size_t len, struct pdu *pdu);
 int		 pdu_size(struct pdu *pdu);
 struct pdu	*pdu_aggregate(struct pdu **pdus);
+/* The NULL-terminated array of PDUs is released with llcp_free() */
 struct pdu     **pdu_dispatch(struct pdu *pdu);
 void		 pdu_free(struct pdu *pdu);
 
@@ -0,0 +1,223 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "llcp_log.h"
+#include "llcp_pool.h"
+
+#define LOG_LLCP_POOL "libllcp.pool"
+#define LLCP_POOL_LOG(priority, format, ...) llcp_log_log (LOG_LLCP_POOL, priority, format, __VA_ARGS__)
+
+static void *
+default_allocate(void *context, size_t size)
+{
+  (void) context;
+  return malloc(size);
+}
+
+static void
+default_release(void *context, void *ptr)
+{
+  (void) context;
+  free(ptr);
+}
+
+static struct llcp_allocator allocator = {
+  .allocate = default_allocate,
+  .release = default_release,
+  .context = NULL,
+};
+
+#if defined(DEBUG)
+
+/* Distinct places of the library that allocate memory */
+#define LLCP_ALLOCATION_SITES 64
+
+static struct llcp_allocation_site allocation_sites[LLCP_ALLOCATION_SITES];
+static size_t allocation_site_count;
+/* Sites that did not fit in the table */
+static struct llcp_allocation_site other_allocation_sites = { .file = "(other)", .line = 0 };
+static pthread_mutex_t allocation_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+llcp_allocation_account(const char *file, int line, size_t size)
+{
+  struct llcp_allocation_site *site = NULL;
+
+  pthread_mutex_lock(&allocation_sites_lock);
+  for (size_t i = 0; i < allocation_site_count; i++) {
+    if ((allocation_sites[i].line == line) && (0 == strcmp(allocation_sites[i].file, file))) {
+      site = &allocation_sites[i];
+      break;
+    }
+  }
+  if (!site) {
+    if (allocation_site_count < LLCP_ALLOCATION_SITES) {
+      site = &allocation_sites[allocation_site_count++];
+      site->file = file;
+      site->line = line;
+    } else {
+      site = &other_allocation_sites;
+    }
+  }
+  site->allocations++;
+  site->bytes += size;
+  pthread_mutex_unlock(&allocation_sites_lock);
+}
+
+#endif /* DEBUG */
+
+void
+llcp_set_allocator(const struct llcp_allocator *new_allocator)
+{
+  if (new_allocator) {
+    assert(new_allocator->allocate && new_allocator->release);
+    allocator = *new_allocator;
+  } else {
+    allocator.allocate = default_allocate;
+    allocator.release = default_release;
+    allocator.context = NULL;
+  }
+}
+
+void *
+llcp_malloc_at(size_t size, const char *file, int line)
+{
+  void *res;
+
+  if (!(res = allocator.allocate(allocator.context, size))) {
+    LLCP_POOL_LOG(LLC_PRIORITY_FATAL, "Cannot allocate %d bytes", (int) size);
+    return NULL;
+  }
+#if defined(DEBUG)
+  if (file)
+    llcp_allocation_account(file, line, size);
+#else
+  (void) file;
+  (void) line;
+#endif
+
+  return res;
+}
+
+char *
+llcp_strdup_at(const char *s, const char *file, int line)
+{
+  size_t size = strlen(s) + 1;
+  char *res;
+
+  if ((res = llcp_malloc_at(size, file, line)))
+    memcpy(res, s, size);
+
+  return res;
+}
+
+void
+llcp_free(void *ptr)
+{
+  if (ptr)
+    allocator.release(allocator.context, ptr);
+}
+
+size_t
+llcp_allocation_sites(struct llcp_allocation_site *sites, size_t count)
+{
+#if defined(DEBUG)
+  pthread_mutex_lock(&allocation_sites_lock);
+  size_t res = allocation_site_count;
+  if (sites)
+    memcpy(sites, allocation_sites, ((count < res) ? count : res) * sizeof(*sites));
+  if (other_allocation_sites.allocations) {
+    if (sites && (res < count))
+      sites[res] = other_allocation_sites;
+    res++;
+  }
+  pthread_mutex_unlock(&allocation_sites_lock);
+
+  return res;
+#else
+  (void) sites;
+  (void) count;
+  return 0;
+#endif
+}
+
+void
+llcp_allocation_reset(void)
+{
+#if defined(DEBUG)
+  pthread_mutex_lock(&allocation_sites_lock);
+  for (size_t i = 0; i < allocation_site_count; i++) {
+    allocation_sites[i].allocations = 0;
+    allocation_sites[i].bytes = 0;
+  }
+  other_allocation_sites.allocations = 0;
+  other_allocation_sites.bytes = 0;
+  pthread_mutex_unlock(&allocation_sites_lock);
+#endif
+}
+
+#if defined(LLCP_STATIC_ALLOCATION)
+
+void *
+llcp_pool_get(struct llcp_pool *pool)
+{
+  void *res = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  for (size_t i = 0; i < pool->count; i++) {
+    if (!pool->used[i]) {
+      pool->used[i] = 1;
+      if (++pool->in_use > pool->high_watermark)
+        pool->high_watermark = pool->in_use;
+      res = pool->blocks + i * pool->size;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!res)
+    LLCP_POOL_LOG(LLC_PRIORITY_ERROR, "Pool %s exhausted (%d blocks)", pool->name, (int) pool->count);
+
+  return res;
+}
+
+void
+llcp_pool_put(struct llcp_pool *pool, void *block)
+{
+  if (!block)
+    return;
+
+  size_t i = ((uint8_t *) block - pool->blocks) / pool->size;
+  assert(((uint8_t *) block >= pool->blocks) && (i < pool->count));
+
+  pthread_mutex_lock(&pool->lock);
+  assert(pool->used[i]);
+  pool->used[i] = 0;
+  pool->in_use--;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+#endif /* LLCP_STATIC_ALLOCATION */
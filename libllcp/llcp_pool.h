@@ -0,0 +1,142 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#ifndef _LLCP_POOL_H
+#define _LLCP_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "llcp.h"
+
+/*
+ * Static allocation profile (--enable-static-allocation).
+ *
+ * Links, connections, services and PDUs come from fixed-size pools reserved
+ * at build time instead of the heap.  The capacities below can be overridden
+ * with CPPFLAGS.  PDUs must then be obtained from pdu_new() / pdu_unpack() for
+ * pdu_free() to return them to their pool.
+ *
+ * With the default capacities, a link (struct llc_link and struct mac_link)
+ * takes about 5.6 KiB and a connection 448 bytes on LP64.
+ */
+#if defined(LLCP_STATIC_ALLOCATION)
+
+#  ifndef LLCP_STATIC_LINKS
+#    define LLCP_STATIC_LINKS 1
+#  endif
+/* Data Link Connections and Logical Data Links, all links together */
+#  ifndef LLCP_STATIC_CONNECTIONS
+#    define LLCP_STATIC_CONNECTIONS 8
+#  endif
+#  ifndef LLCP_STATIC_SERVICES
+#    define LLCP_STATIC_SERVICES 8
+#  endif
+/*
+ * PDUs in use at the same time: per link, the link thread holds a received
+ * PDU and its reply while an application thread sends a UI, SNL or DISC PDU;
+ * per connection, the service thread may send one PDU while another thread
+ * receives one.
+ */
+#  ifndef LLCP_STATIC_PDUS
+#    define LLCP_STATIC_PDUS (3 * LLCP_STATIC_LINKS + 2 * LLCP_STATIC_CONNECTIONS)
+#  endif
+/* Largest local MIU, and so largest information field of a PDU */
+#  ifndef LLCP_STATIC_MIU
+#    define LLCP_STATIC_MIU LLCP_DEFAULT_MIU
+#  endif
+/* Largest service name, including the terminating NUL */
+#  ifndef LLCP_STATIC_URI_SIZE
+#    define LLCP_STATIC_URI_SIZE 64
+#  endif
+/* Service names being resolved or resolved on each link (SDP cache) */
+#  ifndef LLCP_STATIC_SDP_URIS
+#    define LLCP_STATIC_SDP_URIS 8
+#  endif
+
+struct llcp_pool {
+  const char *name;
+  size_t size;            /* Block size */
+  size_t count;
+  uint8_t *blocks;
+  uint8_t *used;
+  size_t in_use;
+  size_t high_watermark;
+  pthread_mutex_t lock;
+};
+
+/* Blocks are aligned for any object */
+#  define LLCP_POOL_BLOCK_SIZE(size) (((size) + sizeof(long double) - 1) & ~(sizeof(long double) - 1))
+
+#  define LLCP_POOL(pool, block_size, block_count) \
+  static long double pool##_blocks[(block_count) * LLCP_POOL_BLOCK_SIZE(block_size) / sizeof(long double)]; \
+  static uint8_t pool##_used[block_count]; \
+  static struct llcp_pool pool = { \
+    .name = #pool, \
+    .size = LLCP_POOL_BLOCK_SIZE(block_size), \
+    .count = (block_count), \
+    .blocks = (uint8_t *) pool##_blocks, \
+    .used = pool##_used, \
+    .lock = PTHREAD_MUTEX_INITIALIZER, \
+  }
+
+void		*llcp_pool_get(struct llcp_pool *pool);
+void		 llcp_pool_put(struct llcp_pool *pool, void *block);
+
+#  define llcp_pool_new(pool, size) llcp_pool_get(&pool)
+#  define llcp_pool_delete(pool, block) llcp_pool_put(&pool, block)
+
+/* Largest MIU the local LLC can announce */
+#  define LLCP_LOCAL_MAX_MIU LLCP_STATIC_MIU
+/*
+ * Largest information field sent to a remote LLC with the given MIU: pooled
+ * PDUs hold no more than LLCP_STATIC_MIU bytes, whatever the remote MIU.
+ */
+#  define LLCP_SEND_MIU(remote_miu) (((remote_miu) < LLCP_STATIC_MIU) ? (remote_miu) : LLCP_STATIC_MIU)
+
+#else /* LLCP_STATIC_ALLOCATION */
+
+#  define LLCP_POOL(pool, block_size, block_count) struct llcp_pool
+#  define llcp_pool_new(pool, size) llcp_malloc(size)
+#  define llcp_pool_delete(pool, block) llcp_free(block)
+
+#  define LLCP_LOCAL_MAX_MIU LLCP_MAX_MIU
+#  define LLCP_SEND_MIU(remote_miu) (remote_miu)
+
+#endif /* LLCP_STATIC_ALLOCATION */
+
+/*
+ * Heap allocations, through the allocator set with llcp_set_allocator().
+ * Debug builds account for them per call site.
+ */
+#if defined(DEBUG)
+#  define llcp_malloc(size) llcp_malloc_at(size, __FILE__, __LINE__)
+#  define llcp_strdup(s) llcp_strdup_at(s, __FILE__, __LINE__)
+#else
+#  define llcp_malloc(size) llcp_malloc_at(size, NULL, 0)
+#  define llcp_strdup(s) llcp_strdup_at(s, NULL, 0)
+#endif
+
+void		*llcp_malloc_at(size_t size, const char *file, int line);
+char		*llcp_strdup_at(const char *s, const char *file, int line);
+
+#endif /* !_LLCP_POOL_H */
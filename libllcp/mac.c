@@ -0,0 +1,605 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "llcp.h"
+#include "llcp_engine.h"
+#include "llcp_log.h"
+#include "llcp_pool.h"
+#include "llc_service.h"
+#include "llc_link.h"
+#include "mac.h"
+#include "mac_replay.h"
+
+#define LOG_MAC_LINK "libllcp.mac.link"
+#define MAC_LINK_MSG(priority, message) llcp_log_log (LOG_MAC_LINK, priority, "%s", message)
+#define MAC_LINK_LOG(priority, format, ...) llcp_log_log (LOG_MAC_LINK, priority, format, __VA_ARGS__)
+
+LLCP_POOL(mac_link_pool, sizeof(struct mac_link), LLCP_STATIC_LINKS);
+
+static uint8_t llcp_magic_number[] = { 0x46, 0x66, 0x6D };
+
+static uint8_t defaultid[10] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
+
+int		 mac_link_run(struct mac_link *link);
+int		 timeval_to_ms(const struct timeval tv);
+
+#define MAC_LINK_TIMESTAMP(link, phase) clock_gettime(CLOCK_MONOTONIC, &(link)->timings.phase)
+
+#ifdef DEBUG
+static long
+elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  if (!to->tv_sec && !to->tv_nsec)
+    return -1;
+  return (to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* Log how long each activation phase took */
+static void
+mac_link_log_timings(const struct mac_link *link)
+{
+  const struct mac_link_timings *t = &link->timings;
+
+  MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) Activation timings (us since start): device %ld, DEP %ld, general bytes %ld, LLC %ld, first PDU %ld",
+               link->driver->name,
+               elapsed_us(&t->start, &t->device_ready),
+               elapsed_us(&t->start, &t->dep),
+               elapsed_us(&t->start, &t->general_bytes),
+               elapsed_us(&t->start, &t->llc_activated),
+               elapsed_us(&t->start, &t->first_pdu));
+}
+#else
+#define mac_link_log_timings(link) do {} while (0)
+#endif /* DEBUG */
+
+struct mac_link *
+mac_link_new_with_driver(const struct mac_driver *driver, void *device, struct llc_link *llc_link) {
+  assert(driver);
+  assert(llc_link);
+  assert(!llc_link->mac_link);
+
+  struct mac_link *res;
+
+  if ((res = llcp_pool_new(mac_link_pool, sizeof(*res)))) {
+    struct mac_driver_timeouts timeouts = {
+      .initiator_slot = MAC_LINK_INITIATOR_SLOT,
+      .target_slot    = MAC_LINK_TARGET_SLOT,
+      .receive_margin = 0,
+    };
+
+    res->mode = MAC_LINK_UNSET;
+    res->driver = driver;
+    res->device = device;
+    res->llc_link = llc_link;
+    res->llc_link->mac_link = res;
+    res->exchange_pdus_thread = NULL;
+    memset(&res->timings, 0, sizeof(res->timings));
+    if (driver->get_timeouts)
+      driver->get_timeouts(res, &timeouts);
+    res->schedule.initiator_slot = timeouts.initiator_slot;
+    res->schedule.target_slot = timeouts.target_slot;
+    res->schedule.timeout = 0;
+    res->schedule.seed = (unsigned int) time(NULL) ^ (unsigned int)(uintptr_t) res;
+    res->receive_margin = timeouts.receive_margin;
+    memset(&res->activation_stats, 0, sizeof(res->activation_stats));
+    res->engine = NULL;
+    res->record = NULL;
+
+    memcpy(res->nfcid, defaultid, sizeof(defaultid));
+  }
+
+  return res;
+}
+
+/*
+ * Set the activation schedule: mac_link_activate() alternates between
+ * initiator slots of initiator_slot ms and target slots of target_slot ms,
+ * and gives up after timeout ms (0 to retry forever).
+ */
+int
+mac_link_set_schedule(struct mac_link *mac_link, int initiator_slot, int target_slot, int timeout)
+{
+  assert(mac_link);
+
+  if ((initiator_slot <= 0) || (target_slot <= 0) || (timeout < 0)) {
+    MAC_LINK_MSG(LLC_PRIORITY_ERROR, "Invalid activation schedule");
+    return -1;
+  }
+
+  mac_link->schedule.initiator_slot = initiator_slot;
+  mac_link->schedule.target_slot = target_slot;
+  mac_link->schedule.timeout = timeout;
+
+  return 0;
+}
+
+/*
+ * Run the LLC Link on an engine worker rather than its own thread.  Set it
+ * before the first activation.  The MAC Link keeps its exchange thread:
+ * drivers block for up to the LTO waiting for the remote device.
+ * Deactivate the LLC Link with llcp_engine_link_deactivate().
+ */
+void
+mac_link_set_engine(struct mac_link *mac_link, struct llcp_engine *engine)
+{
+  assert(mac_link);
+
+  mac_link->engine = engine;
+}
+
+/*
+ * Activate the MAC link in whichever mode the remote device is not in.
+ *
+ * Each slot is randomly spent as initiator or target, so that two devices
+ * running the same schedule cannot stay in the same mode for long.
+ */
+int
+mac_link_activate(struct mac_link *mac_link)
+{
+  assert(mac_link);
+
+  struct mac_link_activation_stats *stats = &mac_link->activation_stats;
+  struct timespec start, now;
+  int res;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  stats->slots = 0;
+
+  for (;;) {
+    struct timespec slot_start;
+    int slot;
+
+    clock_gettime(CLOCK_MONOTONIC, &slot_start);
+    stats->slots++;
+    if (rand_r(&mac_link->schedule.seed) & 0x01) {
+      slot = mac_link->schedule.initiator_slot;
+      res = mac_link_activate_as_initiator(mac_link);
+    } else {
+      slot = mac_link->schedule.target_slot;
+      res = mac_link_activate_as_target(mac_link);
+    }
+
+    if (res > 0)
+      break;
+
+    /* Do not retry before the end of a slot that failed early */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long slot_ms = (now.tv_sec - slot_start.tv_sec) * 1000 + (now.tv_nsec - slot_start.tv_nsec) / 1000000;
+    if (slot_ms < slot) {
+      struct timespec delay = {
+        .tv_sec  = (slot - slot_ms) / 1000,
+        .tv_nsec = ((slot - slot_ms) % 1000) * 1000000,
+      };
+      nanosleep(&delay, NULL);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    if (mac_link->schedule.timeout && (elapsed_ms >= mac_link->schedule.timeout)) {
+      MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) No LLCP Link after %d slots", mac_link->driver->name, stats->slots);
+      stats->failures++;
+      return -1;
+    }
+  }
+
+  const struct timespec *linked = &mac_link->timings.llc_activated;
+  long time_to_link = (linked->tv_sec - start.tv_sec) * 1000000 + (linked->tv_nsec - start.tv_nsec) / 1000;
+
+  stats->activations++;
+  stats->last_us = time_to_link;
+  if ((stats->activations == 1) || (time_to_link < stats->min_us))
+    stats->min_us = time_to_link;
+  if (time_to_link > stats->max_us)
+    stats->max_us = time_to_link;
+  stats->total_us += time_to_link;
+
+  MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) LLCP Link activated in %ld us (%d slots)", mac_link->driver->name, time_to_link, stats->slots);
+
+  return res;
+}
+
+static int
+mac_link_activate_as(struct mac_link *mac_link, int mode)
+{
+  uint8_t gb[MAC_GENERAL_BYTES_MAX];
+  uint8_t remote_gb[MAC_GENERAL_BYTES_MAX];
+  int res;
+
+  memset(&mac_link->timings, 0, sizeof(mac_link->timings));
+  MAC_LINK_TIMESTAMP(mac_link, start);
+
+  memcpy(gb, llcp_magic_number, sizeof(llcp_magic_number));
+  int params_len = llc_link_encode_parameters(mac_link->llc_link, gb + sizeof(llcp_magic_number), sizeof(gb) - sizeof(llcp_magic_number));
+  if (params_len < 0) {
+    MAC_LINK_MSG(LLC_PRIORITY_ERROR, "Cannot encode LLC Link parameters");
+    return -1;
+  }
+  size_t gb_len = sizeof(llcp_magic_number) + params_len;
+
+  if (mode == MAC_LINK_INITIATOR) {
+    MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) Attempting to activate LLCP Link as initiator", mac_link->driver->name);
+    res = mac_link->driver->initiator_activate(mac_link, gb, gb_len, remote_gb, sizeof(remote_gb), mac_link->schedule.initiator_slot);
+  } else {
+    MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) Attempting to activate LLCP Link as target (blocking)", mac_link->driver->name);
+    res = mac_link->driver->target_activate(mac_link, gb, gb_len, remote_gb, sizeof(remote_gb), mac_link->schedule.target_slot);
+  }
+  if (res < 0) {
+    MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) No LLCP Link established", mac_link->driver->name);
+    return -1;
+  }
+  MAC_LINK_TIMESTAMP(mac_link, dep);
+  if (mac_link->record)
+    mac_link_record_frame(mac_link, (mode == MAC_LINK_INITIATOR) ? MAC_RECORD_ACTIVATE_INITIATOR : MAC_RECORD_ACTIVATE_TARGET, remote_gb, res);
+
+  if (((size_t) res < sizeof(llcp_magic_number)) ||
+      memcmp(remote_gb, llcp_magic_number, sizeof(llcp_magic_number))) {
+    MAC_LINK_MSG(LLC_PRIORITY_ERROR, "LLCP Magic Number not found");
+    return -1;
+  }
+  MAC_LINK_TIMESTAMP(mac_link, general_bytes);
+  MAC_LINK_LOG(LLC_PRIORITY_INFO, "(%s) LLCP Link activated (%s)", mac_link->driver->name, (mode == MAC_LINK_INITIATOR) ? "initiator" : "target");
+
+  mac_link->mode = mode;
+  uint8_t flags = (mode == MAC_LINK_INITIATOR) ? LLC_INITIATOR : LLC_TARGET;
+  if (mac_link->engine)
+    res = llcp_engine_link_activate(mac_link->engine, mac_link->llc_link, flags, remote_gb + sizeof(llcp_magic_number), res - sizeof(llcp_magic_number));
+  else
+    res = llc_link_activate(mac_link->llc_link, flags, remote_gb + sizeof(llcp_magic_number), res - sizeof(llcp_magic_number));
+  if (res < 0) {
+    MAC_LINK_MSG(LLC_PRIORITY_FATAL, "Error activating LLC Link");
+    return -1;
+  }
+  MAC_LINK_TIMESTAMP(mac_link, llc_activated);
+
+  return mac_link_run(mac_link);
+}
+
+int
+mac_link_activate_as_initiator(struct mac_link *mac_link)
+{
+  assert(mac_link);
+
+  return mac_link_activate_as(mac_link, MAC_LINK_INITIATOR);
+}
+
+int
+mac_link_activate_as_target(struct mac_link *mac_link)
+{
+  assert(mac_link);
+
+  return mac_link_activate_as(mac_link, MAC_LINK_TARGET);
+}
+
+/*
+ * Hand a received PDU to the LLC Link.  Its up queue is small and
+ * non-blocking, so wait up to the local LTO for the LLC Link to catch up.
+ */
+static int
+mac_link_deliver(struct mac_link *link, const uint8_t *buffer, size_t len)
+{
+  struct timespec delay = {
+    .tv_sec  = 0,
+    .tv_nsec = 1000000,
+  };
+  int tries = timeval_to_ms(link->llc_link->local_lto);
+
+  while (mq_send(link->llc_link->llc_up, (char *) buffer, len, 0) < 0) {
+    if ((errno != EAGAIN) || (tries-- <= 0))
+      return -1;
+    nanosleep(&delay, NULL);
+  }
+
+  return 0;
+}
+
+void *
+mac_link_exchange_pdus(void *arg)
+{
+  struct mac_link *link = (struct mac_link *)arg;
+
+  if (link->mode == MAC_LINK_INITIATOR) {
+    /* Bootstrap the LLC communication sending a SYMM PDU */
+    uint8_t symm[2] = { 0x00, 0x00 };
+    if (pdu_send(link, symm, sizeof(symm)) < 0)
+      return NULL;
+  }
+
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
+  for (;;) {
+    ssize_t len = pdu_receive(link, buffer, sizeof(buffer));
+    if (len < 0) {
+      MAC_LINK_LOG(LLC_PRIORITY_WARN, "pdu_receive returned %d", len);
+      break;
+    }
+    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Received %d PDU bytes", (int) len);
+
+    if (!link->timings.first_pdu.tv_sec && !link->timings.first_pdu.tv_nsec) {
+      MAC_LINK_TIMESTAMP(link, first_pdu);
+      mac_link_log_timings(link);
+    }
+
+    if (LL_ACTIVATED == link->llc_link->status) {
+      if (mac_link_deliver(link, buffer, len) < 0) {
+        MAC_LINK_LOG(LLC_PRIORITY_FATAL, "Can't send data to LLC Link: %s", strerror(errno));
+        break;
+      }
+    }
+
+    struct timespec ts;
+    ts.tv_sec = link->llc_link->local_lto.tv_sec;
+    ts.tv_nsec = link->llc_link->local_lto.tv_usec * 1000;
+
+    /* Wait LTO - 2ms */
+    if (ts.tv_nsec < 2000000) {
+      ts.tv_sec -= 1;
+      ts.tv_nsec = ts.tv_nsec + 1000000000 - 2000000;
+    } else {
+      ts.tv_nsec -= 2000000;
+    }
+
+    len = mq_timedreceive(link->llc_link->llc_down, (char *) buffer, sizeof(buffer), NULL, &ts);
+
+    if (len < 0) {
+      switch (errno) {
+        case ETIMEDOUT:
+          buffer[0] = buffer[1] = 0x00;
+          len = 2;
+          break;
+        default:
+          break;
+      }
+    }
+    if (len < 0) {
+      MAC_LINK_LOG(LLC_PRIORITY_FATAL, "Can't receive data from LLC Link: %s", strerror(errno));
+      break;
+    }
+
+    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Sending %d bytes", len);
+    if ((len = pdu_send(link, buffer, len)) < 0) {
+      MAC_LINK_LOG(LLC_PRIORITY_WARN, "pdu_send returned %d", len);
+      break;
+    }
+  }
+
+  link->exchange_pdus_thread = NULL;
+
+  if (link->driver->link_lost && link->driver->link_lost(link)) {
+    /* The remote device has left the field */
+    return (void *) MAC_DEACTIVATE_ON_FAILURE;
+  }
+  return (void *) MAC_DEACTIVATE_ON_REQUEST;
+}
+
+void *
+mac_link_drain(void *arg)
+{
+  struct mac_link *link = (struct mac_link *)arg;
+
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
+  uint8_t sym_pdu[] = { 0x00, 0x00 };
+
+  for (;;) {
+    ssize_t len = pdu_receive(link, buffer, sizeof(buffer));
+    if (len < 0) {
+      MAC_LINK_LOG(LLC_PRIORITY_WARN, "pdu_receive returned %d (drain)", len);
+      break;
+    }
+    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Received %d bytes (drain)", (int) len);
+
+    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Sending %d bytes (drain)", sizeof(sym_pdu));
+    if ((len = pdu_send(link, sym_pdu, sizeof(sym_pdu))) < 0) {
+      MAC_LINK_LOG(LLC_PRIORITY_WARN, "pdu_send returned %d (drain)", len);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+int
+mac_link_run(struct mac_link *link)
+{
+  assert(link);
+
+  link->exchange_pdus_thread = &link->exchange_pdus;
+
+  /* The MAC Link thread has to answer within the LTO: let it run SCHED_FIFO */
+  if (llcp_thread_create(link->exchange_pdus_thread, &link->llc_link->thread_attributes, 1, "MAC Link", mac_link_exchange_pdus, link) < 0) {
+    MAC_LINK_MSG(LLC_PRIORITY_FATAL, "Cannot create PDU exchanging thread");
+    link->exchange_pdus_thread = NULL;
+    return -1;
+  }
+
+  return 1;
+}
+
+void
+mac_link_get_timings(const struct mac_link *mac_link, struct mac_link_timings *timings)
+{
+  assert(mac_link);
+  assert(timings);
+
+  *timings = mac_link->timings;
+}
+
+void
+mac_link_get_activation_stats(const struct mac_link *mac_link, struct mac_link_activation_stats *stats)
+{
+  assert(mac_link);
+  assert(stats);
+
+  *stats = mac_link->activation_stats;
+}
+
+int
+mac_link_wait(struct mac_link *link, void **value_ptr)
+{
+  assert(link);
+  assert(link->exchange_pdus_thread);
+  assert(value_ptr);
+
+  *value_ptr = NULL;
+
+  MAC_LINK_MSG(LLC_PRIORITY_TRACE, "Waiting for MAC Link PDU exchange thread to exit");
+  int res = pthread_join(*link->exchange_pdus_thread, value_ptr);
+  MAC_LINK_LOG(LLC_PRIORITY_TRACE, "MAC Link exchange PDU exchange thread terminated (returned %x)", *value_ptr);
+
+  return res;
+}
+
+int
+mac_link_deactivate(struct mac_link *link, intptr_t reason)
+{
+  assert(link);
+  assert((link->exchange_pdus_thread == NULL) || (*link->exchange_pdus_thread != pthread_self()));
+
+  MAC_LINK_LOG(LLC_PRIORITY_ALERT, "MAC Link deactivation requested (reason: %d)", reason);
+
+  if (!link->exchange_pdus_thread) {
+    MAC_LINK_MSG(LLC_PRIORITY_WARN, "MAC Link already stopped");
+    return 0;
+  }
+
+  llcp_threadslayer(*link->exchange_pdus_thread);
+  link->exchange_pdus_thread = NULL;
+
+  bool st;
+  if (link->mode == MAC_LINK_INITIATOR) {
+    switch (reason) {
+      case MAC_DEACTIVATE_ON_REQUEST:
+        st = !link->driver->deactivate || (link->driver->deactivate(link) == 0);
+        break;
+      case MAC_DEACTIVATE_ON_FAILURE:
+        /*
+         * If a failure already occured, the DEP connection is alreday
+         * broken so sending a deselect request would fail.
+         */
+        st = true;
+        break;
+      default:
+        abort();
+        break;
+    }
+  } else {
+    switch (reason) {
+      case MAC_DEACTIVATE_ON_REQUEST:
+        MAC_LINK_MSG(LLC_PRIORITY_INFO, "Drain mode");
+        link->exchange_pdus_thread = &link->exchange_pdus;
+        st = 0 == llcp_thread_create(link->exchange_pdus_thread, &link->llc_link->thread_attributes, 1, "MAC Link drain", mac_link_drain, link);
+        pthread_join(*link->exchange_pdus_thread, NULL);
+        link->exchange_pdus_thread = NULL;
+        break;
+      case MAC_DEACTIVATE_ON_FAILURE:
+        st = true;
+        break;
+      default:
+        abort();
+        break;
+    }
+  }
+
+  if (st) {
+    MAC_LINK_MSG(LLC_PRIORITY_INFO, "MAC Link deactivated");
+    return 0;
+  } else {
+    MAC_LINK_MSG(LLC_PRIORITY_ERROR, "MAC Link deactivation failed");
+    return -1;
+  }
+}
+
+int timeval_to_ms(const struct timeval tv)
+{
+  return ((tv.tv_sec * 1000) + (tv.tv_usec / 1000));
+}
+
+ssize_t
+pdu_send(struct mac_link *link, const void *buf, size_t nbytes)
+{
+  ssize_t res = -1;
+  int oldstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+  MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Sending %d bytes", nbytes);
+  if (link->mode == MAC_LINK_INITIATOR) {
+    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "LTOs: %d ms (local), %d ms (remote)", timeval_to_ms(link->llc_link->local_lto), timeval_to_ms(link->llc_link->remote_lto));
+    const int timeout = timeval_to_ms(link->llc_link->local_lto) + timeval_to_ms(link->llc_link->remote_lto);
+    res = link->driver->transceive(link, buf, nbytes, link->buffer, sizeof(link->buffer), timeout);
+    link->buffer_size = (res < 0) ? 0 : res;
+  } else {
+    res = link->driver->send(link, buf, nbytes, -1);
+  }
+
+  if (res < 0)
+    MAC_LINK_LOG(LLC_PRIORITY_FATAL, "Could not send %d bytes", nbytes);
+  else if (link->record)
+    mac_link_record_frame(link, MAC_RECORD_TX, buf, nbytes);
+  pthread_setcancelstate(oldstate, NULL);
+
+  return res;
+}
+
+ssize_t
+pdu_receive(struct mac_link *link, void *buf, size_t nbytes)
+{
+  ssize_t res;
+  int timeout = timeval_to_ms(link->llc_link->local_lto);
+
+  if (link->mode == MAC_LINK_INITIATOR) {
+    res = MIN(nbytes, link->buffer_size);
+    MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Received %d bytes (Requested %d, buffer size %d)", res, nbytes, link->buffer_size);
+    memcpy(buf, link->buffer, res);
+    if (link->record)
+      mac_link_record_frame(link, MAC_RECORD_RX, buf, res);
+    return res;
+  } else {
+    if ((res = link->driver->receive(link, buf, nbytes, timeout + link->receive_margin)) >= 0) {
+      MAC_LINK_LOG(LLC_PRIORITY_TRACE, "Received %d bytes", res);
+      if (link->record)
+        mac_link_record_frame(link, MAC_RECORD_RX, buf, res);
+      return res;
+    }
+  }
+  MAC_LINK_LOG(LLC_PRIORITY_FATAL, "MAC Level error on PDU reception (%d)", res);
+  return -1;
+}
+
+void
+mac_link_free(struct mac_link *mac_link)
+{
+  if (mac_link) {
+    if (mac_link->llc_link)
+      mac_link->llc_link->mac_link = NULL;
+    llcp_pool_delete(mac_link_pool, mac_link);
+  }
+}
@@ -24,27 +24,128 @@
 
 #include <sys/types.h>
 
+#include <stdio.h>
+#include <time.h>
+
 #include <nfc/nfc.h>
 
+#include "llcp.h"
+
 #ifdef __cplusplus
 extern  "C" {
 #endif /* __cplusplus */
 
+/*
+ * CLOCK_MONOTONIC timestamps of the last activation phases.  Phases that were
+ * not reached are zero.
+ */
+struct mac_link_timings {
+  struct timespec start;          /* mac_link_activate_as_*() called */
+  struct timespec device_ready;   /* Device initialized (set by drivers that need it) */
+  struct timespec dep;            /* DEP link established */
+  struct timespec general_bytes;  /* LLCP magic number and parameters checked */
+  struct timespec llc_activated;  /* llc_link_activate() returned */
+  struct timespec first_pdu;      /* First PDU received from the remote LLC */
+};
+
+/* Default slot lengths (ms) */
+#define MAC_LINK_INITIATOR_SLOT 10000
+#define MAC_LINK_TARGET_SLOT     5000
+
+/* Maximum length of the ATR general bytes */
+#define MAC_GENERAL_BYTES_MAX 48
+
+struct llcp_engine;
+struct mac_link;
+
+struct mac_driver_timeouts {
+  int initiator_slot;     /* Default initiator slot length (ms) */
+  int target_slot;        /* Default target slot length (ms) */
+  int receive_margin;     /* Added to the LTO when receiving as target (ms) */
+};
+
+/*
+ * MAC driver
+ *
+ * The MAC link handles the LLCP parts of the activation (magic number and
+ * link parameters) and the PDU exchange; a driver moves bytes over its
+ * transport.  The activation functions exchange general bytes and return the
+ * number of general bytes received from the remote device, or -1 when no
+ * link could be established within timeout ms.  Other functions return -1
+ * on failure.
+ */
+struct mac_driver {
+  const char *name;
+  int (*initiator_activate)(struct mac_link *link, const uint8_t *gb, size_t gb_len, uint8_t *remote_gb, size_t remote_gb_len, int timeout);
+  int (*target_activate)(struct mac_link *link, const uint8_t *gb, size_t gb_len, uint8_t *remote_gb, size_t remote_gb_len, int timeout);
+  ssize_t (*transceive)(struct mac_link *link, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout);
+  ssize_t (*send)(struct mac_link *link, const uint8_t *buf, size_t len, int timeout);
+  ssize_t (*receive)(struct mac_link *link, uint8_t *buf, size_t len, int timeout);
+  int (*deactivate)(struct mac_link *link);
+  int (*link_lost)(struct mac_link *link);  /* The last error means the remote device left */
+  void (*get_timeouts)(const struct mac_link *link, struct mac_driver_timeouts *timeouts);
+};
+
+extern const struct mac_driver mac_iso18092_driver;
+
+/* Time-to-link statistics of mac_link_activate() */
+struct mac_link_activation_stats {
+  unsigned activations;   /* Successful activations */
+  unsigned failures;      /* Activations that timed out */
+  unsigned slots;         /* Slots used by the last activation */
+  long last_us;           /* Time to link of the last activation */
+  long min_us;
+  long max_us;
+  uint64_t total_us;      /* Sum over all successful activations */
+};
+
 struct mac_link {
   enum { MAC_LINK_UNSET, MAC_LINK_INITIATOR, MAC_LINK_TARGET } mode;
-  nfc_device *device;
+  const struct mac_driver *driver;
+  void *device;           /* Driver specific, a nfc_device for mac_iso18092_driver */
   struct llc_link *llc_link;
   uint8_t nfcid[10];
-  uint8_t buffer[BUFSIZ];
+  uint8_t buffer[LLCP_MAX_PDU_SIZE];
   size_t buffer_size;
   pthread_t *__restrict__ exchange_pdus_thread;
+  pthread_t exchange_pdus;  /* Storage for exchange_pdus_thread */
+  struct mac_link_timings timings;
+  struct {
+    int initiator_slot;   /* Time polling for a target (ms) */
+    int target_slot;      /* Time waiting for an initiator (ms) */
+    int timeout;          /* mac_link_activate() gives up after (ms), 0 never */
+    unsigned int seed;
+  } schedule;
+  int receive_margin;
+  struct mac_link_activation_stats activation_stats;
+  struct llcp_engine *engine;  /* Runs the LLC Link, see mac_link_set_engine() */
+  FILE *record;           /* Frames are recorded there, see mac_link_record() */
+  struct timespec record_time;
 };
 
+/* Replay flags */
+#define MAC_REPLAY_FAST  0x00   /* Deliver frames as soon as they are requested */
+#define MAC_REPLAY_TIMED 0x01   /* Deliver frames with their recorded timing */
+
+struct mac_replay;
+
+struct mac_replay_stats {
+  size_t frames;          /* Frames delivered to the LLC Link */
+  size_t mismatches;      /* Frames sent by the LLC Link that differ from the record */
+};
+
+extern const struct mac_driver mac_replay_driver;
+
 struct mac_link	*mac_link_new(nfc_device *device, struct llc_link *llc_link);
+struct mac_link	*mac_link_new_with_driver(const struct mac_driver *driver, void *device, struct llc_link *llc_link);
 
+int		 mac_link_set_schedule(struct mac_link *mac_link, int initiator_slot, int target_slot, int timeout);
+void		 mac_link_set_engine(struct mac_link *mac_link, struct llcp_engine *engine);
 int		 mac_link_activate(struct mac_link *mac_link);
 int		 mac_link_activate_as_initiator(struct mac_link *mac_link);
 int		 mac_link_activate_as_target(struct mac_link *mac_link);
+void		 mac_link_get_timings(const struct mac_link *mac_link, struct mac_link_timings *timings);
+void		 mac_link_get_activation_stats(const struct mac_link *mac_link, struct mac_link_activation_stats *stats);
 
 ssize_t		 pdu_send(struct mac_link *link, const void *buf, size_t nbytes);
 ssize_t		 pdu_receive(struct mac_link *link, void *buf, size_t nbytes);
@@ -55,6 +156,11 @@ int		 mac_link_deactivate(struct mac_link *link, intptr_t reason);
 
 void		 mac_link_free(struct mac_link *mac_link);
 
+int		 mac_link_record(struct mac_link *mac_link, FILE *file);
+struct mac_replay *mac_replay_new(FILE *file, int flags);
+void		 mac_replay_get_stats(const struct mac_replay *replay, struct mac_replay_stats *stats);
+void		 mac_replay_free(struct mac_replay *replay);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -0,0 +1,331 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+
+/*
+ * Record and replay of MAC link sessions.
+ *
+ * mac_link_record() saves the frames a MAC link exchanges, with their
+ * timing.  The replay driver plays such a record back to an LLC Link without
+ * any hardware, either as fast as possible or with the recorded timing.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "llcp.h"
+#include "llcp_log.h"
+#include "llcp_pool.h"
+#include "mac.h"
+#include "mac_replay.h"
+
+#define LOG_MAC_REPLAY "libllcp.mac.replay"
+#define MAC_REPLAY_MSG(priority, message) llcp_log_log (LOG_MAC_REPLAY, priority, "%s", message)
+#define MAC_REPLAY_LOG(priority, format, ...) llcp_log_log (LOG_MAC_REPLAY, priority, format, __VA_ARGS__)
+
+static const uint8_t mac_record_magic[] = { 'L', 'L', 'C', 'R' };
+
+struct mac_replay {
+  FILE *file;
+  int flags;
+  uint64_t offset;        /* Record time of the last frame read (us) */
+  struct timespec start;  /* Replay time matching a record time of 0 */
+  int eof;
+  struct mac_replay_stats stats;
+};
+
+/*
+ * Start recording the frames of the MAC link to file, or stop recording if
+ * file is NULL.  The file is not closed by the MAC link.
+ */
+int
+mac_link_record(struct mac_link *mac_link, FILE *file)
+{
+  assert(mac_link);
+
+  if (file) {
+    uint8_t header[sizeof(mac_record_magic) + 1];
+    memcpy(header, mac_record_magic, sizeof(mac_record_magic));
+    header[sizeof(mac_record_magic)] = MAC_RECORD_VERSION;
+    if (fwrite(header, sizeof(header), 1, file) != 1) {
+      MAC_REPLAY_MSG(LLC_PRIORITY_ERROR, "Cannot write record header");
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mac_link->record_time);
+  }
+
+  mac_link->record = file;
+
+  return 0;
+}
+
+/* Called by the MAC link for each frame */
+void
+mac_link_record_frame(struct mac_link *link, uint8_t type, const uint8_t *data, size_t len)
+{
+  struct timespec now;
+  uint8_t header[7];
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint32_t delay = (now.tv_sec - link->record_time.tv_sec) * 1000000 + (now.tv_nsec - link->record_time.tv_nsec) / 1000;
+  link->record_time = now;
+
+  header[0] = type;
+  header[1] = delay >> 24;
+  header[2] = delay >> 16;
+  header[3] = delay >> 8;
+  header[4] = delay;
+  header[5] = len >> 8;
+  header[6] = len;
+
+  if ((fwrite(header, sizeof(header), 1, link->record) != 1) ||
+      (len && (fwrite(data, len, 1, link->record) != 1))) {
+    MAC_REPLAY_MSG(LLC_PRIORITY_ERROR, "Cannot record frame, recording stopped");
+    link->record = NULL;
+  }
+}
+
+struct mac_replay *
+mac_replay_new(FILE *file, int flags)
+{
+  assert(file);
+
+  uint8_t header[sizeof(mac_record_magic) + 1];
+  if ((fread(header, sizeof(header), 1, file) != 1) ||
+      memcmp(header, mac_record_magic, sizeof(mac_record_magic))) {
+    MAC_REPLAY_MSG(LLC_PRIORITY_ERROR, "Not a MAC link record");
+    return NULL;
+  }
+  if (header[sizeof(mac_record_magic)] != MAC_RECORD_VERSION) {
+    MAC_REPLAY_LOG(LLC_PRIORITY_ERROR, "Unsupported record version %d", header[sizeof(mac_record_magic)]);
+    return NULL;
+  }
+
+  struct mac_replay *replay;
+  if (!(replay = llcp_malloc(sizeof(*replay)))) {
+    MAC_REPLAY_MSG(LLC_PRIORITY_FATAL, "Cannot allocate memory");
+    return NULL;
+  }
+
+  replay->file = file;
+  replay->flags = flags;
+  replay->offset = 0;
+  replay->eof = 0;
+  memset(&replay->stats, 0, sizeof(replay->stats));
+
+  return replay;
+}
+
+/*
+ * Read the next frame, which must be of the given type.  Returns the frame
+ * length, or -1 at the end of the record or if the record does not match the
+ * session.
+ */
+static ssize_t
+mac_replay_read(struct mac_replay *replay, uint8_t type, uint8_t *data, size_t len)
+{
+  uint8_t header[7];
+  uint8_t frame[LLCP_MAX_PDU_SIZE];
+
+  if (replay->eof)
+    return -1;
+
+  if (fread(header, sizeof(header), 1, replay->file) != 1) {
+    MAC_REPLAY_MSG(LLC_PRIORITY_INFO, "End of record");
+    replay->eof = 1;
+    return -1;
+  }
+
+  size_t frame_len = (header[5] << 8) | header[6];
+  if ((frame_len > sizeof(frame)) || (frame_len && (fread(frame, frame_len, 1, replay->file) != 1))) {
+    MAC_REPLAY_MSG(LLC_PRIORITY_ERROR, "Truncated record");
+    replay->eof = 1;
+    return -1;
+  }
+
+  replay->offset += ((uint32_t) header[1] << 24) | (header[2] << 16) | (header[3] << 8) | header[4];
+
+  if (header[0] != type) {
+    MAC_REPLAY_LOG(LLC_PRIORITY_ERROR, "Unexpected frame type %d (expected %d)", header[0], type);
+    replay->eof = 1;
+    return -1;
+  }
+
+  if (type == MAC_RECORD_TX) {
+    /* Frames sent by the LLC Link are only compared with the record */
+    if ((frame_len != len) || memcmp(frame, data, len))
+      replay->stats.mismatches++;
+    return len;
+  }
+
+  if (frame_len > len) {
+    MAC_REPLAY_LOG(LLC_PRIORITY_ERROR, "Frame too large (%d bytes)", (int) frame_len);
+    replay->eof = 1;
+    return -1;
+  }
+  memcpy(data, frame, frame_len);
+
+  return frame_len;
+}
+
+/* Wait until the time the last frame read was received in the record */
+static void
+mac_replay_wait(struct mac_replay *replay)
+{
+  if (!(replay->flags & MAC_REPLAY_TIMED))
+    return;
+
+  struct timespec deadline = {
+    .tv_sec  = replay->start.tv_sec + replay->offset / 1000000,
+    .tv_nsec = replay->start.tv_nsec + (replay->offset % 1000000) * 1000,
+  };
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    ;
+}
+
+static int
+mac_replay_activate(struct mac_link *link, uint8_t type, uint8_t *remote_gb, size_t remote_gb_len)
+{
+  struct mac_replay *replay = link->device;
+
+  ssize_t res = mac_replay_read(replay, type, remote_gb, remote_gb_len);
+  if (res < 0)
+    return -1;
+
+  /* Align the record time of the activation with now */
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t start_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec - (int64_t) replay->offset * 1000;
+  replay->start.tv_sec = start_ns / 1000000000;
+  replay->start.tv_nsec = start_ns % 1000000000;
+
+  return res;
+}
+
+static int
+mac_replay_initiator_activate(struct mac_link *link, const uint8_t *gb, size_t gb_len, uint8_t *remote_gb, size_t remote_gb_len, int timeout)
+{
+  (void) gb;
+  (void) gb_len;
+  (void) timeout;
+
+  return mac_replay_activate(link, MAC_RECORD_ACTIVATE_INITIATOR, remote_gb, remote_gb_len);
+}
+
+static int
+mac_replay_target_activate(struct mac_link *link, const uint8_t *gb, size_t gb_len, uint8_t *remote_gb, size_t remote_gb_len, int timeout)
+{
+  (void) gb;
+  (void) gb_len;
+  (void) timeout;
+
+  return mac_replay_activate(link, MAC_RECORD_ACTIVATE_TARGET, remote_gb, remote_gb_len);
+}
+
+static ssize_t
+mac_replay_send(struct mac_link *link, const uint8_t *buf, size_t len, int timeout)
+{
+  (void) timeout;
+
+  return mac_replay_read(link->device, MAC_RECORD_TX, (uint8_t *) buf, len);
+}
+
+static ssize_t
+mac_replay_receive(struct mac_link *link, uint8_t *buf, size_t len, int timeout)
+{
+  struct mac_replay *replay = link->device;
+  (void) timeout;
+
+  ssize_t res = mac_replay_read(replay, MAC_RECORD_RX, buf, len);
+  if (res >= 0) {
+    mac_replay_wait(replay);
+    replay->stats.frames++;
+  }
+
+  return res;
+}
+
+static ssize_t
+mac_replay_transceive(struct mac_link *link, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout)
+{
+  if (mac_replay_send(link, tx, tx_len, timeout) < 0)
+    return -1;
+
+  return mac_replay_receive(link, rx, rx_len, timeout);
+}
+
+static int
+mac_replay_link_lost(struct mac_link *link)
+{
+  struct mac_replay *replay = link->device;
+
+  return replay->eof;
+}
+
+static void
+mac_replay_get_timeouts(const struct mac_link *link, struct mac_driver_timeouts *timeouts)
+{
+  (void) link;
+
+  timeouts->initiator_slot = MAC_LINK_INITIATOR_SLOT;
+  timeouts->target_slot = MAC_LINK_TARGET_SLOT;
+  timeouts->receive_margin = 0;
+}
+
+const struct mac_driver mac_replay_driver = {
+  .name               = "replay",
+  .initiator_activate = mac_replay_initiator_activate,
+  .target_activate    = mac_replay_target_activate,
+  .transceive         = mac_replay_transceive,
+  .send               = mac_replay_send,
+  .receive            = mac_replay_receive,
+  .deactivate         = NULL,
+  .link_lost          = mac_replay_link_lost,
+  .get_timeouts       = mac_replay_get_timeouts,
+};
+
+void
+mac_replay_get_stats(const struct mac_replay *replay, struct mac_replay_stats *stats)
+{
+  assert(replay);
+  assert(stats);
+
+  *stats = replay->stats;
+}
+
+/* The record file is not closed */
+void
+mac_replay_free(struct mac_replay *replay)
+{
+  llcp_free(replay);
+}
@@ -0,0 +1,52 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+
+#ifndef _MAC_REPLAY_H
+#define _MAC_REPLAY_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Record file format
+ *
+ * A record file starts with the "LLCR" magic number and a version byte,
+ * followed by frames:
+ *
+ *   type (1 byte) | delay since the previous frame in us (4 bytes) |
+ *   length (2 bytes) | data
+ *
+ * Integers are big endian.
+ */
+#define MAC_RECORD_VERSION 1
+
+#define MAC_RECORD_ACTIVATE_INITIATOR 0x01  /* General bytes of the target */
+#define MAC_RECORD_ACTIVATE_TARGET    0x02  /* General bytes of the initiator */
+#define MAC_RECORD_TX                 0x03  /* Frame sent by the local LLC */
+#define MAC_RECORD_RX                 0x04  /* Frame received from the remote LLC */
+
+struct mac_link;
+
+void		 mac_link_record_frame(struct mac_link *link, uint8_t type, const uint8_t *data, size_t len);
+
+#endif /* !_MAC_REPLAY_H */
@@ -0,0 +1,138 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+/*
+ * Benchmark for the Data Link Connection setup.
+ *
+ * Creates outgoing connections on an activated LLC Link, answers them with a
+ * CC PDU as the remote LLC would and measures the time until
+ * llc_connection_wait() returns, along with the CPU time the process spends
+ * meanwhile.
+ *
+ * Usage: bench_llc_connection [connections]
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "llc_connection.h"
+#include "llc_link.h"
+#include "llc_service.h"
+
+#define CONNECTIONS 1000
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void *
+void_service(void *arg)
+{
+  return arg;
+}
+
+static void
+send_pdu(struct llc_link *link, const uint8_t *pdu, size_t len)
+{
+  if (mq_send(link->llc_up, (const char *) pdu, len, 0) < 0) {
+    perror("mq_send");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Receive the PDU the LLC Link sends for the last one it received */
+static void
+receive_pdu(struct llc_link *link)
+{
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec timeout;
+
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec++;
+  if (mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout) < 0) {
+    perror("mq_timedreceive");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int connections = (argc > 1) ? atoi(argv[1]) : CONNECTIONS;
+  struct timespec start, end, cpu_start, cpu_end;
+  double total = 0, worst = 0, cpu = 0;
+
+  if (llcp_init() < 0)
+    return EXIT_FAILURE;
+
+  struct llc_link *link = llc_link_new();
+  struct llc_service *service = llc_service_new(NULL, void_service, NULL);
+  if (!link || !service || (llc_link_service_bind(link, service, 16) < 0))
+    return EXIT_FAILURE;
+  if (llc_link_activate(link, LLC_INITIATOR, NULL, 0) < 0)
+    return EXIT_FAILURE;
+
+  /* CC from SAP 32 to SAP 16, then SYMM to collect the DM of the teardown */
+  uint8_t cc[] = { 0x41, 0xA0 };
+  uint8_t symm[] = { 0x00, 0x00 };
+
+  for (int i = 0; i < connections; i++) {
+    struct llc_connection *connection = llc_outgoing_data_link_connection_new(link, 16, 32);
+    if (!connection)
+      return EXIT_FAILURE;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    send_pdu(link, cc, sizeof(cc));
+    if (llc_connection_wait(connection, NULL) != 0) {
+      fprintf(stderr, "llc_connection_wait() failed\n");
+      return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+
+    double ns = elapsed_ns(&start, &end);
+    total += ns;
+    if (ns > worst)
+      worst = ns;
+    cpu += elapsed_ns(&cpu_start, &cpu_end);
+
+    /* The service thread was joined: disconnect and let the link collect it */
+    connection->thread = 0;
+    connection->status = DLC_DISCONNECTED;
+    send_pdu(link, symm, sizeof(symm));
+    receive_pdu(link);
+  }
+
+  printf("%d connections: %.1f us average setup, %.1f us worst, %.1f us CPU\n",
+         connections, total / connections / 1000, worst / 1000, cpu / connections / 1000);
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+  llcp_fini();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,189 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+/*
+ * Benchmark for the multi-link engine.
+ *
+ * Pushes UI PDUs into many LLC Links at once, as the MAC layers of as many
+ * peers would, and compares running them on llcp_engine workers with running
+ * one LLC Link thread per link.
+ *
+ * Heap allocations made by the library while the PDUs are processed are
+ * counted through llcp_set_allocator() and reported per PDU.
+ *
+ * Usage: bench_llcp_engine [links [workers]]
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "llc_link.h"
+#include "llcp_engine.h"
+
+#define PDUS_PER_LINK 2000
+
+static size_t allocations;
+static pthread_mutex_t allocations_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+counting_allocate(void *context, size_t size)
+{
+  (void) context;
+  pthread_mutex_lock(&allocations_lock);
+  allocations++;
+  pthread_mutex_unlock(&allocations_lock);
+  return malloc(size);
+}
+
+static void
+counting_release(void *context, void *ptr)
+{
+  (void) context;
+  free(ptr);
+}
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Feed PDUS_PER_LINK UI PDUs to each link and wait for them to be consumed */
+static double
+pump(struct llc_link **links, size_t count)
+{
+  /* UI PDU to an unbound SAP: processed without any answer */
+  uint8_t ui[] = { 0x80, 0xE0, 'h', 'e', 'l', 'l', 'o' };
+  size_t sent[count];
+  size_t remaining = count;
+  struct timespec start, end;
+
+  for (size_t i = 0; i < count; i++)
+    sent[i] = 0;
+
+  pthread_mutex_lock(&allocations_lock);
+  allocations = 0;
+  pthread_mutex_unlock(&allocations_lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (remaining) {
+    size_t progress = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (sent[i] == PDUS_PER_LINK)
+        continue;
+      if (mq_send(links[i]->llc_up, (char *) ui, sizeof(ui), 0) == 0) {
+        progress++;
+        if (++sent[i] == PDUS_PER_LINK)
+          remaining--;
+      } else if (errno != EAGAIN) {
+        perror("mq_send");
+        exit(EXIT_FAILURE);
+      }
+    }
+    /* All queues are full: let the LLC Links run */
+    if (!progress)
+      sched_yield();
+  }
+  for (size_t i = 0; i < count; i++) {
+    struct mq_attr attr;
+    while ((mq_getattr(links[i]->llc_up, &attr) == 0) && attr.mq_curmsgs)
+      sched_yield();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return elapsed_ns(&start, &end);
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 64;
+  size_t workers = (argc > 2) ? strtoul(argv[2], NULL, 10) : 0;
+  struct llc_link *links[count];
+  double ns;
+
+  struct llcp_allocator allocator = {
+    .allocate = counting_allocate,
+    .release = counting_release,
+    .context = NULL,
+  };
+  llcp_set_allocator(&allocator);
+
+  if (llcp_init() < 0)
+    exit(EXIT_FAILURE);
+
+  struct llcp_engine *engine = llcp_engine_new(workers);
+  if (!engine)
+    exit(EXIT_FAILURE);
+  if (count > llcp_engine_workers(engine) * LLCP_ENGINE_WORKER_LINKS) {
+    fprintf(stderr, "Cannot run more than %d links per worker\n", LLCP_ENGINE_WORKER_LINKS);
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (!(links[i] = llc_link_new()))
+      exit(EXIT_FAILURE);
+  }
+
+  printf("%zu links, %d PDUs per link\n", count, PDUS_PER_LINK);
+
+  /* One thread per link */
+  for (size_t i = 0; i < count; i++) {
+    if (llc_link_activate(links[i], LLC_INITIATOR, NULL, 0) < 0)
+      exit(EXIT_FAILURE);
+  }
+  ns = pump(links, count);
+  printf("%-24s %12.0f PDU/s %6.2f allocs/PDU\n", "thread per link", count * PDUS_PER_LINK / ns * 1e9,
+         (double) allocations / (count * PDUS_PER_LINK));
+  for (size_t i = 0; i < count; i++)
+    llc_link_deactivate(links[i]);
+
+  /* Engine */
+  if (llcp_engine_start(engine) < 0)
+    exit(EXIT_FAILURE);
+  for (size_t i = 0; i < count; i++) {
+    if (llcp_engine_link_activate(engine, links[i], LLC_INITIATOR, NULL, 0) < 0)
+      exit(EXIT_FAILURE);
+  }
+  ns = pump(links, count);
+  printf("%-24s %12.0f PDU/s %6.2f allocs/PDU (%zu workers, %zu links per worker)\n", "engine",
+         count * PDUS_PER_LINK / ns * 1e9, (double) allocations / (count * PDUS_PER_LINK),
+         llcp_engine_workers(engine), (count + llcp_engine_workers(engine) - 1) / llcp_engine_workers(engine));
+  for (size_t w = 0; w < llcp_engine_workers(engine); w++) {
+    struct llcp_engine_stats stats;
+    llcp_engine_get_stats(engine, w, &stats);
+    printf("  worker %-3zu %4zu links %10llu PDUs %8llu idle wakeups\n", w, stats.links,
+           (unsigned long long) stats.pdus, (unsigned long long) stats.wakeups);
+  }
+  for (size_t i = 0; i < count; i++) {
+    llcp_engine_link_deactivate(engine, links[i]);
+    llc_link_free(links[i]);
+  }
+  llcp_engine_free(engine);
+
+  llcp_fini();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,163 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+/*
+ * Micro-benchmark for the TLV parameters codec.
+ *
+ * Compares decoding a link parameters list in a single pass with
+ * parameters_decode() against walking it and calling one parameter_decode_*
+ * function per field, and the same for encoding with parameters_encode().
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "llcp_parameters.h"
+
+#define ITERATIONS 1000000
+
+static const uint8_t link_parameters[] = {
+  0x01, 0x01, 0x11,
+  0x02, 0x02, 0x07, 0xff,
+  0x03, 0x02, 0x00, 0x13,
+  0x04, 0x01, 0x64,
+  0x07, 0x01, 0x03,
+};
+
+static volatile uint16_t sink;
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static int
+decode_per_field(const uint8_t *buffer, size_t len)
+{
+  struct llcp_version version;
+  uint16_t miux, wks;
+  uint8_t lto, opt;
+
+  size_t offset = 0;
+  while (offset < len) {
+    if ((offset > len - 2) || (offset + 2 + buffer[offset + 1] > len))
+      return -1;
+    const uint8_t *tlv = buffer + offset;
+    size_t tlv_len = 2 + buffer[offset + 1];
+    switch (buffer[offset]) {
+      case LLCP_PARAMETER_VERSION:
+        if (parameter_decode_version(tlv, tlv_len, &version) < 0)
+          return -1;
+        break;
+      case LLCP_PARAMETER_MIUX:
+        if (parameter_decode_miux(tlv, tlv_len, &miux) < 0)
+          return -1;
+        sink = miux;
+        break;
+      case LLCP_PARAMETER_WKS:
+        if (parameter_decode_wks(tlv, tlv_len, &wks) < 0)
+          return -1;
+        break;
+      case LLCP_PARAMETER_LTO:
+        if (parameter_decode_lto(tlv, tlv_len, &lto) < 0)
+          return -1;
+        break;
+      case LLCP_PARAMETER_OPT:
+        if (parameter_decode_opt(tlv, tlv_len, &opt) < 0)
+          return -1;
+        break;
+    }
+    offset += tlv_len;
+  }
+  return 0;
+}
+
+static int
+encode_per_field(uint8_t *buffer, size_t len, const struct llcp_parameters *p)
+{
+  int n, res = 0;
+
+  if ((n = parameter_encode_version(buffer + res, len - res, p->version)) < 0)
+    return -1;
+  res += n;
+  if ((n = parameter_encode_miux(buffer + res, len - res, p->miux)) < 0)
+    return -1;
+  res += n;
+  if ((n = parameter_encode_wks(buffer + res, len - res, p->wks)) < 0)
+    return -1;
+  res += n;
+  if ((n = parameter_encode_lto(buffer + res, len - res, p->lto)) < 0)
+    return -1;
+  res += n;
+  if ((n = parameter_encode_opt(buffer + res, len - res, p->opt)) < 0)
+    return -1;
+  res += n;
+
+  return res;
+}
+
+int
+main(void)
+{
+  struct timespec start, end;
+  struct llcp_parameters parameters;
+  uint8_t buffer[64];
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (decode_per_field(link_parameters, sizeof(link_parameters)) < 0)
+      abort();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("decode (per field):   %6.1f ns/op\n", elapsed_ns(&start, &end) / ITERATIONS);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (parameters_decode(link_parameters, sizeof(link_parameters), &parameters) < 0)
+      abort();
+    sink = parameters.miux;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("decode (single pass): %6.1f ns/op\n", elapsed_ns(&start, &end) / ITERATIONS);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (encode_per_field(buffer, sizeof(buffer), &parameters) < 0)
+      abort();
+    sink = buffer[0];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("encode (per field):   %6.1f ns/op\n", elapsed_ns(&start, &end) / ITERATIONS);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (parameters_encode(buffer, sizeof(buffer), &parameters) < 0)
+      abort();
+    sink = buffer[0];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("encode (single pass):%6.1f ns/op\n", elapsed_ns(&start, &end) / ITERATIONS);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+/*
+ * Micro-benchmarks for the PDU and parameters codecs.
+ *
+ * Reports the time (ns/op) and the number of heap allocations (allocs/op)
+ * of pdu_pack(), pdu_unpack(), pdu_aggregate(), pdu_dispatch(), pdu_new_cc(),
+ * pdu_new_frmr() and every parameter_encode_* / parameter_decode_* function.
+ * PDUs are measured with information fields from empty up to the largest
+ * MIU, AGF PDUs with 2 to 16 encapsulated PDUs.
+ *
+ * Allocations are counted by interposing malloc(3) and friends, which is
+ * only possible with the GNU C library; elsewhere they are reported as n/a.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "llcp.h"
+#include "llcp_parameters.h"
+#include "llcp_pdu.h"
+#include "llc_connection.h"
+
+#define ITERATIONS 200000
+
+#if defined(__GLIBC__)
+#  define HAVE_ALLOCATION_COUNT 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+static size_t allocations;
+
+void *
+malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  allocations++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+  __libc_free(ptr);
+}
+#else
+static size_t allocations;
+#endif
+
+static const size_t payload_sizes[] = { 0, 16, 128, 512, LLCP_MAX_MIU };
+static const size_t fan_outs[] = { 2, 4, 8, 16 };
+
+static volatile uint8_t sink;
+
+struct bench {
+  struct timespec start;
+  size_t allocations;
+};
+
+static void
+bench_start(struct bench *bench)
+{
+  bench->allocations = allocations;
+  clock_gettime(CLOCK_MONOTONIC, &bench->start);
+}
+
+static void
+bench_stop(struct bench *bench, const char *name, size_t arg, int iterations)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double ns = (end.tv_sec - bench->start.tv_sec) * 1e9 + (end.tv_nsec - bench->start.tv_nsec);
+  char label[64];
+  snprintf(label, sizeof(label), "%s(%zu)", name, arg);
+
+#if defined(HAVE_ALLOCATION_COUNT)
+  printf("%-28s %9.1f ns/op %6.2f allocs/op\n", label, ns / iterations,
+	 (double)(allocations - bench->allocations) / iterations);
+#else
+  printf("%-28s %9.1f ns/op    n/a allocs/op\n", label, ns / iterations);
+#endif
+}
+
+static void
+bench_pdu_codec(void)
+{
+  static uint8_t information[LLCP_MAX_MIU];
+  static uint8_t buffer[LLCP_MAX_MIU + 3];
+  struct bench bench;
+
+  memset(information, 0x5a, sizeof(information));
+
+  for (size_t i = 0; i < sizeof(payload_sizes) / sizeof(*payload_sizes); i++) {
+    size_t len = payload_sizes[i];
+    struct pdu *pdu = pdu_new(0x20, PDU_I, 0x21, 3, 4, information, len);
+    int n = 0;
+    if (!pdu)
+      abort();
+
+    bench_start(&bench);
+    for (int j = 0; j < ITERATIONS; j++) {
+      if ((n = pdu_pack(pdu, buffer, sizeof(buffer))) < 0)
+	abort();
+      sink = buffer[n - 1];
+    }
+    bench_stop(&bench, "pdu_pack", len, ITERATIONS);
+
+    bench_start(&bench);
+    for (int j = 0; j < ITERATIONS; j++) {
+      struct pdu *p;
+      if (!(p = pdu_unpack(buffer, n)))
+	abort();
+      sink = p->ns;
+      pdu_free(p);
+    }
+    bench_stop(&bench, "pdu_unpack", len, ITERATIONS);
+
+    pdu_free(pdu);
+  }
+}
+
+static void
+bench_pdu_agf(void)
+{
+  static uint8_t information[128];
+  struct pdu *pdus[17];
+  struct bench bench;
+
+  memset(information, 0xa5, sizeof(information));
+
+  for (size_t i = 0; i < sizeof(fan_outs) / sizeof(*fan_outs); i++) {
+    size_t fan_out = fan_outs[i];
+    for (size_t j = 0; j < fan_out; j++) {
+      /* Mix short connectionless and connection-oriented PDUs */
+      if (j % 2)
+	pdus[j] = pdu_new(0x20, PDU_I, 0x21, j & 0x0f, j & 0x0f, information, sizeof(information));
+      else
+	pdus[j] = pdu_new(0x20, PDU_UI, 0x21, 0, 0, information, 16);
+      if (!pdus[j])
+	abort();
+    }
+    pdus[fan_out] = NULL;
+
+    struct pdu *agf;
+    bench_start(&bench);
+    for (int j = 0; j < ITERATIONS / 10; j++) {
+      if (!(agf = pdu_aggregate(pdus)))
+	abort();
+      sink = agf->information[0];
+      pdu_free(agf);
+    }
+    bench_stop(&bench, "pdu_aggregate", fan_out, ITERATIONS / 10);
+
+    if (!(agf = pdu_aggregate(pdus)))
+      abort();
+
+    bench_start(&bench);
+    for (int j = 0; j < ITERATIONS / 10; j++) {
+      struct pdu **dispatched;
+      if (!(dispatched = pdu_dispatch(agf)))
+	abort();
+      for (struct pdu **p = dispatched; *p; p++) {
+	sink = (*p)->ptype;
+	pdu_free(*p);
+      }
+      llcp_free(dispatched);
+    }
+    bench_stop(&bench, "pdu_dispatch", fan_out, ITERATIONS / 10);
+
+    pdu_free(agf);
+    for (size_t j = 0; j < fan_out; j++)
+      pdu_free(pdus[j]);
+  }
+}
+
+static void
+bench_pdu_new(void)
+{
+  struct llc_connection connection;
+  struct bench bench;
+
+  memset(&connection, 0, sizeof(connection));
+  connection.local_sap = 0x20;
+  connection.remote_sap = 0x21;
+  connection.local_miu = LLCP_MAX_MIU;
+  connection.rwl = 4;
+  connection.state.s = 3;
+  connection.state.r = 5;
+
+  struct pdu *rejected = pdu_new(0x20, PDU_I, 0x21, 1, 2, NULL, 0);
+  if (!rejected)
+    abort();
+
+  bench_start(&bench);
+  for (int i = 0; i < ITERATIONS; i++) {
+    struct pdu *pdu;
+    if (!(pdu = pdu_new_cc(&connection)))
+      abort();
+    sink = pdu->information_size;
+    pdu_free(pdu);
+  }
+  bench_stop(&bench, "pdu_new_cc", 0, ITERATIONS);
+
+  bench_start(&bench);
+  for (int i = 0; i < ITERATIONS; i++) {
+    struct pdu *pdu;
+    if (!(pdu = pdu_new_frmr(0x21, 0x20, rejected, &connection, FRMR_I)))
+      abort();
+    sink = pdu->information_size;
+    pdu_free(pdu);
+  }
+  bench_stop(&bench, "pdu_new_frmr", 0, ITERATIONS);
+
+  pdu_free(rejected);
+}
+
+static void
+bench_parameters(void)
+{
+  static const char sn[] = "urn:nfc:sn:snep";
+  struct llcp_version version = { 1, 1 };
+  uint8_t buffer[64];
+  char string[64];
+  struct bench bench;
+  uint16_t u16;
+  uint8_t u8, tid;
+  int n = 0;
+
+#define BENCH_ENCODE(name, ...) \
+  do { \
+    bench_start(&bench); \
+    for (int i = 0; i < ITERATIONS; i++) { \
+      if ((n = parameter_encode_##name(buffer, sizeof(buffer), __VA_ARGS__)) < 0) \
+	abort(); \
+      sink = buffer[n - 1]; \
+    } \
+    bench_stop(&bench, "parameter_encode_" #name, n, ITERATIONS); \
+  } while (0)
+
+#define BENCH_DECODE(name, ...) \
+  do { \
+    bench_start(&bench); \
+    for (int i = 0; i < ITERATIONS; i++) { \
+      if (parameter_decode_##name(buffer, n, __VA_ARGS__) < 0) \
+	abort(); \
+      sink = buffer[0]; \
+    } \
+    bench_stop(&bench, "parameter_decode_" #name, n, ITERATIONS); \
+  } while (0)
+
+  BENCH_ENCODE(version, version);
+  BENCH_DECODE(version, &version);
+  BENCH_ENCODE(miux, 0x07ff);
+  BENCH_DECODE(miux, &u16);
+  BENCH_ENCODE(wks, 0x0013);
+  BENCH_DECODE(wks, &u16);
+  BENCH_ENCODE(lto, 100);
+  BENCH_DECODE(lto, &u8);
+  BENCH_ENCODE(rw, 4);
+  BENCH_DECODE(rw, &u8);
+  BENCH_ENCODE(sn, sn);
+  BENCH_DECODE(sn, string, sizeof(string));
+  BENCH_ENCODE(opt, 0x03);
+  BENCH_DECODE(opt, &u8);
+  BENCH_ENCODE(sdreq, 1, sn);
+  BENCH_DECODE(sdreq, &tid, string, sizeof(string));
+  BENCH_ENCODE(sdres, 1, 0x04);
+  BENCH_DECODE(sdres, &tid, &u8);
+
+#undef BENCH_ENCODE
+#undef BENCH_DECODE
+}
+
+int
+main(void)
+{
+  bench_pdu_codec();
+  bench_pdu_agf();
+  bench_pdu_new();
+  bench_parameters();
+
+  return EXIT_SUCCESS;
+}
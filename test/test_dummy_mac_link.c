@@ -84,7 +84,7 @@ echo_service(void *arg)
   pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
   for (;;) {
-    char buffer[1024];
+    char buffer[LLCP_MAX_PDU_SIZE];
     int res = mq_receive(llc_up, buffer, sizeof(buffer), NULL);
     pthread_testcancel();
     cut_assert_equal_int(7, res, cut_message("Invalid message length"));
@@ -94,11 +94,38 @@ echo_service(void *arg)
   }
 }
 
+void *
+large_echo_service(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *)arg;
+
+  int old_cancelstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
+
+  cut_set_current_test_context(connection->link->cut_test_context);
+
+  mqd_t llc_up = mq_open(connection->mq_up_name, O_RDONLY);
+  cut_assert_false(llc_up == (mqd_t) - 1, cut_message("Can't open llc_up mqueue for reading"));
+
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+  for (;;) {
+    uint8_t buffer[LLCP_MAX_PDU_SIZE];
+    int res = mq_receive(llc_up, (char *) buffer, sizeof(buffer), NULL);
+    pthread_testcancel();
+    cut_assert_equal_int(2 + LLCP_MAX_MIU, res, cut_message("Invalid message length"));
+    for (int i = 0; i < LLCP_MAX_MIU; i++)
+      cut_assert_equal_int((uint8_t) i, buffer[2 + i], cut_message("Invalid message data"));
+    sem_post(sem_cutter);
+    pthread_testcancel();
+  }
+}
+
 void
 dummy_mac_transport(struct llc_link *initiator, struct llc_link *target)
 {
   int n;
-  char buffer[1024];
+  char buffer[LLCP_MAX_PDU_SIZE];
 
   for (;;) {
     struct timespec ts = {
@@ -166,7 +193,7 @@ test_dummy_mac_link(void)
   res = llc_link_activate(target, LLC_TARGET | LLC_PAX_PDU_PROHIBITED, NULL, 0);
   cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
 
-  char buffer[1024];
+  char buffer[LLCP_MAX_PDU_SIZE];
 
   pthread_t transport;
   struct dummy_mac_transport_endpoints eps = {
@@ -214,3 +241,72 @@ test_dummy_mac_link(void)
   llc_link_free(target);
 
 }
+
+void
+test_dummy_mac_link_large_miu(void)
+{
+  int res;
+  struct llc_link *initiator, *target;
+  struct llc_service *service;
+
+  initiator = llc_link_new();
+  cut_assert_not_null(initiator, cut_message("llc_link_new()"));
+  target = llc_link_new();
+  cut_assert_not_null(target, cut_message("llc_link_new()"));
+
+  initiator->cut_test_context = cut_get_current_test_context();
+
+  service = llc_service_new(NULL, large_echo_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+
+  res = llc_link_service_bind(initiator, service, ECHO_SAP);
+  cut_assert_equal_int(ECHO_SAP, res, cut_message("llc_link_service_bind()"));
+
+  llc_link_set_miu(initiator, LLCP_MAX_MIU);
+  llc_link_set_miu(target, LLCP_MAX_MIU);
+
+  /* Exchange link parameters as the MAC would */
+  uint8_t initiator_params[BUFSIZ], target_params[BUFSIZ];
+  int initiator_params_len = llc_link_encode_parameters(initiator, initiator_params, sizeof(initiator_params));
+  int target_params_len = llc_link_encode_parameters(target, target_params, sizeof(target_params));
+
+  res = llc_link_activate(initiator, LLC_INITIATOR | LLC_PAX_PDU_PROHIBITED, target_params, target_params_len);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+  res = llc_link_activate(target, LLC_TARGET | LLC_PAX_PDU_PROHIBITED, initiator_params, initiator_params_len);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+  cut_assert_equal_int(LLCP_MAX_MIU, target->remote_miu, cut_message("Wrong remote MIU"));
+
+  pthread_t transport;
+  struct dummy_mac_transport_endpoints eps = {
+    .initiator = initiator,
+    .target = target,
+  };
+  pthread_create(&transport, NULL, dummy_mac_transport_thread, &eps);
+
+  uint8_t data[LLCP_MAX_MIU];
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = i;
+
+  res = llc_link_send_data(target, 0x20, ECHO_SAP, data, sizeof(data));
+  cut_assert_equal_int(0, res, cut_message("llc_link_send_data()"));
+
+  struct timespec ts = {
+    .tv_sec = time(NULL) + 2,
+    .tv_nsec = 0,
+  };
+
+  int old_cancelstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancelstate);
+  res = sem_timedwait(sem_cutter, &ts);
+  cut_assert_equal_int(0, res, cut_message("Message not received"));
+  pthread_setcancelstate(old_cancelstate, NULL);
+
+  pthread_cancel(transport);
+  pthread_join(transport, NULL);
+
+  llc_link_deactivate(initiator);
+  llc_link_deactivate(target);
+
+  llc_link_free(initiator);
+  llc_link_free(target);
+}
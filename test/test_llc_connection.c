@@ -24,6 +24,8 @@
 #include <sys/types.h>
 
 #include <cutter.h>
+#include <errno.h>
+#include <time.h>
 
 #include "llc_connection.h"
 #include "llc_link.h"
@@ -139,21 +141,19 @@ test_llc_logical_data_link_new(void)
 
   cut_assert_equal_int(32, connection1->service_sap, cut_message("Wrong SAP"));
   cut_assert_equal_int(32, connection1->local_sap, cut_message("Wrong DSAP"));
-  cut_assert_equal_int(24, connection1->remote_sap, cut_message("Wrong SSAP"));
+  cut_assert_equal_int(0, connection1->remote_sap, cut_message("A Logical Data Link receives from any SAP"));
+  cut_assert_true(llc_link->datagram_handlers[32] == connection1, cut_message("Logical Data Link not registered"));
 
+  /* There is a single Logical Data Link per service SAP */
   connection2 = llc_logical_data_link_new(llc_link, pdu);
-  cut_assert_not_null(connection2, cut_message("llc_logical_data_link_new()"));
-
-  cut_assert_equal_int(32, connection2->service_sap, cut_message("Wrong SAP"));
-  cut_assert_equal_int(32, connection2->local_sap, cut_message("Wrong DSAP"));
-  cut_assert_equal_int(24, connection2->remote_sap, cut_message("Wrong SSAP"));
+  cut_assert_null(connection2, cut_message("llc_logical_data_link_new()"));
 
   llc_link_service_unbind(llc_link, 32);
 
   llc_service_free(service);
 
+  llc_link->datagram_handlers[32] = NULL;
   llc_connection_free(connection1);
-  llc_connection_free(connection2);
 
   pdu_free(pdu);
 }
@@ -192,7 +192,7 @@ test_llc_connection_accept(void)
   int res = llc_link_activate(llc_link, 0, NULL, 0);
   cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
 
-  char buffer[1024] = { 0x45, 0x20 };
+  char buffer[LLCP_MAX_PDU_SIZE] = { 0x45, 0x20 };
   res = mq_send(llc_link->llc_up, buffer, 2, 0);
   cut_assert_not_equal_int(-1, res, cut_message("mq_send()"));
 
@@ -234,7 +234,7 @@ test_llc_connection_reject(void)
   int res = llc_link_activate(llc_link, 0, NULL, 0);
   cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
 
-  char buffer[1024] = { 0x45, 0x20 };
+  char buffer[LLCP_MAX_PDU_SIZE] = { 0x45, 0x20 };
   res = mq_send(llc_link->llc_up, buffer, 2, 0);
   cut_assert_not_equal_int(-1, res, cut_message("mq_send()"));
 
@@ -259,3 +259,127 @@ test_llc_connection_reject(void)
 
   llc_service_free(service);
 }
+
+void
+test_llc_connection_receive_window(void)
+{
+  struct llc_connection *connection;
+  struct llc_service *service;
+  struct mq_attr attr;
+
+  service = llc_service_new(NULL, void_thread, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  int sap = llc_link_service_bind(llc_link, service, 17);
+  cut_assert_equal_int(17, sap, cut_message("llc_link_service_bind"));
+
+  /* The window is bounded by the receive buffer */
+  llc_service_set_receive_buffer(service, 6 * (3 + LLCP_DEFAULT_MIU));
+  connection = llc_outgoing_data_link_connection_new(llc_link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+  cut_assert_equal_int(3, connection->rwl, cut_message("Wrong receive window"));
+  mq_getattr(connection->llc_up, &attr);
+  cut_assert_equal_int(6, attr.mq_maxmsg, cut_message("The up queue should hold two receive windows"));
+
+  /* Record the application consuming two PDUs */
+  uint8_t i_pdu[] = { 0x47, 0x20, 0x00, 'h', 'e', 'l', 'l', 'o' };
+  uint8_t data[16];
+  for (int i = 0; i < 2; i++) {
+    cut_assert_equal_int(0, mq_send(connection->llc_up, (char *) i_pdu, sizeof(i_pdu), 0), cut_message("mq_send()"));
+    cut_assert_equal_int(5, llc_connection_recv(connection, data, sizeof(data), NULL), cut_message("llc_connection_recv()"));
+  }
+  llc_link->transmission_handlers[17] = NULL;
+  llc_connection_free(connection);
+  cut_assert_equal_int(5, service->consumption.size, cut_message("Wrong average information size"));
+  cut_assert_not_equal_int(0, service->consumption.rate, cut_message("Consumption rate should be known"));
+
+  /* ... and by RW */
+  service->consumption.rate = 0;
+  llc_service_set_rw(service, 2);
+  connection = llc_outgoing_data_link_connection_new(llc_link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+  cut_assert_equal_int(2, connection->rwl, cut_message("Wrong receive window"));
+  llc_link->transmission_handlers[17] = NULL;
+  llc_connection_free(connection);
+
+  /* A slow consumer gets the smallest window */
+  uint8_t parameters[] = { 0x04, 0x01, 0x0A };
+  cut_assert_equal_int(0, llc_link_activate(llc_link, LLC_INITIATOR, parameters, sizeof(parameters)), cut_message("llc_link_activate()"));
+  llc_service_set_rw(service, LLCP_MAX_RW);
+  service->consumption.rate = 50;
+  service->consumption.size = 100;
+  connection = llc_outgoing_data_link_connection_new(llc_link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+  cut_assert_equal_int(1, connection->rwl, cut_message("Wrong receive window"));
+  llc_link->transmission_handlers[17] = NULL;
+  llc_connection_free(connection);
+
+  /* A fast one gets what fits in its receive buffer */
+  service->consumption.rate = 1000000;
+  connection = llc_outgoing_data_link_connection_new(llc_link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+  cut_assert_equal_int(3, connection->rwl, cut_message("Wrong receive window"));
+  llc_link->transmission_handlers[17] = NULL;
+  llc_connection_free(connection);
+  llc_link_deactivate(llc_link);
+
+  llc_link_service_unbind(llc_link, 17);
+  llc_service_free(service);
+}
+
+static void *
+reject_later(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 10000000,
+  };
+
+  nanosleep(&delay, NULL);
+  llc_connection_set_status(connection, DLC_REJECTED);
+  return NULL;
+}
+
+void
+test_llc_connection_timedwait(void)
+{
+  struct llc_connection *connection;
+  struct llc_service *service;
+  struct timespec timeout;
+  pthread_t thread;
+
+  service = llc_service_new(NULL, void_thread, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  int sap = llc_link_service_bind(llc_link, service, 17);
+  cut_assert_equal_int(17, sap, cut_message("llc_link_service_bind"));
+
+  connection = llc_outgoing_data_link_connection_new(llc_link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+
+  /* Nobody answers */
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_nsec += 50000000;
+  if (timeout.tv_nsec >= 1000000000) {
+    timeout.tv_sec++;
+    timeout.tv_nsec -= 1000000000;
+  }
+  cut_assert_equal_int(-1, llc_connection_timedwait(connection, &timeout, NULL), cut_message("llc_connection_timedwait()"));
+  cut_assert_equal_int(ETIMEDOUT, errno, cut_message("Wrong error"));
+
+  /* The status change wakes the waiter up */
+  cut_assert_equal_int(0, pthread_create(&thread, NULL, reject_later, connection), cut_message("pthread_create()"));
+  timeout.tv_sec += 10;
+  cut_assert_equal_int(-1, llc_connection_timedwait(connection, &timeout, NULL), cut_message("llc_connection_timedwait()"));
+  cut_assert_equal_int(DLC_REJECTED, connection->status, cut_message("Wrong status"));
+  pthread_join(thread, NULL);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  cut_assert_operator_int(now.tv_sec, <, timeout.tv_sec - 5, cut_message("The waiter was not woken up"));
+
+  llc_link->transmission_handlers[17] = NULL;
+  llc_connection_free(connection);
+
+  llc_link_service_unbind(llc_link, 17);
+  llc_service_free(service);
+}
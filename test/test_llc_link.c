@@ -22,9 +22,19 @@
 #include "config.h"
 
 #include <cutter.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "llc_connection.h"
 #include "llc_link.h"
 #include "llc_service.h"
+#include "llcp_pool.h"
 
 void *
 void_service(void *arg)
@@ -45,6 +55,7 @@ cut_setup(void)
 void
 cut_teardown(void)
 {
+  llcp_set_allocator(NULL);
   llcp_fini();
 }
 
@@ -183,3 +194,1275 @@ test_llc_link_find_sap_by_uri(void)
   llc_service_free(service);
   llc_link_free(link);
 }
+
+void
+test_llc_link_service_index(void)
+{
+  struct llc_link *link;
+  struct llc_service *services[16];
+  char uri[BUFSIZ];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  cut_assert_equal_int(LLCP_SDP_SAP, llc_link_find_sap_by_uri(link, LLCP_SDP_URI), cut_message("SDP service not found"));
+
+  for (int i = 0; i < 16; i++) {
+    snprintf(uri, sizeof(uri), "urn:nfc:xsn:service-%d", i);
+    services[i] = llc_service_new_with_uri(NULL, void_service, uri, NULL);
+    res = llc_link_service_bind(link, services[i], SAP_AUTO);
+    cut_assert_equal_int(0x10 + i, res, cut_message("llc_link_service_bind()"));
+  }
+
+  struct llc_service *service = llc_service_new_with_uri(NULL, void_service, "urn:nfc:xsn:extra", NULL);
+  res = llc_link_service_bind(link, service, SAP_AUTO);
+  cut_assert_equal_int(-1, res, cut_message("No SAP should be left"));
+
+  for (int i = 0; i < 16; i++) {
+    snprintf(uri, sizeof(uri), "urn:nfc:xsn:service-%d", i);
+    cut_assert_equal_int(0x10 + i, llc_link_find_sap_by_uri(link, uri), cut_message("Wrong SAP"));
+  }
+
+  llc_link_service_unbind(link, 0x14);
+  cut_assert_equal_int(0, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:service-4"), cut_message("Unbound service found"));
+  cut_assert_equal_int(0x15, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:service-5"), cut_message("Wrong SAP"));
+
+  res = llc_link_service_bind(link, service, SAP_AUTO);
+  cut_assert_equal_int(0x14, res, cut_message("Freed SAP should be reused"));
+  cut_assert_equal_int(0x14, llc_link_find_sap_by_uri(link, "urn:nfc:xsn:extra"), cut_message("Wrong SAP"));
+
+  llc_service_free(services[4]);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_resolve_uris(void)
+{
+  struct llc_link *link;
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  const char *uris[] = { "urn:nfc:sn:snep", "urn:nfc:xsn:foo" };
+  res = llc_link_resolve_uris(link, uris, 2);
+  cut_assert_equal_int(2, res, cut_message("llc_link_resolve_uris()"));
+  cut_assert_equal_int(-1, llc_link_resolved_sap(link, "urn:nfc:sn:snep"), cut_message("Service should not be resolved yet"));
+
+  res = llc_link_resolve_uris(link, uris, 2);
+  cut_assert_equal_int(0, res, cut_message("Pending services should not be requested again"));
+
+  char buffer[LLCP_MAX_PDU_SIZE];
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  uint8_t expected_snl[] = {
+    0x06, 0x41,
+    0x08, 0x10, 0x00, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 's', 'n', ':', 's', 'n', 'e', 'p',
+    0x08, 0x10, 0x01, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 'x', 's', 'n', ':', 'f', 'o', 'o',
+  };
+  cut_assert_equal_memory(expected_snl, sizeof(expected_snl), buffer, res, cut_message("Invalid SNL PDU"));
+
+  uint8_t snl_reply[] = {
+    0x06, 0x41,
+    0x09, 0x02, 0x00, 0x04,
+    0x09, 0x02, 0x01, 0x00,
+  };
+  res = mq_send(link->llc_up, (char *) snl_reply, sizeof(snl_reply), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 1000) && (llc_link_resolved_sap(link, "urn:nfc:xsn:foo") < 0); i++)
+    nanosleep(&delay, NULL);
+
+  cut_assert_equal_int(4, llc_link_resolved_sap(link, "urn:nfc:sn:snep"), cut_message("Wrong SAP"));
+  cut_assert_equal_int(0, llc_link_resolved_sap(link, "urn:nfc:xsn:foo"), cut_message("Wrong SAP"));
+  cut_assert_equal_int(-1, llc_link_resolved_sap(link, "urn:nfc:xsn:bar"), cut_message("Unknown service resolved"));
+
+  llc_link_deactivate(link);
+  cut_assert_equal_int(-1, llc_link_resolved_sap(link, "urn:nfc:sn:snep"), cut_message("Cache should not outlive the link"));
+
+  llc_link_free(link);
+}
+
+void
+test_llc_link_resolve_many_uris(void)
+{
+  struct llc_link *link;
+  char uris[20][32];
+  const char *names[20];
+  char buffer[LLCP_MAX_PDU_SIZE];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  for (int i = 0; i < 20; i++) {
+    snprintf(uris[i], sizeof(uris[i]), "urn:nfc:xsn:service-%d", i);
+    names[i] = uris[i];
+  }
+
+  /* More requests than the 16 first TIDs are pending at once */
+  for (int i = 0; i < 20; i += 5) {
+    res = llc_link_resolve_uris(link, names + i, 5);
+    cut_assert_equal_int(5, res, cut_message("llc_link_resolve_uris()"));
+    res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+    cut_assert_equal_int(0x41, (uint8_t) buffer[1], cut_message("SNL PDU expected"));
+  }
+
+  uint8_t snl_reply[2 + 20 * 4] = { 0x06, 0x41 };
+  for (int i = 0; i < 20; i++) {
+    snl_reply[2 + 4 * i] = 0x09;
+    snl_reply[3 + 4 * i] = 0x02;
+    snl_reply[4 + 4 * i] = i;
+    snl_reply[5 + 4 * i] = 0x10 + i;
+  }
+  res = mq_send(link->llc_up, (char *) snl_reply, sizeof(snl_reply), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 1000) && (llc_link_resolved_sap(link, names[19]) < 0); i++)
+    nanosleep(&delay, NULL);
+
+  for (int i = 0; i < 20; i++)
+    cut_assert_equal_int(0x10 + i, llc_link_resolved_sap(link, names[i]), cut_message("Wrong SAP for '%s'", names[i]));
+
+  /* Resolved services are not requested again */
+  res = llc_link_resolve_uris(link, names, 20);
+  cut_assert_equal_int(0, res, cut_message("llc_link_resolve_uris()"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_snl_split(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  /* The local MIU takes more requests than the remote one takes answers */
+  res = llc_link_set_miu(link, 256);
+  cut_assert_equal_int(0, res, cut_message("llc_link_set_miu()"));
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+  cut_assert_equal_int(LLCP_DEFAULT_MIU, link->remote_miu, cut_message("Wrong remote MIU"));
+
+  uint8_t snl[2 + 40 * 4] = { 0x06, 0x41 };
+  for (int i = 0; i < 40; i++) {
+    snl[2 + 4 * i] = 0x08;
+    snl[3 + 4 * i] = 0x02;
+    snl[4 + 4 * i] = i;
+    snl[5 + 4 * i] = 'a';
+  }
+  res = mq_send(link->llc_up, (char *) snl, sizeof(snl), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  /* 32 SDRES fill the remote MIU, the 8 other ones follow */
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(2 + 32 * 4, res, cut_message("Wrong first SNL PDU length"));
+  cut_assert_equal_int(31, (uint8_t) buffer[2 + 31 * 4 + 2], cut_message("Wrong TID"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(2 + 8 * 4, res, cut_message("Wrong second SNL PDU length"));
+  cut_assert_equal_int(32, (uint8_t) buffer[2 + 2], cut_message("Wrong TID"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_pax(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR | LLC_PAX_PDU_PROHIBITED, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+  res = llc_link_renegotiate(link, 512, 0);
+  cut_assert_equal_int(-1, res, cut_message("PAX PDUs should be prohibited"));
+  llc_link_deactivate(link);
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  res = llc_link_renegotiate(link, LLCP_MAX_MIU + 1, 0);
+  cut_assert_equal_int(-1, res, cut_message("MIU should not exceed the LLCP maximum"));
+
+  res = llc_link_renegotiate(link, 512, 5);
+  cut_assert_equal_int(0, res, cut_message("llc_link_renegotiate()"));
+  cut_assert_equal_int(512, link->local_miu, cut_message("Wrong local MIU"));
+  cut_assert_equal_int(50000, link->local_lto.tv_usec, cut_message("Wrong local LTO"));
+
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  uint8_t expected_pax[] = {
+    0x00, 0x40,
+    0x01, 0x01, 0x11,
+    0x02, 0x02, 0x01, 0x80,
+    0x03, 0x02, 0x00, 0x03,
+    0x04, 0x01, 0x05,
+    0x07, 0x01, 0x03,
+  };
+  cut_assert_equal_memory(expected_pax, sizeof(expected_pax), buffer, res, cut_message("Invalid PAX PDU"));
+
+  /* Answer to our PAX PDU */
+  uint8_t pax_reply[] = { 0x00, 0x40, 0x02, 0x02, 0x00, 0x80 };
+  res = mq_send(link->llc_up, (char *) pax_reply, sizeof(pax_reply), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 1000) && (link->remote_miu == LLCP_DEFAULT_MIU); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(256, link->remote_miu, cut_message("Wrong remote MIU"));
+
+  /* PAX PDU initiated by the remote LLC */
+  uint8_t pax_request[] = { 0x00, 0x40, 0x04, 0x01, 0x20 };
+  res = mq_send(link->llc_up, (char *) pax_request, sizeof(pax_request), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_memory(expected_pax, sizeof(expected_pax), buffer, res, cut_message("Invalid PAX PDU answer"));
+  cut_assert_equal_int(320000, link->remote_lto.tv_usec, cut_message("Wrong remote LTO"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+/* The link up queue is non-blocking and only holds a few PDUs */
+static int
+send_pdu(struct llc_link *link, const uint8_t *pdu, size_t len)
+{
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  int res;
+
+  for (int i = 0; ((res = mq_send(link->llc_up, (char *) pdu, len, 0)) < 0) && (errno == EAGAIN) && (i < 1000); i++)
+    nanosleep(&delay, NULL);
+
+  return res;
+}
+
+void
+test_llc_link_adapt_parameters(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_set_adaptive_parameters(link, 1000, 2, 10);
+  cut_assert_equal_int(0, res, cut_message("llc_link_set_adaptive_parameters()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* UI PDUs filling the MIU to an unbound SAP */
+  uint8_t ui[2 + LLCP_DEFAULT_MIU] = { 0x80, 0xE0 };
+  for (int i = 0; i < LLC_LINK_BULK_THRESHOLD; i++) {
+    res = send_pdu(link, ui, sizeof(ui));
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_operator_int(res, >, 2, cut_message("mq_receive()"));
+  cut_assert_equal_int(0x40, (uint8_t) buffer[1], cut_message("PAX PDU expected"));
+  cut_assert_equal_int(1000, link->local_miu, cut_message("Wrong local MIU"));
+  cut_assert_equal_int(20000, link->local_lto.tv_usec, cut_message("Wrong local LTO"));
+
+  uint8_t symm[] = { 0x00, 0x00 };
+  for (int i = 0; i < LLC_LINK_IDLE_THRESHOLD; i++) {
+    res = send_pdu(link, symm, sizeof(symm));
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_operator_int(res, >, 2, cut_message("mq_receive()"));
+  cut_assert_equal_int(0x40, (uint8_t) buffer[1], cut_message("PAX PDU expected"));
+  cut_assert_equal_int(1000, link->local_miu, cut_message("MIU should not be lowered"));
+  cut_assert_equal_int(100000, link->local_lto.tv_usec, cut_message("Wrong local LTO"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_large_miu(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  uint8_t data[LLCP_MAX_MIU + 1];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_set_miu(link, LLCP_MAX_MIU + 1);
+  cut_assert_equal_int(-1, res, cut_message("MIU should not exceed the LLCP maximum"));
+  res = llc_link_set_miu(link, LLCP_MAX_MIU);
+  cut_assert_equal_int(0, res, cut_message("llc_link_set_miu()"));
+
+  uint8_t parameters[] = { 0x02, 0x02, 0x07, 0xFF };
+  res = llc_link_activate(link, LLC_INITIATOR, parameters, sizeof(parameters));
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+  cut_assert_equal_int(LLCP_MAX_MIU, link->local_miu, cut_message("Wrong local MIU"));
+  cut_assert_equal_int(LLCP_MAX_MIU, link->remote_miu, cut_message("Wrong remote MIU"));
+
+  uint8_t encoded[BUFSIZ];
+  res = llc_link_encode_parameters(link, encoded, sizeof(encoded));
+  cut_assert_operator_int(res, >, 7, cut_message("llc_link_encode_parameters()"));
+  cut_assert_equal_memory(parameters, sizeof(parameters), encoded + 3, 4, cut_message("Wrong MIUX parameter"));
+
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = i;
+
+  res = llc_link_send_data(link, 0x20, 0x20, data, LLCP_MAX_MIU);
+  cut_assert_equal_int(0, res, cut_message("llc_link_send_data()"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(2 + LLCP_MAX_MIU, res, cut_message("Wrong UI PDU size"));
+  cut_assert_equal_memory(data, LLCP_MAX_MIU, buffer + 2, res - 2, cut_message("Wrong UI PDU information"));
+
+  res = llc_link_send_data(link, 0x20, 0x20, data, LLCP_MAX_MIU + 1);
+  cut_assert_equal_int(-1, res, cut_message("PDU larger than the remote MIU should be rejected"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_send_miu(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  uint8_t data[LLCP_MAX_MIU] = { 0 };
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  /* The remote LLC takes the largest MIU */
+  uint8_t parameters[] = { 0x02, 0x02, 0x07, 0xFF };
+  res = llc_link_activate(link, LLC_INITIATOR, parameters, sizeof(parameters));
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+  cut_assert_equal_int(LLCP_MAX_MIU, link->remote_miu, cut_message("Wrong remote MIU"));
+
+#if defined(LLCP_STATIC_ALLOCATION)
+  const size_t miu = LLCP_STATIC_MIU;
+#else
+  const size_t miu = LLCP_MAX_MIU;
+#endif
+  res = llc_link_send_data(link, 0x20, 0x20, data, miu);
+  cut_assert_equal_int(0, res, cut_message("llc_link_send_data()"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(2 + miu, res, cut_message("Wrong UI PDU size"));
+
+  if (miu < LLCP_MAX_MIU) {
+    /* Pooled PDUs cannot hold more, whatever the remote MIU */
+    res = llc_link_send_data(link, 0x20, 0x20, data, miu + 1);
+    cut_assert_equal_int(-1, res, cut_message("Data larger than the static MIU should be rejected"));
+  }
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_recycle(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct mq_attr attr;
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_recycle(link);
+  cut_assert_equal_int(-1, res, cut_message("A link that never ran cannot be recycled"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  pthread_t thread = link->thread;
+  mqd_t llc_up = link->llc_up;
+
+  /* Leave a PDU behind */
+  uint8_t data[] = { 'h', 'e', 'l', 'l', 'o' };
+  res = llc_link_send_data(link, 0x20, 0x20, data, sizeof(data));
+  cut_assert_equal_int(0, res, cut_message("llc_link_send_data()"));
+
+  res = llc_link_recycle(link);
+  cut_assert_equal_int(0, res, cut_message("llc_link_recycle()"));
+  cut_assert_equal_int(LL_DEACTIVATED, link->status, cut_message("Wrong link status"));
+  mq_getattr(link->llc_down, &attr);
+  cut_assert_equal_int(0, attr.mq_curmsgs, cut_message("Stale PDUs should be discarded"));
+
+  uint8_t parameters[] = { 0x04, 0x01, 0x0A };
+  res = llc_link_activate(link, LLC_TARGET, parameters, sizeof(parameters));
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+  cut_assert_true(pthread_equal(thread, link->thread), cut_message("The link thread should be kept"));
+  cut_assert_equal_int(llc_up, link->llc_up, cut_message("The link queues should be kept"));
+  cut_assert_equal_int(LLC_TARGET, link->role, cut_message("Wrong role"));
+  cut_assert_equal_int(100000, link->remote_lto.tv_usec, cut_message("Wrong remote LTO"));
+
+  /* The remote LLC disconnects, the link thread survives */
+  uint8_t disc[] = { 0x01, 0x40 };
+  res = mq_send(link->llc_up, (char *) disc, sizeof(disc), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 1000) && (link->status != LL_DEACTIVATED); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(LL_DEACTIVATED, link->status, cut_message("Link should be disconnected"));
+
+  res = llc_link_recycle(link);
+  cut_assert_equal_int(0, res, cut_message("llc_link_recycle()"));
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  uint8_t pax_request[] = { 0x00, 0x40, 0x04, 0x01, 0x20 };
+  res = mq_send(link->llc_up, (char *) pax_request, sizeof(pax_request), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_operator_int(res, >, 2, cut_message("mq_receive()"));
+  cut_assert_equal_int(0x40, (uint8_t) buffer[1], cut_message("PAX PDU expected"));
+
+  llc_link_deactivate(link);
+  res = llc_link_recycle(link);
+  cut_assert_equal_int(-1, res, cut_message("A deactivated link cannot be recycled"));
+
+  llc_link_free(link);
+}
+
+void
+test_llc_link_agf(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* More PDUs than the link up queue can hold */
+  uint8_t agf[] = {
+    0x00, 0x80,
+    0x00, 0x06, 0x00, 0x40, 0x02, 0x02, 0x00, 0x80,
+    0x00, 0x05, 0x00, 0x40, 0x04, 0x01, 0x20,
+    0x00, 0x06, 0x00, 0x40, 0x03, 0x02, 0x00, 0x13,
+    0x00, 0x06, 0x00, 0x40, 0x02, 0x02, 0x01, 0x00,
+  };
+  res = mq_send(link->llc_up, (char *) agf, sizeof(agf), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  for (int i = 0; i < 4; i++) {
+    res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+    cut_assert_operator_int(res, >, 2, cut_message("mq_receive()"));
+    cut_assert_equal_int(0x40, (uint8_t) buffer[1], cut_message("PAX PDU expected"));
+  }
+  cut_assert_equal_int(384, link->remote_miu, cut_message("Wrong remote MIU"));
+  cut_assert_equal_int(320000, link->remote_lto.tv_usec, cut_message("Wrong remote LTO"));
+  cut_assert_equal_int(0x13, link->remote_wks, cut_message("Wrong remote WKS"));
+
+  /* A truncated encapsulated PDU is dropped with the rest of the frame */
+  uint8_t truncated_agf[] = {
+    0x00, 0x80,
+    0x00, 0x05, 0x00, 0x40, 0x04, 0x01, 0x0A,
+    0x00, 0x09, 0x00, 0x40,
+  };
+  res = mq_send(link->llc_up, (char *) truncated_agf, sizeof(truncated_agf), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(0x40, (uint8_t) buffer[1], cut_message("PAX PDU expected"));
+  cut_assert_equal_int(100000, link->remote_lto.tv_usec, cut_message("Wrong remote LTO"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+static void *
+send_three(void *arg)
+{
+  struct llc_connection *connection = arg;
+  uint8_t data[] = { 'a', 'b', 'c' };
+  intptr_t failures = 0;
+
+  for (int i = 0; i < 3; i++) {
+    if (llc_connection_send(connection, data + i, 1) < 0)
+      failures++;
+  }
+
+  return (void *) failures;
+}
+
+void
+test_llc_link_remote_busy(void)
+{
+  struct llc_link *link;
+  struct llc_service *service;
+  struct llc_connection *connection;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec timeout;
+  pthread_t sender;
+  void *failures;
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  service = llc_service_new(NULL, void_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  res = llc_link_service_bind(link, service, 17);
+  cut_assert_equal_int(17, res, cut_message("llc_link_service_bind()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  connection = llc_outgoing_data_link_connection_new(link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+  connection->rwr = 4;
+  connection->status = DLC_CONNECTED;
+
+  /* The remote LLC is busy */
+  uint8_t rnr[] = { 0x47, 0xA0, 0x00 };
+  res = send_pdu(link, rnr, sizeof(rnr));
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  /* More I PDUs than the connection down queue holds */
+  res = pthread_create(&sender, NULL, send_three, connection);
+  cut_assert_equal_int(0, res, cut_message("pthread_create()"));
+
+  uint8_t symm[] = { 0x00, 0x00 };
+  for (int i = 0; i < 3; i++) {
+    res = send_pdu(link, symm, sizeof(symm));
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_nsec += 100000000;
+  if (timeout.tv_nsec >= 1000000000) {
+    timeout.tv_sec++;
+    timeout.tv_nsec -= 1000000000;
+  }
+  res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  cut_assert_equal_int(-1, res, cut_message("No I PDU should be sent to a busy LLC"));
+  cut_assert_equal_int(1, connection->remote_busy, cut_message("The remote LLC should be busy"));
+
+  /* RR resumes the transmission right away, in order */
+  uint8_t rr[] = { 0x47, 0x60, 0x00 };
+  res = send_pdu(link, rr, sizeof(rr));
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  for (int i = 0; i < 3; i++) {
+    /* The sender may not have refilled the queue yet */
+    for (int j = 0; j < 100; j++) {
+      if (i || j) {
+        res = send_pdu(link, symm, sizeof(symm));
+        cut_assert_equal_int(0, res, cut_message("mq_send()"));
+      }
+      clock_gettime(CLOCK_REALTIME, &timeout);
+      timeout.tv_sec++;
+      if ((res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout)) >= 0)
+        break;
+    }
+    cut_assert_equal_int(4, res, cut_message("Wrong I PDU size"));
+    cut_assert_equal_int(0x83, (uint8_t) buffer[0], cut_message("Wrong DSAP"));
+    cut_assert_equal_int(0x11, (uint8_t) buffer[1], cut_message("Wrong PTYPE/SSAP"));
+    cut_assert_equal_int(i << 4, (uint8_t) buffer[2], cut_message("Wrong sequence"));
+    cut_assert_equal_int('a' + i, buffer[3], cut_message("Wrong information"));
+  }
+
+  pthread_join(sender, &failures);
+  cut_assert_equal_int(0, (intptr_t) failures, cut_message("Sending to a busy LLC should block, not fail"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_local_busy(void)
+{
+  struct llc_link *link;
+  struct llc_service *service;
+  struct llc_connection *connection;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  uint8_t data[16];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  service = llc_service_new(NULL, void_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  llc_service_set_rw(service, 2);
+  res = llc_link_service_bind(link, service, 17);
+  cut_assert_equal_int(17, res, cut_message("llc_link_service_bind()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  connection = llc_outgoing_data_link_connection_new(link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+  cut_assert_equal_int(2, connection->rwl, cut_message("Wrong receive window"));
+  cut_assert_equal_int(3, connection->high_watermark, cut_message("Wrong high watermark"));
+  cut_assert_equal_int(1, connection->low_watermark, cut_message("Wrong low watermark"));
+  connection->status = DLC_CONNECTED;
+
+  /* The service does not consume the I PDUs right away */
+  uint8_t i_pdu[] = { 0x47, 0x20, 0x00, 'x' };
+  struct mq_attr attr;
+  for (int i = 0; i < 2; i++) {
+    i_pdu[2] = i << 4;
+    res = send_pdu(link, i_pdu, sizeof(i_pdu));
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+    while ((mq_getattr(connection->llc_up, &attr) == 0) && (attr.mq_curmsgs < i + 1))
+      sched_yield();
+    cut_assert_equal_int(0, connection->local_busy, cut_message("The connection should not be busy below the high watermark"));
+  }
+  mq_getattr(link->llc_down, &attr);
+  cut_assert_equal_int(0, attr.mq_curmsgs, cut_message("No RNR PDU expected"));
+
+  /* The third one reaches the high watermark */
+  i_pdu[2] = 0x20;
+  uint8_t expected_rnr[] = { 0x83, 0x91, 0x03 };
+  res = send_pdu(link, i_pdu, sizeof(i_pdu));
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_memory(expected_rnr, sizeof(expected_rnr), buffer, res, cut_message("RNR PDU expected"));
+  cut_assert_equal_int(1, connection->local_busy, cut_message("The connection should be busy"));
+  cut_assert_equal_int(1, connection->busy.count, cut_message("Wrong busy count"));
+
+  for (int i = 0; i < 2; i++) {
+    res = llc_connection_recv(connection, data, sizeof(data), NULL);
+    cut_assert_equal_int(1, res, cut_message("llc_connection_recv()"));
+  }
+
+  uint8_t symm[] = { 0x00, 0x00 };
+  res = send_pdu(link, symm, sizeof(symm));
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  uint8_t expected_rr[] = { 0x83, 0x51, 0x03 };
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_memory(expected_rr, sizeof(expected_rr), buffer, res, cut_message("RR PDU expected"));
+  cut_assert_equal_int(0, connection->local_busy, cut_message("The connection should not be busy anymore"));
+  cut_assert_operator_int(0, <, connection->busy.time, cut_message("Busy time should be accounted"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+static volatile int bulk_sending;
+
+static void *
+send_bulk(void *arg)
+{
+  struct llc_connection *connection = arg;
+  uint8_t data[LLCP_DEFAULT_MIU] = { 0 };
+
+  while (bulk_sending && llc_connection_send(connection, data, sizeof(data)) == 0)
+    ;
+  bulk_sending = -1;
+
+  return NULL;
+}
+
+/*
+ * Run the link until it sends an I PDU of the interactive connection,
+ * acknowledging every bulk I PDU.  Returns the number of bulk I PDUs sent
+ * in the meantime, -1 on timeout.
+ */
+static int
+bulk_pdus_before(struct llc_link *link, uint8_t interactive_sap, int max)
+{
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec timeout;
+  int bulk = 0;
+
+  for (int i = 0; i < max; i++) {
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec++;
+    int res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+    if (res < 0) {
+      /* The bulk sender has not refilled its queue yet */
+      uint8_t symm[] = { 0x00, 0x00 };
+      send_pdu(link, symm, sizeof(symm));
+      continue;
+    }
+    if ((buffer[1] & 0x3F) == interactive_sap)
+      return bulk;
+
+    bulk++;
+    uint8_t rr[] = { 0x43, 0x60, ((uint8_t) buffer[2] >> 4) + 1 };
+    rr[2] &= 0x0F;
+    send_pdu(link, rr, sizeof(rr));
+  }
+
+  return -1;
+}
+
+void
+test_llc_link_fair_scheduling(void)
+{
+  struct llc_link *link;
+  struct llc_service *bulk_service, *interactive_service;
+  struct llc_connection *bulk, *interactive;
+  pthread_t sender;
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  bulk_service = llc_service_new(NULL, void_service, NULL);
+  cut_assert_not_null(bulk_service, cut_message("llc_service_new()"));
+  llc_service_set_weight(bulk_service, 2);
+  res = llc_link_service_bind(link, bulk_service, 16);
+  cut_assert_equal_int(16, res, cut_message("llc_link_service_bind()"));
+  interactive_service = llc_service_new(NULL, void_service, NULL);
+  cut_assert_not_null(interactive_service, cut_message("llc_service_new()"));
+  res = llc_link_service_bind(link, interactive_service, 17);
+  cut_assert_equal_int(17, res, cut_message("llc_link_service_bind()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* The bulk connection has a lower SAP, it used to be served first */
+  bulk = llc_outgoing_data_link_connection_new(link, 16, 32);
+  cut_assert_not_null(bulk, cut_message("llc_outgoing_data_link_connection_new()"));
+  bulk->rwr = LLCP_MAX_RW;
+  bulk->status = DLC_CONNECTED;
+  interactive = llc_outgoing_data_link_connection_new(link, 17, 33);
+  cut_assert_not_null(interactive, cut_message("llc_outgoing_data_link_connection_new()"));
+  interactive->status = DLC_CONNECTED;
+
+  bulk_sending = 1;
+  res = pthread_create(&sender, NULL, send_bulk, bulk);
+  cut_assert_equal_int(0, res, cut_message("pthread_create()"));
+
+  /* Let the bulk transfer settle */
+  uint8_t symm[] = { 0x00, 0x00 };
+  send_pdu(link, symm, sizeof(symm));
+  res = bulk_pdus_before(link, 17, 8);
+  cut_assert_equal_int(-1, res, cut_message("No interactive PDU yet"));
+
+  /* The interactive PDU waits for at most one bulk turn */
+  for (int i = 0; i < 4; i++) {
+    uint8_t ping[] = { 'p' };
+    res = llc_connection_send(interactive, ping, sizeof(ping));
+    cut_assert_equal_int(0, res, cut_message("llc_connection_send()"));
+    res = bulk_pdus_before(link, 17, 64);
+    cut_assert_operator_int(res, >=, 0, cut_message("The interactive PDU was not sent"));
+    cut_assert_operator_int(res, <=, 2, cut_message("The interactive PDU waited for %d bulk PDUs", res));
+
+    /* The interactive PDU needs acknowledging too */
+    uint8_t rr[] = { 0x47, 0x61, i + 1 };
+    send_pdu(link, rr, sizeof(rr));
+  }
+
+  /* Drain the bulk queue until the sender notices it has to stop */
+  bulk_sending = 0;
+  while (bulk_sending == 0) {
+    char buffer[LLCP_MAX_PDU_SIZE];
+    if (mq_receive(bulk->llc_down, buffer, sizeof(buffer), NULL) < 0)
+      sched_yield();
+  }
+  pthread_join(sender, NULL);
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+static int accept_calls;
+
+static int
+accept_even(struct llc_connection *connection)
+{
+  accept_calls++;
+  return (connection->remote_sap % 2) ? -1 : 0;
+}
+
+void
+test_llc_link_accept_callback(void)
+{
+  struct llc_link *link;
+  struct llc_service *service;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec timeout;
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  service = llc_service_new(NULL, void_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  llc_service_set_accept_callback(service, accept_even);
+  res = llc_link_service_bind(link, service, 17);
+  cut_assert_equal_int(17, res, cut_message("llc_link_service_bind()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* CONNECT from SAP 32: the CC answers it in the same exchange */
+  accept_calls = 0;
+  uint8_t connect[] = { 0x45, 0x20 };
+  res = send_pdu(link, connect, sizeof(connect));
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec++;
+  res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  cut_assert_operator_int(res, >=, 2, cut_message("mq_timedreceive()"));
+  uint8_t cc[] = { 0x81, 0x91 };
+  cut_assert_equal_memory(cc, sizeof(cc), buffer, 2, cut_message("Expected CC"));
+  cut_assert_equal_int(1, accept_calls, cut_message("The accept callback should be called once"));
+  cut_assert_equal_int(DLC_CONNECTED, link->transmission_handlers[17]->status, cut_message("Wrong status"));
+
+  /* CONNECT from SAP 33: the DM answers it in the same exchange */
+  connect[1] = 0x21;
+  res = send_pdu(link, connect, sizeof(connect));
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec++;
+  res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  uint8_t dm[] = { 0x85, 0xD2, 0x03 };
+  cut_assert_equal_memory(dm, sizeof(dm), buffer, res, cut_message("Expected DM"));
+  cut_assert_equal_int(2, accept_calls, cut_message("The accept callback should be called once"));
+  cut_assert_null(link->transmission_handlers[18], cut_message("The rejected connection should be collected"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+static volatile int datagrams;
+static volatile int datagram_sources[MAX_LLC_LINK_SERVICE + 1];
+
+static void *
+datagram_service(void *arg)
+{
+  struct llc_connection *connection = arg;
+  uint8_t data[LLCP_DEFAULT_MIU];
+  uint8_t ssap;
+
+  while (llc_connection_recv(connection, data, sizeof(data), &ssap) >= 0) {
+    datagram_sources[ssap]++;
+    datagrams++;
+  }
+
+  return NULL;
+}
+
+void
+test_llc_link_datagram_endpoint(void)
+{
+  struct llc_link *link;
+  struct llc_service *service;
+  struct llc_connection *endpoint = NULL;
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  service = llc_service_new(NULL, datagram_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  res = llc_link_service_bind(link, service, 16);
+  cut_assert_equal_int(16, res, cut_message("llc_link_service_bind()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* Many more datagrams and remote SAPs than there used to be Logical Data Links */
+  datagrams = 0;
+  for (int i = 0; i < 64; i++) {
+    uint8_t ui[] = { 0x40, 0xC0 | (32 + i % 16), 'h', 'e', 'l', 'l', 'o' };
+    res = send_pdu(link, ui, sizeof(ui));
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+    struct timespec delay = { 0, 1000000 };
+    for (int j = 0; (datagrams <= i) && (j < 1000); j++)
+      nanosleep(&delay, NULL);
+    cut_assert_equal_int(i + 1, datagrams, cut_message("Datagram %d not received", i));
+
+    if (!endpoint)
+      endpoint = link->datagram_handlers[16];
+    cut_assert_true(endpoint && (link->datagram_handlers[16] == endpoint), cut_message("The Logical Data Link should persist"));
+  }
+  for (int sap = 32; sap < 48; sap++)
+    cut_assert_equal_int(4, datagram_sources[sap], cut_message("Wrong datagram count from SAP %d", sap));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+static void *
+oneshot_datagram_service(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[1024];
+  uint8_t ssap;
+
+  if (llc_connection_recv(connection, buffer, sizeof(buffer), &ssap) > 0)
+    datagrams++;
+
+  return NULL;
+}
+
+void
+test_llc_link_oneshot_datagram_service(void)
+{
+  struct llc_link *link;
+  struct llc_service *service;
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  service = llc_service_new(NULL, oneshot_datagram_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  res = llc_link_service_bind(link, service, 16);
+  cut_assert_equal_int(16, res, cut_message("llc_link_service_bind()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* The service returns after each datagram: it must be run again */
+  datagrams = 0;
+  for (int i = 0; i < 8; i++) {
+    uint8_t ui[] = { 0x40, 0xC0 | 32, 'h', 'e', 'l', 'l', 'o' };
+    res = send_pdu(link, ui, sizeof(ui));
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+    struct timespec delay = { 0, 1000000 };
+    for (int j = 0; (datagrams <= i) && (j < 1000); j++)
+      nanosleep(&delay, NULL);
+    cut_assert_equal_int(i + 1, datagrams, cut_message("Datagram %d not received", i));
+  }
+
+  /* Datagrams queued while the service is returning are not lost */
+  for (int i = 0; i < 2; i++) {
+    uint8_t ui[] = { 0x40, 0xC0 | 33, 'h', 'e', 'l', 'l', 'o' };
+    res = send_pdu(link, ui, sizeof(ui));
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+  /* The link notices the returned service on its next turn: keep it busy */
+  struct timespec delay = { 0, 1000000 };
+  for (int j = 0; (datagrams < 10) && (j < 1000); j++) {
+    uint8_t symm[] = { 0x00, 0x00 };
+    char reply[LLCP_MAX_PDU_SIZE];
+    struct timespec now = { 0, 0 };
+    send_pdu(link, symm, sizeof(symm));
+    while (mq_timedreceive(link->llc_down, reply, sizeof(reply), NULL, &now) > 0)
+      ;
+    nanosleep(&delay, NULL);
+  }
+  cut_assert_equal_int(10, datagrams, cut_message("Queued datagrams not received"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_send_datagrams(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  uint8_t small[20], large[100];
+  struct timespec timeout;
+  int res;
+
+  memset(small, 's', sizeof(small));
+  memset(large, 'l', sizeof(large));
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  struct llc_datagram datagrams[6];
+  for (int i = 0; i < 5; i++) {
+    datagrams[i].local_sap = 32;
+    datagrams[i].remote_sap = 16 + i;
+    datagrams[i].data.iov_base = small;
+    datagrams[i].data.iov_len = sizeof(small);
+  }
+  datagrams[5].local_sap = 32;
+  datagrams[5].remote_sap = 16;
+  datagrams[5].data.iov_base = large;
+  datagrams[5].data.iov_len = LLCP_DEFAULT_MIU + 1;
+
+  res = llc_link_send_datagrams(link, datagrams, 6);
+  cut_assert_equal_int(-1, res, cut_message("Datagrams larger than the remote MIU should be refused"));
+
+  datagrams[5].data.iov_len = sizeof(large);
+  res = llc_link_send_datagrams(link, datagrams, 6);
+  cut_assert_equal_int(6, res, cut_message("llc_link_send_datagrams()"));
+
+  /* The 5 small datagrams fit in the remote MIU: they go in one AGF PDU */
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec++;
+  res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  cut_assert_equal_int(2 + 5 * (4 + sizeof(small)), res, cut_message("Wrong AGF PDU length"));
+  struct pdu *agf = pdu_unpack((uint8_t *) buffer, res);
+  cut_assert_not_null(agf, cut_message("pdu_unpack()"));
+  cut_assert_equal_int(PDU_AGF, agf->ptype, cut_message("Expected AGF PDU"));
+  struct pdu **pdus = pdu_dispatch(agf);
+  cut_assert_not_null(pdus, cut_message("pdu_dispatch()"));
+  int n = 0;
+  for (struct pdu **pdu = pdus; *pdu; pdu++, n++) {
+    cut_assert_equal_int(PDU_UI, (*pdu)->ptype, cut_message("Expected UI PDU"));
+    cut_assert_equal_int(16 + n, (*pdu)->dsap, cut_message("Wrong DSAP"));
+    cut_assert_equal_int(32, (*pdu)->ssap, cut_message("Wrong SSAP"));
+    cut_assert_equal_memory(small, sizeof(small), (*pdu)->information, (*pdu)->information_size, cut_message("Wrong information"));
+    pdu_free(*pdu);
+  }
+  llcp_free(pdus);
+  pdu_free(agf);
+  cut_assert_equal_int(5, n, cut_message("Wrong number of aggregated PDUs"));
+
+  /* The large one goes alone */
+  res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  uint8_t ui[] = { 0x40, 0xE0 };
+  cut_assert_equal_int(2 + sizeof(large), res, cut_message("Wrong UI PDU length"));
+  cut_assert_equal_memory(ui, sizeof(ui), buffer, 2, cut_message("Expected UI PDU"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+static size_t allocations;
+static pthread_mutex_t allocations_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+counting_allocate(void *context, size_t size)
+{
+  (void) context;
+  pthread_mutex_lock(&allocations_lock);
+  allocations++;
+  pthread_mutex_unlock(&allocations_lock);
+  return malloc(size);
+}
+
+static void
+counting_release(void *context, void *ptr)
+{
+  (void) context;
+  free(ptr);
+}
+
+/*
+ * Heap allocations made by the link thread for each received PDU.  The static
+ * profile takes PDUs from a pool; the dynamic one still allocates the PDU
+ * structure and its information field when unpacking a received PDU.
+ */
+#if defined(LLCP_STATIC_ALLOCATION)
+#  define ALLOCATIONS_PER_PDU 0
+#else
+#  define ALLOCATIONS_PER_PDU 2
+#endif
+
+void
+test_llc_link_allocations_per_pdu(void)
+{
+  struct llc_link *link;
+  struct mq_attr attr;
+  int res;
+
+  struct llcp_allocator allocator = {
+    .allocate = counting_allocate,
+    .release = counting_release,
+    .context = NULL,
+  };
+  llcp_set_allocator(&allocator);
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* UI PDU to an unbound SAP: processed without any answer */
+  uint8_t ui[] = { 0x80, 0xE0, 'h', 'e', 'l', 'l', 'o' };
+  const int count = 100;
+
+  pthread_mutex_lock(&allocations_lock);
+  allocations = 0;
+  pthread_mutex_unlock(&allocations_lock);
+
+  for (int i = 0; i < count; i++) {
+    /* The queue is short: let the link thread run when it is full */
+    while (((res = mq_send(link->llc_up, (char *) ui, sizeof(ui), 0)) < 0) && (errno == EAGAIN))
+      sched_yield();
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+  while ((mq_getattr(link->llc_up, &attr) == 0) && attr.mq_curmsgs)
+    sched_yield();
+
+  pthread_mutex_lock(&allocations_lock);
+  size_t total = allocations;
+  pthread_mutex_unlock(&allocations_lock);
+  cut_assert_true(total <= (size_t) count * ALLOCATIONS_PER_PDU,
+                  cut_message("%zu allocations for %d PDUs (budget: %d per PDU)", total, count, ALLOCATIONS_PER_PDU));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+/* Fails PDU allocations */
+static void *
+pdu_failing_allocate(void *context, size_t size)
+{
+  (void) context;
+  return (size == sizeof(struct pdu)) ? NULL : malloc(size);
+}
+
+void
+test_llc_link_resolve_uris_failures(void)
+{
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  char name[256];
+  const char *names[64];
+  char uris[64][32];
+  int res;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  /* The remote LLC takes the largest MIU */
+  uint8_t parameters[] = { 0x02, 0x02, 0x07, 0xFF };
+  res = llc_link_activate(link, LLC_INITIATOR, parameters, sizeof(parameters));
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+  /* The length of a SDREQ TLV is a single byte */
+  memset(name, 'a', 255);
+  name[255] = '\0';
+  names[0] = name;
+  res = llc_link_resolve_uris(link, names, 1);
+  cut_assert_equal_int(-1, res, cut_message("Service name longer than 254 bytes accepted"));
+  name[254] = '\0';
+  res = llc_link_resolve_uris(link, names, 1);
+  cut_assert_equal_int(1, res, cut_message("llc_link_resolve_uris()"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(2 + 3 + 254, res, cut_message("Wrong SNL PDU length"));
+  cut_assert_equal_int(255, (uint8_t) buffer[3], cut_message("Wrong SDREQ length"));
+
+  /* Requests that could not be sent are not left pending */
+  struct llcp_allocator allocator = {
+    .allocate = pdu_failing_allocate,
+    .release = counting_release,
+    .context = NULL,
+  };
+  names[0] = "urn:nfc:sn:snep";
+  llcp_set_allocator(&allocator);
+  res = llc_link_resolve_uris(link, names, 1);
+  llcp_set_allocator(NULL);
+  cut_assert_equal_int(-1, res, cut_message("SNL PDU cannot be sent"));
+  res = llc_link_resolve_uris(link, names, 1);
+  cut_assert_equal_int(1, res, cut_message("Service should be requested again"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(0x41, (uint8_t) buffer[1], cut_message("SNL PDU expected"));
+
+  /* The cache fills up: the requests sent so far are reported */
+  for (int i = 0; i < 64; i++) {
+    snprintf(uris[i], sizeof(uris[i]), "urn:nfc:xsn:s-%02d", i);
+    names[i] = uris[i];
+  }
+  res = llc_link_resolve_uris(link, names, 64);
+  cut_assert_equal_int(LLC_LINK_SDP_CACHE_SIZE - 2, res, cut_message("llc_link_resolve_uris()"));
+  res = mq_receive(link->llc_down, buffer, sizeof(buffer), NULL);
+  cut_assert_equal_int(2 + (LLC_LINK_SDP_CACHE_SIZE - 2) * (3 + 16), res, cut_message("Wrong SNL PDU length"));
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+}
+
+void
+test_llc_link_thread_attributes(void)
+{
+  struct llc_link *link;
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+
+  /* Pin the thread to a CPU the test is allowed to run on */
+  int cpu = 0;
+#if defined(HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP) && HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    while ((cpu < 63) && !CPU_ISSET(cpu, &allowed))
+      cpu++;
+  }
+#endif
+
+  struct llcp_thread_attributes attributes = {
+    .stack_size = 64 * 1024,
+    .cpus = (uint64_t) 1 << cpu,
+    .priority = 0,
+  };
+  int res = llc_link_set_thread_attributes(link, &attributes);
+  cut_assert_equal_int(0, res, cut_message("llc_link_set_thread_attributes()"));
+
+  attributes.priority = 1000;
+  res = llc_link_set_thread_attributes(link, &attributes);
+  cut_assert_equal_int(-1, res, cut_message("Invalid SCHED_FIFO priority accepted"));
+
+  res = llc_link_activate(link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llc_link_activate()"));
+
+#if defined(HAVE_DECL_PTHREAD_SETNAME_NP) && HAVE_DECL_PTHREAD_SETNAME_NP
+  char name[16];
+  res = pthread_getname_np(link->thread, name, sizeof(name));
+  cut_assert_equal_int(0, res, cut_message("pthread_getname_np()"));
+  cut_assert_equal_string("LLC Link", name, cut_message("Wrong thread name"));
+#endif
+#if defined(HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP) && HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP
+  cpu_set_t cpus;
+  res = pthread_getaffinity_np(link->thread, sizeof(cpus), &cpus);
+  cut_assert_equal_int(0, res, cut_message("pthread_getaffinity_np()"));
+  cut_assert_equal_int(1, CPU_COUNT(&cpus), cut_message("Wrong CPU affinity"));
+  cut_assert_true(CPU_ISSET(cpu, &cpus), cut_message("Wrong CPU affinity"));
+#endif
+
+  llc_link_deactivate(link);
+  llc_link_free(link);
+
+  /* Attributes the system rejects are dropped rather than failing */
+  pthread_t thread;
+  struct llcp_thread_attributes invalid = {
+    .stack_size = PTHREAD_STACK_MIN + 1,
+    .cpus = 0,
+    .priority = 0,
+  };
+#if defined(HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP) && HAVE_DECL_PTHREAD_ATTR_SETAFFINITY_NP
+  if (!CPU_ISSET(63, &allowed))
+    invalid.cpus = (uint64_t) 1 << 63;
+#endif
+  res = llcp_thread_create(&thread, &invalid, 0, "Invalid", void_service, NULL);
+  cut_assert_equal_int(0, res, cut_message("llcp_thread_create()"));
+  pthread_join(thread, NULL);
+}
@@ -0,0 +1,122 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+#include "config.h"
+
+#include <cutter.h>
+
+#include "llc_link.h"
+#include "llc_service.h"
+#include "llc_service_sdp.h"
+#include "llcp_pdu.h"
+
+struct llc_link *llc_link;
+
+void *
+void_thread(void *arg)
+{
+  (void) arg;
+  return NULL;
+}
+
+void
+cut_setup(void)
+{
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+
+  llc_link = llc_link_new();
+  cut_assert_not_null(llc_link, cut_message("llc_link_new()"));
+
+  struct llc_service *service = llc_service_new_with_uri(NULL, void_thread, "urn:nfc:xsn:foo", NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new_with_uri()"));
+  cut_assert_equal_int(17, llc_link_service_bind(llc_link, service, 17), cut_message("llc_link_service_bind()"));
+}
+
+void
+cut_teardown(void)
+{
+  llc_link_free(llc_link);
+  llcp_fini();
+}
+
+void
+test_llc_service_sdp_snl(void)
+{
+  uint8_t snl_pdu[] = {
+    0x06, 0x41,
+    0x08, 0x10, 0x01, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 'x', 's', 'n', ':', 'f', 'o', 'o',
+    0x08, 0x10, 0x02, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 'x', 's', 'n', ':', 'b', 'a', 'r',
+    0x08, 0x0f, 0x03, 'u', 'r', 'n', ':', 'n', 'f', 'c', ':', 's', 'n', ':', 's', 'd', 'p',
+  };
+
+  struct pdu *pdu = pdu_unpack(snl_pdu, sizeof(snl_pdu));
+  cut_assert_not_null(pdu, cut_message("pdu_unpack()"));
+
+  uint8_t buffer[BUFSIZ];
+  size_t offset = 0;
+  int res = llc_service_sdp_snl(llc_link, pdu, &offset, buffer, sizeof(buffer));
+
+  uint8_t expected[] = {
+    0x06, 0x41,
+    0x09, 0x02, 0x01, 17,
+    0x09, 0x02, 0x02, 0,
+    0x09, 0x02, 0x03, 1,
+  };
+  cut_assert_equal_memory(expected, sizeof(expected), buffer, res, cut_message("Invalid SNL reply"));
+  cut_assert_equal_int(pdu->information_size, offset, cut_message("All requests should be answered"));
+
+  /* Answers that do not fit go in another SNL PDU */
+  offset = 0;
+  res = llc_service_sdp_snl(llc_link, pdu, &offset, buffer, 10);
+  cut_assert_equal_memory(expected, 10, buffer, res, cut_message("Invalid first SNL reply"));
+  cut_assert_equal_int(36, offset, cut_message("Third request should be pending"));
+  res = llc_service_sdp_snl(llc_link, pdu, &offset, buffer, 10);
+  uint8_t remaining[] = { 0x06, 0x41, 0x09, 0x02, 0x03, 1 };
+  cut_assert_equal_memory(remaining, sizeof(remaining), buffer, res, cut_message("Invalid second SNL reply"));
+  res = llc_service_sdp_snl(llc_link, pdu, &offset, buffer, 10);
+  cut_assert_equal_int(0, res, cut_message("Nothing left to answer"));
+
+  offset = 0;
+  res = llc_service_sdp_snl(llc_link, pdu, &offset, buffer, 5);
+  cut_assert_equal_int(-1, res, cut_message("No room for any answer"));
+
+  pdu_free(pdu);
+}
+
+void
+test_llc_service_sdp_snl_malformed(void)
+{
+  uint8_t buffer[BUFSIZ];
+
+  uint8_t empty_snl_pdu[] = { 0x06, 0x41 };
+  struct pdu *pdu = pdu_unpack(empty_snl_pdu, sizeof(empty_snl_pdu));
+  size_t offset = 0;
+  int res = llc_service_sdp_snl(llc_link, pdu, &offset, buffer, sizeof(buffer));
+  cut_assert_equal_int(0, res, cut_message("Nothing to answer"));
+  pdu_free(pdu);
+
+  uint8_t truncated_snl_pdu[] = { 0x06, 0x41, 0x08, 0x10, 0x01, 'u', 'r', 'n' };
+  pdu = pdu_unpack(truncated_snl_pdu, sizeof(truncated_snl_pdu));
+  offset = 0;
+  res = llc_service_sdp_snl(llc_link, pdu, &offset, buffer, sizeof(buffer));
+  cut_assert_equal_int(-1, res, cut_message("Truncated SDREQ accepted"));
+  pdu_free(pdu);
+}
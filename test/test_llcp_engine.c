@@ -0,0 +1,302 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <cutter.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "llc_connection.h"
+#include "llc_link.h"
+#include "llc_service.h"
+#include "llcp_engine.h"
+
+#define LINKS 4
+
+void
+cut_setup(void)
+{
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+}
+
+void
+cut_teardown(void)
+{
+  llcp_fini();
+}
+
+void
+test_llcp_engine_links(void)
+{
+  struct llcp_engine *engine;
+  struct llc_link *links[LINKS];
+  struct llcp_engine_stats stats;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  int res;
+
+  engine = llcp_engine_new(2);
+  cut_assert_not_null(engine, cut_message("llcp_engine_new()"));
+  cut_assert_equal_int(2, llcp_engine_workers(engine), cut_message("Wrong number of workers"));
+
+  res = llcp_engine_start(engine);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_start()"));
+
+  for (int i = 0; i < LINKS; i++) {
+    links[i] = llc_link_new();
+    cut_assert_not_null(links[i], cut_message("llc_link_new()"));
+
+    res = llcp_engine_link_activate(engine, links[i], LLC_INITIATOR, NULL, 0);
+    cut_assert_equal_int(0, res, cut_message("llcp_engine_link_activate()"));
+    cut_assert_null((void *) links[i]->thread, cut_message("The link should not have its own thread"));
+  }
+
+  /* Each link answers a PAX PDU from the remote LLC */
+  for (int i = 0; i < LINKS; i++) {
+    uint8_t pax_request[] = { 0x00, 0x40, 0x04, 0x01, (uint8_t)(i + 1) };
+    res = mq_send(links[i]->llc_up, (char *) pax_request, sizeof(pax_request), 0);
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+
+  for (int i = 0; i < LINKS; i++) {
+    res = mq_receive(links[i]->llc_down, buffer, sizeof(buffer), NULL);
+    cut_assert_operator_int(res, >, 2, cut_message("mq_receive()"));
+    cut_assert_equal_int(0x40, (uint8_t) buffer[1], cut_message("PAX PDU expected"));
+    cut_assert_equal_int((i + 1) * 10000, links[i]->remote_lto.tv_usec, cut_message("Wrong remote LTO"));
+  }
+
+  /* Links are spread among workers */
+  uint64_t pdus = 0;
+  for (size_t w = 0; w < 2; w++) {
+    res = llcp_engine_get_stats(engine, w, &stats);
+    cut_assert_equal_int(0, res, cut_message("llcp_engine_get_stats()"));
+    cut_assert_equal_int(LINKS / 2, stats.links, cut_message("Unbalanced workers"));
+    pdus += stats.pdus;
+  }
+  cut_assert_equal_int(LINKS, (int) pdus, cut_message("Wrong number of processed PDUs"));
+  res = llcp_engine_get_stats(engine, 2, &stats);
+  cut_assert_equal_int(-1, res, cut_message("No such worker"));
+
+  /* A DISC PDU disconnects the link from its worker */
+  uint8_t disc[] = { 0x01, 0x40 };
+  res = mq_send(links[0]->llc_up, (char *) disc, sizeof(disc), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 1000) && (links[0]->status != LL_DEACTIVATED); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(LL_DEACTIVATED, links[0]->status, cut_message("Link should be deactivated"));
+
+  for (int i = 0; i < LINKS; i++) {
+    llcp_engine_link_deactivate(engine, links[i]);
+    llc_link_free(links[i]);
+  }
+
+  for (size_t w = 0; w < 2; w++) {
+    llcp_engine_get_stats(engine, w, &stats);
+    cut_assert_equal_int(0, stats.links, cut_message("Worker should run no link"));
+  }
+
+  llcp_engine_free(engine);
+}
+
+void
+test_llcp_engine_slow_mac(void)
+{
+  struct llcp_engine *engine;
+  struct llc_link *links[2];
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec timeout;
+  int res;
+
+  engine = llcp_engine_new(1);
+  cut_assert_not_null(engine, cut_message("llcp_engine_new()"));
+  res = llcp_engine_start(engine);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_start()"));
+
+  for (int i = 0; i < 2; i++) {
+    links[i] = llc_link_new();
+    cut_assert_not_null(links[i], cut_message("llc_link_new()"));
+    res = llcp_engine_link_activate(engine, links[i], LLC_INITIATOR, NULL, 0);
+    cut_assert_equal_int(0, res, cut_message("llcp_engine_link_activate()"));
+  }
+
+  /* CONNECT to an unbound SAP, answered with a DM PDU */
+  uint8_t connect[] = { 0x51, 0x20 };
+  uint8_t expected_dm[] = { 0x81, 0xD4, 0x02 };
+
+  /* The MAC layer of the first link does not read the answers */
+  for (int i = 0; i < 3; i++) {
+    while (((res = mq_send(links[0]->llc_up, (char *) connect, sizeof(connect), 0)) < 0) && (errno == EAGAIN))
+      sched_yield();
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+
+  /* ... which does not hold back the other link */
+  res = mq_send(links[1]->llc_up, (char *) connect, sizeof(connect), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec++;
+  res = mq_timedreceive(links[1]->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  cut_assert_equal_memory(expected_dm, sizeof(expected_dm), buffer, res, cut_message("DM PDU expected"));
+
+  /* The remaining CONNECT PDUs are handled as the DM PDUs are read */
+  for (int i = 0; i < 3; i++) {
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec++;
+    res = mq_timedreceive(links[0]->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+    cut_assert_equal_memory(expected_dm, sizeof(expected_dm), buffer, res, cut_message("DM PDU expected"));
+  }
+
+  for (int i = 0; i < 2; i++) {
+    llcp_engine_link_deactivate(engine, links[i]);
+    llc_link_free(links[i]);
+  }
+  llcp_engine_free(engine);
+}
+
+void
+test_llcp_engine_agf_replies(void)
+{
+  struct llcp_engine *engine;
+  struct llc_link *link;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec timeout;
+  int res;
+
+  engine = llcp_engine_new(1);
+  cut_assert_not_null(engine, cut_message("llcp_engine_new()"));
+  res = llcp_engine_start(engine);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_start()"));
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  res = llcp_engine_link_activate(engine, link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_link_activate()"));
+
+  /* Four PAX PDUs call for more replies than the down queue holds */
+  uint8_t agf[2 + 4 * 7] = { 0x00, 0x80 };
+  for (int i = 0; i < 4; i++) {
+    uint8_t pax[] = { 0x00, 0x05, 0x00, 0x40, 0x04, 0x01, (uint8_t)(i + 1) };
+    memcpy(agf + 2 + i * sizeof(pax), pax, sizeof(pax));
+  }
+  res = mq_send(link->llc_up, (char *) agf, sizeof(agf), 0);
+  cut_assert_equal_int(0, res, cut_message("mq_send()"));
+
+  /* The replies that did not fit go out on the next turns */
+  uint8_t symm[] = { 0x00, 0x00 };
+  for (int i = 0; i < 4; i++) {
+    if (i == 2) {
+      res = mq_send(link->llc_up, (char *) symm, sizeof(symm), 0);
+      cut_assert_equal_int(0, res, cut_message("mq_send()"));
+    }
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec++;
+    res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+    cut_assert_operator_int(res, >, 2, cut_message("Reply %d lost", i));
+    cut_assert_equal_int(0x40, (uint8_t) buffer[1], cut_message("PAX PDU expected"));
+  }
+
+  llcp_engine_link_deactivate(engine, link);
+  llc_link_free(link);
+  llcp_engine_free(engine);
+}
+
+static void *
+idle_service(void *arg)
+{
+  (void) arg;
+  return NULL;
+}
+
+void
+test_llcp_engine_receive_overrun(void)
+{
+  struct llcp_engine *engine;
+  struct llc_link *link;
+  struct llc_connection *connection;
+  char buffer[LLCP_MAX_PDU_SIZE];
+  struct timespec timeout;
+  int res;
+
+  engine = llcp_engine_new(1);
+  cut_assert_not_null(engine, cut_message("llcp_engine_new()"));
+  res = llcp_engine_start(engine);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_start()"));
+
+  link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  struct llc_service *service = llc_service_new(NULL, idle_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  res = llc_link_service_bind(link, service, 17);
+  cut_assert_equal_int(17, res, cut_message("llc_link_service_bind()"));
+  res = llcp_engine_link_activate(engine, link, LLC_INITIATOR, NULL, 0);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_link_activate()"));
+
+  connection = llc_outgoing_data_link_connection_new(link, 17, 32);
+  cut_assert_not_null(connection, cut_message("llc_outgoing_data_link_connection_new()"));
+  connection->status = DLC_CONNECTED;
+  struct mq_attr attr;
+  mq_getattr(connection->llc_up, &attr);
+  int high_watermark = connection->high_watermark;
+  int capacity = attr.mq_maxmsg;
+
+  /* Nobody reads the connection: it gets busy at its high watermark... */
+  uint8_t i_pdu[] = { 0x47, 0x20, 0x00, 'x' };
+  for (int i = 0; i < high_watermark; i++) {
+    i_pdu[2] = i << 4;
+    while (((res = mq_send(link->llc_up, (char *) i_pdu, sizeof(i_pdu), 0)) < 0) && (errno == EAGAIN))
+      sched_yield();
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+  uint8_t expected_rnr[] = { 0x83, 0x91, (uint8_t) high_watermark };
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec++;
+  res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  cut_assert_equal_memory(expected_rnr, sizeof(expected_rnr), buffer, res, cut_message("RNR PDU expected"));
+
+  /* ... and a remote LLC ignoring it is rejected rather than blocking the worker */
+  for (int i = high_watermark; i <= capacity; i++) {
+    i_pdu[2] = i << 4;
+    while (((res = mq_send(link->llc_up, (char *) i_pdu, sizeof(i_pdu), 0)) < 0) && (errno == EAGAIN))
+      sched_yield();
+    cut_assert_equal_int(0, res, cut_message("mq_send()"));
+  }
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec++;
+  res = mq_timedreceive(link->llc_down, buffer, sizeof(buffer), NULL, &timeout);
+  cut_assert_equal_int(6, res, cut_message("FRMR PDU expected"));
+  cut_assert_equal_int(0x82, (uint8_t) buffer[0], cut_message("Wrong DSAP"));
+  cut_assert_equal_int(0x11, (uint8_t) buffer[1], cut_message("Wrong PTYPE/SSAP"));
+  cut_assert_equal_int(FRMR_S, (uint8_t) buffer[2] & FRMR_S, cut_message("Invalid N(S) expected"));
+  cut_assert_equal_int(capacity, connection->state.r, cut_message("The rejected I PDU should not be received"));
+
+  llcp_engine_link_deactivate(engine, link);
+  llc_link_free(link);
+  llcp_engine_free(engine);
+}
@@ -23,6 +23,7 @@
 
 #include <cutter.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "llcp_parameters.h"
 
@@ -207,15 +208,26 @@ test_llcp_parameter_sdreq(void)
   cut_assert_equal_int(17, res, cut_message("Invalid packed length"));
   cut_assert_equal_memory(buffer, res, buffer2, sizeof(buffer2), cut_message("Wrong data"));
 
-  char *the_uri;
+  char the_uri[BUFSIZ];
   tid = 0;
-  res = parameter_decode_sdreq(buffer, 17, &tid, &the_uri);
+  res = parameter_decode_sdreq(buffer, 17, &tid, the_uri, sizeof(the_uri));
   cut_assert_equal_int(0, res, cut_message("parameter_decode_sdreq() failed"));
   cut_assert_equal_int(42, tid, cut_message("Wrong TID"));
   cut_assert_equal_string(uri, the_uri, cut_message("Wrong URI"));
 
-  free(the_uri);
-
+  res = parameter_decode_sdreq(buffer, 17, &tid, the_uri, 14);
+  cut_assert_equal_int(-1, res, cut_message("parameter_decode_sdreq() should fail"));
+
+  /* The TLV length byte also counts the TID */
+  char long_uri[256];
+  memset(long_uri, 'a', 255);
+  long_uri[255] = '\0';
+  res = parameter_encode_sdreq(buffer, sizeof(buffer), tid, long_uri);
+  cut_assert_equal_int(-1, res, cut_message("Service name longer than 254 bytes encoded"));
+  long_uri[254] = '\0';
+  res = parameter_encode_sdreq(buffer, sizeof(buffer), tid, long_uri);
+  cut_assert_equal_int(257, res, cut_message("Invalid packed length"));
+  cut_assert_equal_int(255, buffer[1], cut_message("Wrong SDREQ length"));
 }
 
 void
@@ -241,3 +253,82 @@ test_llcp_parameter_sdres(void)
   cut_assert_equal_int(42, tid, cut_message("Wrong TID"));
   cut_assert_equal_int(12, sap, cut_message("Wrong SAP"));
 }
+
+void
+test_llcp_parameters_decode(void)
+{
+  uint8_t buffer[] = {
+    0x01, 0x01, 0x11,
+    0x02, 0x02, 0x01, 0x23,
+    0x03, 0x02, 0x12, 0x35,
+    0x04, 0x01, 0x64,
+    0x05, 0x01, 0x04,
+    0x06, 0x03, 'f', 'o', 'o',
+    0x07, 0x01, 0x02,
+    0x42, 0x02, 0xde, 0xad,
+  };
+  struct llcp_parameters parameters;
+
+  int res = parameters_decode(buffer, sizeof(buffer), &parameters);
+  cut_assert_equal_int(0, res, cut_message("parameters_decode() failed"));
+  cut_assert_equal_int(0xFE, parameters.present, cut_message("Wrong present parameters"));
+  cut_assert_equal_int(1, parameters.version.major, cut_message("Wrong major version"));
+  cut_assert_equal_int(1, parameters.version.minor, cut_message("Wrong minor version"));
+  cut_assert_equal_int(0x0123, parameters.miux, cut_message("Wrong MIUX"));
+  cut_assert_equal_int(0x1235, parameters.wks, cut_message("Wrong WKS"));
+  cut_assert_equal_int(0x64, parameters.lto, cut_message("Wrong LTO"));
+  cut_assert_equal_int(0x04, parameters.rw, cut_message("Wrong RW"));
+  cut_assert_equal_memory("foo", 3, parameters.sn, parameters.sn_len, cut_message("Wrong SN"));
+  cut_assert_equal_int(0x02, parameters.opt, cut_message("Wrong OPT"));
+
+  uint8_t encoded[BUFSIZ];
+  cut_assert_equal_int(sizeof(buffer) - 4, parameters_size(&parameters), cut_message("Wrong parameters size"));
+  res = parameters_encode(encoded, sizeof(encoded), &parameters);
+  cut_assert_equal_int(sizeof(buffer) - 4, res, cut_message("parameters_encode() failed"));
+  cut_assert_equal_memory(buffer, sizeof(buffer) - 4, encoded, res, cut_message("Wrong encoded parameters"));
+
+  res = parameters_encode(encoded, sizeof(buffer) - 5, &parameters);
+  cut_assert_equal_int(-1, res, cut_message("parameters_encode() should fail"));
+
+  parameters.rw = 0x10;
+  res = parameters_encode(encoded, sizeof(encoded), &parameters);
+  cut_assert_equal_int(-1, res, cut_message("Invalid RW encoded"));
+}
+
+void
+test_llcp_parameters_decode_malformed(void)
+{
+  struct llcp_parameters parameters;
+
+  uint8_t invalid_length[] = { 0x02, 0x01, 0x01 };
+  cut_assert_equal_int(-1, parameters_decode(invalid_length, sizeof(invalid_length), &parameters), cut_message("Invalid MIUX length accepted"));
+
+  uint8_t valid[] = { 0x01, 0x01, 0x11, 0x06, 0x03, 'f', 'o', 'o', 0x04, 0x01, 0x64 };
+  for (size_t len = 0; len <= sizeof(valid); len++) {
+    int expected = ((len == 0) || (len == 3) || (len == 8) || (len == sizeof(valid))) ? 0 : -1;
+    cut_assert_equal_int(expected, parameters_decode(valid, len, &parameters), cut_message("Truncated at %d bytes", (int) len));
+  }
+
+  /* Random garbage must be either rejected or decoded within bounds */
+  uint32_t seed = 0x4c4c4350;
+  uint8_t buffer[64];
+  for (int i = 0; i < 10000; i++) {
+    size_t len = 0;
+    seed = seed * 1103515245 + 12345;
+    len = (seed >> 16) % sizeof(buffer);
+    for (size_t j = 0; j < len; j++) {
+      seed = seed * 1103515245 + 12345;
+      buffer[j] = seed >> 16;
+      /* Favor small types and lengths so that some lists are valid */
+      if (!(j % 3))
+        buffer[j] &= 0x07;
+    }
+    if (parameters_decode(buffer, len, &parameters) == 0) {
+      if (parameters.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_SN)) {
+        cut_assert_true(parameters.sn >= buffer, cut_message("SN out of bounds"));
+        cut_assert_true(parameters.sn + parameters.sn_len <= buffer + len, cut_message("SN out of bounds"));
+      }
+      cut_assert_true(parameters.miux <= 0x07FF || !(parameters.present & LLCP_PARAMETER_BIT(LLCP_PARAMETER_MIUX)), cut_message("Invalid MIUX"));
+    }
+  }
+}
@@ -23,10 +23,12 @@
 
 #include <cutter.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "llcp.h"
 #include "llcp_pdu.h"
+#include "llcp_pool.h"
 
 struct pdu *sample_i_pdu;
 uint8_t sample_i_pdu_packed[] = { 0x23, 0x02, 0x53,
@@ -72,6 +74,8 @@ cut_setup()
 void
 cut_teardown(void)
 {
+  llcp_set_allocator(NULL);
+
   pdu_free(sample_a_pdu);
   pdu_free(sample_i_pdu);
 
@@ -107,6 +111,29 @@ test_llcp_pdu_unpack(void)
   pdu_free(pdu);
 }
 
+void
+test_llcp_pdu_unpack_view(void)
+{
+  struct pdu pdu;
+  int res;
+
+  res = pdu_unpack_view(sample_i_pdu_packed, sizeof(sample_i_pdu_packed), &pdu);
+  cut_assert_equal_int(0, res, cut_message("pdu_unpack_view()"));
+
+  cut_assert_equal_int(sample_i_pdu->ssap, pdu.ssap, cut_message("Wrong SSAP"));
+  cut_assert_equal_int(sample_i_pdu->dsap, pdu.dsap, cut_message("Wrong SDAP"));
+  cut_assert_equal_int(sample_i_pdu->ptype, pdu.ptype, cut_message("Wrong PTYPE"));
+  cut_assert_equal_int(sample_i_pdu->ns, pdu.ns, cut_message("Wrong N(S)"));
+  cut_assert_equal_int(sample_i_pdu->nr, pdu.nr, cut_message("Wrong N(R)"));
+  cut_assert_equal_int(sample_i_pdu->information_size, pdu.information_size, cut_message("Wrong information size"));
+  cut_assert_true(pdu.information == sample_i_pdu_packed + 3, cut_message("Information should not be copied"));
+
+  res = pdu_unpack_view(sample_i_pdu_packed, 2, &pdu);
+  cut_assert_equal_int(-1, res, cut_message("I PDU without sequence field"));
+  res = pdu_unpack_view(sample_i_pdu_packed, 1, &pdu);
+  cut_assert_equal_int(-1, res, cut_message("Truncated PDU"));
+}
+
 void
 test_llcp_pdu_size(void)
 {
@@ -174,5 +201,87 @@ test_llcp_pdu_dispatch(void)
     p++;
   }
 
-  free(pdus);
+  llcp_free(pdus);
+}
+
+struct counting_allocator {
+  size_t allocations;
+  size_t releases;
+};
+
+/* Outlives the test: cut_teardown() restores the default allocator */
+static struct counting_allocator counts;
+
+static void *
+counting_allocate(void *context, size_t size)
+{
+  ((struct counting_allocator *) context)->allocations++;
+  return malloc(size);
+}
+
+static void
+counting_release(void *context, void *ptr)
+{
+  ((struct counting_allocator *) context)->releases++;
+  free(ptr);
+}
+
+void
+test_llcp_set_allocator(void)
+{
+  counts.allocations = counts.releases = 0;
+  struct llcp_allocator allocator = {
+    .allocate = counting_allocate,
+    .release = counting_release,
+    .context = &counts,
+  };
+
+  llcp_set_allocator(&allocator);
+  llcp_allocation_reset();
+
+  struct pdu **pdus = pdu_dispatch(sample_a_pdu);
+  cut_assert_not_null(pdus, cut_message("pdu_dispatch()"));
+  cut_assert_not_equal_int(0, counts.allocations, cut_message("Allocation not routed to the allocator"));
+  for (struct pdu **p = pdus; *p; p++)
+    pdu_free(*p);
+  llcp_free(pdus);
+  cut_assert_equal_int(counts.allocations, counts.releases, cut_message("Memory not released to the allocator"));
+
+#if defined(DEBUG)
+  struct llcp_allocation_site sites[65];
+  size_t count = llcp_allocation_sites(sites, 65);
+  size_t allocations = 0;
+  for (size_t i = 0; i < count && i < 65; i++)
+    allocations += sites[i].allocations;
+  cut_assert_equal_int(counts.allocations, allocations, cut_message("Wrong allocation accounting"));
+#endif
+
+  llcp_set_allocator(NULL);
+  size_t allocations_before = counts.allocations;
+  pdus = pdu_dispatch(sample_a_pdu);
+  for (struct pdu **p = pdus; *p; p++)
+    pdu_free(*p);
+  llcp_free(pdus);
+  cut_assert_equal_int(allocations_before, counts.allocations, cut_message("Default allocator not restored"));
+}
+
+void
+test_llcp_allocation_sites_overflow(void)
+{
+#if defined(DEBUG)
+  /* Fill the 64 entries of the site table, and then some */
+  llcp_allocation_reset();
+  for (int line = 1; line <= 64 + 8; line++)
+    llcp_free(llcp_malloc_at(1, "overflow", line));
+
+  struct llcp_allocation_site sites[65];
+  size_t count = llcp_allocation_sites(sites, 65);
+  cut_assert_equal_int(65, count, cut_message("Wrong number of allocation sites"));
+  cut_assert_equal_string("(other)", sites[64].file, cut_message("Missing (other) site"));
+  cut_assert_true(sites[64].allocations >= 8, cut_message("Unknown sites not accounted"));
+  for (size_t i = 0; i < 64; i++) {
+    if (0 == strcmp(sites[i].file, "overflow"))
+      cut_assert_equal_int(1, sites[i].allocations, cut_message("Wrong accounting for line %d", sites[i].line));
+  }
+#endif
 }
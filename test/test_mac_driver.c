@@ -0,0 +1,485 @@
+/*-
+ * Copyright (C) 2011, Romain Tartière
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <cutter.h>
+#include <poll.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "llc_connection.h"
+#include "llc_link.h"
+#include "llc_service.h"
+#include "llcp_engine.h"
+#include "mac.h"
+
+/*
+ * Loopback MAC driver: both ends of a socket pair are MAC links.
+ */
+
+static ssize_t
+loopback_read(struct mac_link *link, uint8_t *buf, size_t len, int timeout)
+{
+  struct pollfd pfd = {
+    .fd = *(int *) link->device,
+    .events = POLLIN,
+  };
+
+  if (poll(&pfd, 1, timeout) <= 0)
+    return -1;
+  ssize_t res = recv(pfd.fd, buf, len, 0);
+  return (res <= 0) ? -1 : res;
+}
+
+static ssize_t
+loopback_send(struct mac_link *link, const uint8_t *buf, size_t len, int timeout)
+{
+  (void) timeout;
+  return send(*(int *) link->device, buf, len, MSG_NOSIGNAL);
+}
+
+static int
+loopback_initiator_activate(struct mac_link *link, const uint8_t *gb, size_t gb_len, uint8_t *remote_gb, size_t remote_gb_len, int timeout)
+{
+  if (loopback_send(link, gb, gb_len, timeout) < 0)
+    return -1;
+  return loopback_read(link, remote_gb, remote_gb_len, timeout);
+}
+
+static int
+loopback_target_activate(struct mac_link *link, const uint8_t *gb, size_t gb_len, uint8_t *remote_gb, size_t remote_gb_len, int timeout)
+{
+  ssize_t res = loopback_read(link, remote_gb, remote_gb_len, timeout);
+  if ((res < 0) || (loopback_send(link, gb, gb_len, timeout) < 0))
+    return -1;
+  return res;
+}
+
+static ssize_t
+loopback_transceive(struct mac_link *link, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout)
+{
+  if (loopback_send(link, tx, tx_len, timeout) < 0)
+    return -1;
+  return loopback_read(link, rx, rx_len, timeout);
+}
+
+static int
+loopback_deactivate(struct mac_link *link)
+{
+  return shutdown(*(int *) link->device, SHUT_RDWR);
+}
+
+static int
+loopback_link_lost(struct mac_link *link)
+{
+  (void) link;
+  return 1;
+}
+
+static const struct mac_driver loopback_driver = {
+  .name               = "loopback",
+  .initiator_activate = loopback_initiator_activate,
+  .target_activate    = loopback_target_activate,
+  .transceive         = loopback_transceive,
+  .send               = loopback_send,
+  .receive            = loopback_read,
+  .deactivate         = loopback_deactivate,
+  .link_lost          = loopback_link_lost,
+  .get_timeouts       = NULL,
+};
+
+void
+cut_setup(void)
+{
+  if (llcp_init())
+    cut_fail("llcp_init() failed");
+}
+
+void
+cut_teardown(void)
+{
+  llcp_fini();
+}
+
+static void *
+target_thread(void *arg)
+{
+  return (void *)(intptr_t) mac_link_activate_as_target((struct mac_link *) arg);
+}
+
+/*
+ * Run a session between two MAC links.  A non-zero priority asks for
+ * SCHED_FIFO MAC Link threads, which fall back to the default policy when
+ * they are not allowed to use it.
+ */
+static void
+loopback_session(FILE *record, int priority)
+{
+  int fds[2];
+  int res;
+
+  res = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+  cut_assert_equal_int(0, res, cut_message("socketpair()"));
+
+  struct llc_link *initiator = llc_link_new();
+  struct llc_link *target = llc_link_new();
+  cut_assert_not_null(initiator, cut_message("llc_link_new()"));
+  cut_assert_not_null(target, cut_message("llc_link_new()"));
+
+  /* Set directly: llc_link_set_thread_attributes() rejects invalid priorities */
+  initiator->thread_attributes.priority = priority;
+  target->thread_attributes.priority = priority;
+
+  res = llc_link_set_miu(target, 512);
+  cut_assert_equal_int(0, res, cut_message("llc_link_set_miu()"));
+
+  struct mac_link *initiator_mac = mac_link_new_with_driver(&loopback_driver, &fds[0], initiator);
+  struct mac_link *target_mac = mac_link_new_with_driver(&loopback_driver, &fds[1], target);
+  cut_assert_not_null(initiator_mac, cut_message("mac_link_new_with_driver()"));
+  cut_assert_not_null(target_mac, cut_message("mac_link_new_with_driver()"));
+  cut_assert_equal_int(MAC_LINK_TARGET_SLOT, target_mac->schedule.target_slot, cut_message("Wrong default slot"));
+  if (record) {
+    res = mac_link_record(initiator_mac, record);
+    cut_assert_equal_int(0, res, cut_message("mac_link_record()"));
+  }
+
+  pthread_t thread;
+  res = pthread_create(&thread, NULL, target_thread, target_mac);
+  cut_assert_equal_int(0, res, cut_message("pthread_create()"));
+
+  res = mac_link_activate_as_initiator(initiator_mac);
+  cut_assert_equal_int(1, res, cut_message("mac_link_activate_as_initiator()"));
+
+  void *target_res;
+  pthread_join(thread, &target_res);
+  cut_assert_equal_int(1, (intptr_t) target_res, cut_message("mac_link_activate_as_target()"));
+
+  cut_assert_equal_int(LL_ACTIVATED, initiator->status, cut_message("Initiator LLC Link not activated"));
+  cut_assert_equal_int(LL_ACTIVATED, target->status, cut_message("Target LLC Link not activated"));
+  cut_assert_equal_int(LLC_INITIATOR, initiator->role, cut_message("Wrong initiator role"));
+  cut_assert_equal_int(LLC_TARGET, target->role, cut_message("Wrong target role"));
+  cut_assert_equal_int(512, initiator->remote_miu, cut_message("Parameters not exchanged"));
+
+  if (priority) {
+    int policy;
+    struct sched_param param;
+    res = pthread_getschedparam(initiator_mac->exchange_pdus, &policy, &param);
+    cut_assert_equal_int(0, res, cut_message("pthread_getschedparam()"));
+    if (priority > sched_get_priority_max(SCHED_FIFO)) {
+      cut_assert_equal_int(SCHED_OTHER, policy, cut_message("Invalid SCHED_FIFO priority applied"));
+    } else {
+      cut_assert_true((SCHED_OTHER == policy) || ((SCHED_FIFO == policy) && (priority == param.sched_priority)),
+                      cut_message("Wrong MAC Link thread scheduling (policy %d, priority %d)", policy, param.sched_priority));
+    }
+  }
+
+  /* Let SYMM PDUs flow through the driver */
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 1000) && !(target_mac->timings.first_pdu.tv_sec || target_mac->timings.first_pdu.tv_nsec); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_true(target_mac->timings.first_pdu.tv_sec || target_mac->timings.first_pdu.tv_nsec, cut_message("No PDU exchanged"));
+
+  if (record) {
+    uint8_t data[] = { 'h', 'e', 'l', 'l', 'o' };
+    res = llc_link_send_data(target, 0x20, 0x20, data, sizeof(data));
+    cut_assert_equal_int(0, res, cut_message("llc_link_send_data()"));
+    delay.tv_nsec = 50000000;
+    nanosleep(&delay, NULL);
+  }
+
+  res = mac_link_deactivate(initiator_mac, MAC_DEACTIVATE_ON_REQUEST);
+  cut_assert_equal_int(0, res, cut_message("mac_link_deactivate()"));
+  mac_link_deactivate(target_mac, MAC_DEACTIVATE_ON_FAILURE);
+
+  llc_link_deactivate(initiator);
+  llc_link_deactivate(target);
+  mac_link_free(initiator_mac);
+  mac_link_free(target_mac);
+  llc_link_free(initiator);
+  llc_link_free(target);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void
+test_mac_driver_loopback(void)
+{
+  loopback_session(NULL, 0);
+}
+
+/* Activate both ends and wait for the first PDU exchanged */
+static void
+loopback_activate(struct mac_link *initiator_mac, struct mac_link *target_mac)
+{
+  pthread_t thread;
+  int res;
+
+  res = pthread_create(&thread, NULL, target_thread, target_mac);
+  cut_assert_equal_int(0, res, cut_message("pthread_create()"));
+
+  res = mac_link_activate_as_initiator(initiator_mac);
+  cut_assert_equal_int(1, res, cut_message("mac_link_activate_as_initiator()"));
+
+  void *target_res;
+  pthread_join(thread, &target_res);
+  cut_assert_equal_int(1, (intptr_t) target_res, cut_message("mac_link_activate_as_target()"));
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 1000) && !(target_mac->timings.first_pdu.tv_sec || target_mac->timings.first_pdu.tv_nsec); i++)
+    nanosleep(&delay, NULL);
+  cut_assert_true(target_mac->timings.first_pdu.tv_sec || target_mac->timings.first_pdu.tv_nsec, cut_message("No PDU exchanged"));
+}
+
+void
+test_mac_driver_recycle(void)
+{
+  int fds[2];
+  int res;
+
+  res = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+  cut_assert_equal_int(0, res, cut_message("socketpair()"));
+
+  struct llc_link *initiator = llc_link_new();
+  struct llc_link *target = llc_link_new();
+  cut_assert_not_null(initiator, cut_message("llc_link_new()"));
+  cut_assert_not_null(target, cut_message("llc_link_new()"));
+
+  struct mac_link *initiator_mac = mac_link_new_with_driver(&loopback_driver, &fds[0], initiator);
+  struct mac_link *target_mac = mac_link_new_with_driver(&loopback_driver, &fds[1], target);
+  cut_assert_not_null(initiator_mac, cut_message("mac_link_new_with_driver()"));
+  cut_assert_not_null(target_mac, cut_message("mac_link_new_with_driver()"));
+
+  loopback_activate(initiator_mac, target_mac);
+  pthread_t initiator_llc_thread = initiator->thread;
+  pthread_t target_llc_thread = target->thread;
+
+  for (int session = 0; session < 3; session++) {
+    res = llc_link_recycle(initiator);
+    cut_assert_equal_int(0, res, cut_message("llc_link_recycle()"));
+    res = llc_link_recycle(target);
+    cut_assert_equal_int(0, res, cut_message("llc_link_recycle()"));
+    cut_assert_equal_int(LL_DEACTIVATED, initiator->status, cut_message("Initiator LLC Link still activated"));
+    cut_assert_true(initiator->mac_link == initiator_mac, cut_message("The MAC Link was detached"));
+    cut_assert_true(target->mac_link == target_mac, cut_message("The MAC Link was detached"));
+
+    /* The loopback driver shuts its socket down on deactivation */
+    close(fds[0]);
+    close(fds[1]);
+    res = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+    cut_assert_equal_int(0, res, cut_message("socketpair()"));
+
+    loopback_activate(initiator_mac, target_mac);
+    cut_assert_equal_int(LL_ACTIVATED, initiator->status, cut_message("Initiator LLC Link not activated"));
+    cut_assert_equal_int(LL_ACTIVATED, target->status, cut_message("Target LLC Link not activated"));
+    cut_assert_true(pthread_equal(initiator_llc_thread, initiator->thread), cut_message("The LLC Link thread was restarted"));
+    cut_assert_true(pthread_equal(target_llc_thread, target->thread), cut_message("The LLC Link thread was restarted"));
+  }
+
+  res = mac_link_deactivate(initiator_mac, MAC_DEACTIVATE_ON_REQUEST);
+  cut_assert_equal_int(0, res, cut_message("mac_link_deactivate()"));
+  mac_link_deactivate(target_mac, MAC_DEACTIVATE_ON_FAILURE);
+
+  llc_link_deactivate(initiator);
+  llc_link_deactivate(target);
+  mac_link_free(initiator_mac);
+  mac_link_free(target_mac);
+  llc_link_free(initiator);
+  llc_link_free(target);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static volatile int datagrams;
+
+static void *
+datagram_service(void *arg)
+{
+  struct llc_connection *connection = (struct llc_connection *) arg;
+  uint8_t buffer[1024];
+  uint8_t ssap;
+
+  while (llc_connection_recv(connection, buffer, sizeof(buffer), &ssap) > 0)
+    datagrams++;
+
+  return NULL;
+}
+
+void
+test_mac_driver_engine(void)
+{
+  struct llcp_engine *engine;
+  struct llcp_engine_stats stats;
+  int fds[2];
+  int res;
+
+  engine = llcp_engine_new(1);
+  cut_assert_not_null(engine, cut_message("llcp_engine_new()"));
+  res = llcp_engine_start(engine);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_start()"));
+
+  res = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+  cut_assert_equal_int(0, res, cut_message("socketpair()"));
+
+  struct llc_link *initiator = llc_link_new();
+  struct llc_link *target = llc_link_new();
+  cut_assert_not_null(initiator, cut_message("llc_link_new()"));
+  cut_assert_not_null(target, cut_message("llc_link_new()"));
+
+  struct llc_service *service = llc_service_new(NULL, datagram_service, NULL);
+  cut_assert_not_null(service, cut_message("llc_service_new()"));
+  res = llc_link_service_bind(initiator, service, 16);
+  cut_assert_equal_int(16, res, cut_message("llc_link_service_bind()"));
+
+  struct mac_link *initiator_mac = mac_link_new_with_driver(&loopback_driver, &fds[0], initiator);
+  struct mac_link *target_mac = mac_link_new_with_driver(&loopback_driver, &fds[1], target);
+  cut_assert_not_null(initiator_mac, cut_message("mac_link_new_with_driver()"));
+  cut_assert_not_null(target_mac, cut_message("mac_link_new_with_driver()"));
+  mac_link_set_engine(initiator_mac, engine);
+  mac_link_set_engine(target_mac, engine);
+
+  loopback_activate(initiator_mac, target_mac);
+  cut_assert_null((void *) initiator->thread, cut_message("The LLC Link should not have its own thread"));
+  cut_assert_null((void *) target->thread, cut_message("The LLC Link should not have its own thread"));
+
+  /* A UI PDU goes through both MAC Links and the engine worker */
+  datagrams = 0;
+  uint8_t data[] = { 'h', 'e', 'l', 'l', 'o' };
+  res = llc_link_send_data(target, 32, 16, data, sizeof(data));
+  cut_assert_equal_int(0, res, cut_message("llc_link_send_data()"));
+
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 3000) && !datagrams; i++)
+    nanosleep(&delay, NULL);
+  cut_assert_equal_int(1, datagrams, cut_message("Datagram not received"));
+
+  res = llcp_engine_get_stats(engine, 0, &stats);
+  cut_assert_equal_int(0, res, cut_message("llcp_engine_get_stats()"));
+  cut_assert_equal_int(2, stats.links, cut_message("Both LLC Links should run on the engine"));
+  cut_assert_operator_int(stats.pdus, >, 0, cut_message("No PDU processed by the engine"));
+
+  res = mac_link_deactivate(initiator_mac, MAC_DEACTIVATE_ON_REQUEST);
+  cut_assert_equal_int(0, res, cut_message("mac_link_deactivate()"));
+  mac_link_deactivate(target_mac, MAC_DEACTIVATE_ON_FAILURE);
+
+  llcp_engine_link_deactivate(engine, initiator);
+  llcp_engine_link_deactivate(engine, target);
+  mac_link_free(initiator_mac);
+  mac_link_free(target_mac);
+  llc_link_free(initiator);
+  llc_link_free(target);
+  close(fds[0]);
+  close(fds[1]);
+  llcp_engine_free(engine);
+}
+
+void
+test_mac_driver_sched_fifo_fallback(void)
+{
+  struct rlimit saved, limit;
+
+  /* Unprivileged processes are then not allowed to use SCHED_FIFO */
+  cut_assert_equal_int(0, getrlimit(RLIMIT_RTPRIO, &saved), cut_message("getrlimit()"));
+  limit.rlim_cur = 0;
+  limit.rlim_max = saved.rlim_max;
+  cut_assert_equal_int(0, setrlimit(RLIMIT_RTPRIO, &limit), cut_message("setrlimit()"));
+  loopback_session(NULL, 10);
+  setrlimit(RLIMIT_RTPRIO, &saved);
+
+  loopback_session(NULL, sched_get_priority_max(SCHED_FIFO) + 1);
+}
+
+static double
+replay(FILE *record, int flags, struct mac_replay_stats *stats)
+{
+  struct timespec start, end;
+
+  rewind(record);
+  struct mac_replay *replay = mac_replay_new(record, flags);
+  cut_assert_not_null(replay, cut_message("mac_replay_new()"));
+
+  struct llc_link *link = llc_link_new();
+  cut_assert_not_null(link, cut_message("llc_link_new()"));
+  struct mac_link *mac = mac_link_new_with_driver(&mac_replay_driver, replay, link);
+  cut_assert_not_null(mac, cut_message("mac_link_new_with_driver()"));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int res = mac_link_activate_as_initiator(mac);
+  cut_assert_equal_int(1, res, cut_message("mac_link_activate_as_initiator()"));
+  cut_assert_equal_int(512, link->remote_miu, cut_message("Parameters not replayed"));
+
+  /* The exchange thread stops at the end of the record */
+  struct timespec delay = {
+    .tv_sec = 0,
+    .tv_nsec = 1000000,
+  };
+  for (int i = 0; (i < 5000) && mac->exchange_pdus_thread; i++)
+    nanosleep(&delay, NULL);
+  cut_assert_null(mac->exchange_pdus_thread, cut_message("Replay did not end"));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  mac_replay_get_stats(replay, stats);
+
+  llc_link_deactivate(link);
+  mac_link_free(mac);
+  llc_link_free(link);
+  mac_replay_free(replay);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void
+test_mac_driver_replay(void)
+{
+  struct mac_replay_stats fast, timed;
+
+  FILE *record = tmpfile();
+  cut_assert_not_null(record, cut_message("tmpfile()"));
+
+  loopback_session(record, 0);
+  fflush(record);
+
+  replay(record, MAC_REPLAY_FAST, &fast);
+  cut_assert_operator_int(fast.frames, >, 0, cut_message("No frame replayed"));
+  cut_assert_equal_int(0, fast.mismatches, cut_message("The LLC Link did not answer as recorded"));
+
+  double elapsed = replay(record, MAC_REPLAY_TIMED, &timed);
+  cut_assert_equal_int(fast.frames, timed.frames, cut_message("Wrong number of frames"));
+  cut_assert_operator_int(elapsed * 1000, >=, 40, cut_message("Recorded timing not respected"));
+
+  fclose(record);
+}
@@ -111,6 +111,13 @@ initiator_thread(void *arg)
   res = mac_link_activate_as_initiator(link);
   cut_assert_equal_int(1, res, cut_message("mac_link_activate_as_initiator() failed"));
 
+  struct mac_link_timings timings;
+  mac_link_get_timings(link, &timings);
+  cut_assert_true(timings.start.tv_sec || timings.start.tv_nsec, cut_message("Activation start not recorded"));
+  cut_assert_true(timings.llc_activated.tv_sec || timings.llc_activated.tv_nsec, cut_message("LLC activation not recorded"));
+  cut_assert_operator_int(timings.dep.tv_sec, >=, timings.device_ready.tv_sec, cut_message("Phases out of order"));
+  cut_assert_operator_int(timings.llc_activated.tv_sec, >=, timings.dep.tv_sec, cut_message("Phases out of order"));
+
   printf("===== DEACTIVATE =====\n");
   mac_link_deactivate(link, MAC_DEACTIVATE_ON_REQUEST);
   mac_link_free(link);
@@ -144,3 +151,64 @@ test_mac_link(void)
   cut_assert_equal_int(0, result[INITIATOR], cut_message("Unexpected initiator return code"));
   cut_assert_equal_int(0, result[TARGET], cut_message("Unexpected target return code"));
 }
+
+void *
+scheduled_thread(void *arg)
+{
+  intptr_t res = 0;
+  struct test_thread_data *thread_data = (struct test_thread_data *) arg;
+
+  cut_set_current_test_context(thread_data->context);
+
+  struct llc_link *llc_link = llc_link_new();
+  cut_assert_not_null(llc_link, cut_message("llc_link_new() failed"));
+
+  struct mac_link *link = mac_link_new(thread_data->device, llc_link);
+  cut_assert_not_null(link, cut_message("mac_link_new() failed"));
+
+  res = mac_link_set_schedule(link, 500, 300, 30000);
+  cut_assert_equal_int(0, res, cut_message("mac_link_set_schedule() failed"));
+
+  res = mac_link_activate(link);
+  cut_assert_equal_int(1, res, cut_message("mac_link_activate() failed"));
+
+  struct mac_link_activation_stats stats;
+  mac_link_get_activation_stats(link, &stats);
+  cut_assert_equal_int(1, stats.activations, cut_message("Wrong activation count"));
+  cut_assert_operator_int(stats.slots, >, 0, cut_message("No slot recorded"));
+  cut_assert_operator_int(stats.last_us, >, 0, cut_message("No time to link recorded"));
+  printf("Linked as %s after %u slots (%ld ms)\n", (link->mode == MAC_LINK_INITIATOR) ? "initiator" : "target", stats.slots, stats.last_us / 1000);
+
+  sleep(1);
+
+  mac_link_deactivate(link, MAC_DEACTIVATE_ON_REQUEST);
+  mac_link_free(link);
+  llc_link_free(llc_link);
+  return (void *) res;
+}
+
+void
+test_mac_link_schedule(void)
+{
+  int res;
+
+  struct test_thread_data thread_data[2];
+
+  thread_data[INITIATOR].context = thread_data[TARGET].context = cut_get_current_test_context();
+  thread_data[INITIATOR].device = devices[INITIATOR];
+  thread_data[TARGET].device = devices[TARGET];
+
+  /* Both devices run the same schedule and have to settle on a mode */
+  for (int i = 0; i < 2; i++) {
+    if ((res = pthread_create(&(threads[i]), NULL, scheduled_thread, &thread_data[i])))
+      cut_fail("pthread_create() returned %d", res);
+  }
+
+  signal(SIGINT, abort_test_by_keypress);
+
+  for (int i = 0; i < 2; i++) {
+    if ((res = pthread_join(threads[i], (void *) &result[i])))
+      cut_fail("pthread_join() returned %d", res);
+    cut_assert_equal_int(1, result[i], cut_message("Unexpected return code"));
+  }
+}
@@ -39,10 +39,11 @@ connectionless_echo_server_thread(void *arg)
 
   uint8_t remote_sap;
   uint8_t buffer[1024];
+  int len;
 
-  int len = llc_connection_recv(connection, buffer, sizeof(buffer), &remote_sap);
-
-  llc_link_send_data(connection->link, connection->service_sap, remote_sap, buffer, len);
+  /* The Logical Data Link receives the UI PDUs of every remote SAP */
+  while ((len = llc_connection_recv(connection, buffer, sizeof(buffer), &remote_sap)) >= 0)
+    llc_link_send_data(connection->link, connection->service_sap, remote_sap, buffer, len);
 
   llc_connection_stop(connection);
   return NULL;